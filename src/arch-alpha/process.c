@@ -14,6 +14,7 @@
 
 #include "cryopid.h"
 #include "cpimage.h"
+#include "process.h"
 #include "list.h"
 
 struct registers {
@@ -25,62 +26,40 @@ static int process_was_stopped = 0;
 char* backup_page(pid_t target, void* addr)
 {
     long* page = xmalloc(PAGE_SIZE);
+    long* poison;
     int i;
-    long ret;
-    for(i = 0; i < PAGE_SIZE/sizeof(long); i++) {
-	errno = 0;
-	ret = ptrace(PTRACE_PEEKTEXT, target, (void*)((long)addr+(i*sizeof(long))), 0);
-	if (errno) {
-	    perror("ptrace(PTRACE_PEEKTEXT)");
-	    free(page);
-	    return NULL;
-	}
-	page[i] = ret;
-	if (ptrace(PTRACE_POKETEXT, target, (void*)((long)addr+(i*sizeof(long))), ARCH_POISON) == -1) {
-	    perror("ptrace(PTRACE_POKETEXT)");
-	    free(page);
-	    return NULL;
-	}
+
+    if (!mem_read_target(target, page, (unsigned long)addr, PAGE_SIZE)) {
+	free(page);
+	return NULL;
     }
 
+    poison = xmalloc(PAGE_SIZE);
+    for (i = 0; i < PAGE_SIZE/sizeof(long); i++)
+	poison[i] = ARCH_POISON;
+    if (!mem_write_target(target, (unsigned long)addr, poison, PAGE_SIZE)) {
+	free(poison);
+	free(page);
+	return NULL;
+    }
+    free(poison);
+
     return (char*)page;
 }
 
 int restore_page(pid_t target, void* addr, char* page)
 {
-    long *p = (long*)page;
-    int i;
+    int ret;
     assert(page);
-    for (i = 0; i < PAGE_SIZE/sizeof(long); i++) {
-	errno = 0;
-	if (ptrace(PTRACE_POKETEXT, target, (void*)((long)addr+(i*sizeof(long))), p[i]) == -1) {
-	    perror("ptrace(PTRACE_POKETEXT)");
-	    free(page);
-	    return 0;
-	}
-    }
+    ret = mem_write_target(target, (unsigned long)addr, page, PAGE_SIZE);
     free(page);
-    return 1;
+    return ret;
 }
 
 int memcpy_into_target(pid_t pid, void* dest, const void* src, size_t n)
 {
     /* just like memcpy, but copies it into the space of the target pid */
-    /* n must be a multiple of word size, or will otherwise be rounded down to
-     * be so */
-    int i;
-    long *d, *s;
-    d = (long*) dest;
-    s = (long*) src;
-    n /= sizeof(long);
-    for (i = 0; i < n; i++) {
-	errno = 0;
-	if (ptrace(PTRACE_POKETEXT, pid, d+i, s[i]) == -1) {
-	    perror("ptrace(PTRACE_POKETEXT)");
-	    return 0;
-	}
-    }
-    return 1;
+    return mem_write_target(pid, (unsigned long)dest, src, n);
 }
 
 int memcpy_from_target(pid_t pid, void* dest, const void* src, size_t n)
@@ -183,6 +162,7 @@ static void start_ptrace(pid_t pid)
 	perror("Failed to ptrace");
 	exit(1);
     }
+    stop_window_begin();
 
     if (process_was_stopped)
 	return; /* don't bother waiting for it, we'll just hang */
@@ -197,15 +177,24 @@ static void start_ptrace(pid_t pid)
     }
 }
 
-static void end_ptrace(pid_t pid)
+static void end_ptrace(pid_t pid, int flags)
 {
     long ret;
 
-    ret = ptrace(PTRACE_DETACH, pid, 0, 0);
-    if (ret == -1) {
-	perror("Failed to detach");
-	exit(1);
+    if (flags & KILL_ORIGINAL_PROCESS) {
+	ret = ptrace(PTRACE_KILL, pid, 0, 0);
+	if (ret == -1) {
+	    perror("Failed to kill the original process");
+	    exit(1);
+	}
+    } else {
+	ret = ptrace(PTRACE_DETACH, pid, 0, 0);
+	if (ret == -1) {
+	    perror("Failed to detach from the original process");
+	    exit(1);
+	}
     }
+    stop_window_end();
 }
 
 void get_process(pid_t pid, int flags, struct list *process_image, long *bin_offset)
@@ -214,6 +203,11 @@ void get_process(pid_t pid, int flags, struct list *process_image, long *bin_off
     char* pagebackup;
     struct registers r;
 
+    if (flags & FORK_SNAPSHOT) {
+	fprintf(stderr, "[-] Fork snapshots aren't supported on this architecture.\n");
+	exit(1);
+    }
+
     start_ptrace(pid);
 
     if (save_registers(pid, &r) < 0) {
@@ -243,11 +237,28 @@ void get_process(pid_t pid, int flags, struct list *process_image, long *bin_off
 
     restore_page(pid, (void*)scribble_zone, pagebackup);
     restore_registers(pid, &r);
+
+    /* The VMA data will be read while the image is written (or handed out
+     * by the page server after that), so leave the process stopped until
+     * release_process(). The checksums are read from there as well. */
+    if (success && (flags & (STREAM_VMA_DATA|SERVE_PAGES))) {
+	finish_chunks_vma();
+	return;
+    }
 out_ptrace:
-    end_ptrace(pid);
+    end_ptrace(pid, flags);
     
     if (!success)
 	abort();
+
+    /* The rest can wait until it's running again */
+    finish_chunks_vma();
+}
+
+void release_process(pid_t pid, int flags)
+{
+    if (flags & (STREAM_VMA_DATA|SERVE_PAGES))
+	end_ptrace(pid, flags);
 }
 
 static inline unsigned long __remote_syscall(pid_t pid,
@@ -465,4 +476,32 @@ int r_getsockname(pid_t pid, int s, struct sockaddr *name, socklen_t *namelen)
     return ret;
 }
 
+/* Makes each call in turn, passing buffers through the scribble zone */
+static void r_syscall_one(pid_t pid, struct r_call *c)
+{
+    unsigned long a[5];
+
+    memcpy(a, c->args, sizeof(a));
+    if (c->buf) {
+	if (!mem_write_target(pid, scribble_zone+0x100, c->buf, c->buf_len))
+	    bail("Unable to write to the target's scribble zone!");
+	a[c->buf_arg] = scribble_zone+0x100;
+    }
+    c->ret = __remote_syscall(pid, c->nr, "r_syscalls",
+	    1, a[0], 1, a[1], 1, a[2], 1, a[3], 1, a[4]);
+    c->err = c->ret == -1 ? errno : 0;
+    if (c->buf && c->buf_out && c->ret != -1 &&
+	    !mem_read_target(pid, c->buf, scribble_zone+0x100, c->buf_len))
+	bail("Unable to read from the target's scribble zone!");
+}
+
+/* There's no parasite to batch them up with here */
+void r_syscalls(pid_t pid, struct r_call *calls, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	r_syscall_one(pid, &calls[i]);
+}
+
 /* vim:set ts=8 sw=4 noet: */
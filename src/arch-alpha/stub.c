@@ -54,10 +54,11 @@ void seek_to_image(int fd)
 	if (memcmp(strtab+s.sh_name, "cryopid.image", 13) != 0)
 	    continue;
 
-	if (s.sh_info != IMAGE_VERSION) {
+	if (s.sh_info != IMAGE_VERSION && s.sh_info != IMAGE_VERSION_V3) {
 	    fprintf(stderr, "Incorrect image version found (%d)! Keeping on trying.\n", s.sh_info);
 	    continue;
 	}
+	set_image_version(s.sh_info);
 
 	/* Woo! got it! */
 	syscall_check(
@@ -53,4 +53,30 @@ static inline int sys_clone(int flags, void* child_stack) {
 void *plt_resolve(void *l, char *what);
 void *find_linkmap(void *elf_hdr);
 
+
+/* CRC32C with the SSE4.2 crc32 instruction, where the CPU has it. See
+ * checksum() in common.c. */
+#define ARCH_HAS_CRC32C
+
+static inline int arch_has_crc32c()
+{
+    unsigned int a = 1, b, c, d;
+    /* ebx may be the PIC register, so it's kept out of gcc's way */
+    asm ("movl %%ebx, %1\n"
+	 "cpuid\n"
+	 "xchgl %%ebx, %1"
+	 : "+a"(a), "=&r"(b), "=c"(c), "=d"(d));
+    return (c >> 20) & 1;
+}
+
+static inline unsigned int arch_crc32c(unsigned int crc,
+	const unsigned char *p, int len)
+{
+    for (; len >= 4; p += 4, len -= 4)
+	asm ("crc32l %1, %0" : "+r"(crc) : "m"(*(const unsigned int*)p));
+    for (; len > 0; p++, len--)
+	asm ("crc32b %1, %0" : "+r"(crc) : "m"(*p));
+    return crc;
+}
+
 #endif /* _ARCH_H_ */
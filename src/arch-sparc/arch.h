@@ -29,6 +29,8 @@ static inline _syscall4(int, rt_sigaction, int, sig, const struct k_sigaction*,
 
 static inline unsigned long get_task_size() { return 0xf0000000; }
 
+/* rt_sigaction takes a restorer before the size of the mask */
+#define ARCH_SIGACTION_HAS_RESTORER
 #define __NR_rt_sigaction_sparc __NR_rt_sigaction
 static inline _syscall5(int, rt_sigaction_sparc, int, sig,
     const struct k_sigaction*, ksa, struct k_sigaction*, oksa,
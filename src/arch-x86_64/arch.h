@@ -28,4 +28,28 @@ extern unsigned long get_task_size();
 
 #define cp_sigaction rt_sigaction
 
+
+/* CRC32C with the SSE4.2 crc32 instruction, where the CPU has it. See
+ * checksum() in common.c. */
+#define ARCH_HAS_CRC32C
+
+static inline int arch_has_crc32c()
+{
+    unsigned int a = 1, b, c, d;
+    asm ("cpuid" : "+a"(a), "=b"(b), "=c"(c), "=d"(d));
+    return (c >> 20) & 1;
+}
+
+static inline unsigned int arch_crc32c(unsigned int crc,
+	const unsigned char *p, int len)
+{
+    unsigned long c = crc;
+
+    for (; len >= 8; p += 8, len -= 8)
+	asm ("crc32q %1, %0" : "+r"(c) : "m"(*(const unsigned long*)p));
+    for (; len > 0; p++, len--)
+	asm ("crc32b %1, %0" : "+r"(c) : "m"(*p));
+    return c;
+}
+
 #endif /* _ARCH_H_ */
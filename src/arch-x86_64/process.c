@@ -6,6 +6,8 @@
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/ptrace.h>
+#include <signal.h>
+#include <linux/sched.h>
 #include <assert.h>
 #include <netinet/tcp.h>
 #include <linux/net.h>
@@ -14,66 +16,49 @@
 
 #include "cryopid.h"
 #include "cpimage.h"
+#include "process.h"
 #include "list.h"
 
 static int process_was_stopped = 0;
+static pid_t snapshot_pid = 0; /* the copy of the target in a fork snapshot */
 
 char* backup_page(pid_t target, void* addr)
 {
     long* page = xmalloc(PAGE_SIZE);
+    long* poison;
     int i;
-    long ret;
-    for(i = 0; i < PAGE_SIZE/sizeof(long); i++) {
-	ret = ptrace(PTRACE_PEEKTEXT, target, (void*)((long)addr+(i*sizeof(long))), 0);
-	if (errno) {
-	    perror("ptrace(PTRACE_PEEKTEXT)");
-	    free(page);
-	    return NULL;
-	}
-	page[i] = ret;
-	if (ptrace(PTRACE_POKETEXT, target, (void*)((long)addr+(i*sizeof(long))), ARCH_POISON) == -1) {
-	    perror("ptrace(PTRACE_POKETEXT)");
-	    free(page);
-	    return NULL;
-	}
+
+    if (!mem_read_target(target, page, (unsigned long)addr, PAGE_SIZE)) {
+	free(page);
+	return NULL;
+    }
+
+    poison = xmalloc(PAGE_SIZE);
+    for (i = 0; i < PAGE_SIZE/sizeof(long); i++)
+	poison[i] = ARCH_POISON;
+    if (!mem_write_target(target, (unsigned long)addr, poison, PAGE_SIZE)) {
+	free(poison);
+	free(page);
+	return NULL;
     }
+    free(poison);
 
     return (char*)page;
 }
 
 int restore_page(pid_t target, void* addr, char* page)
 {
-    long *p = (long*)page;
-    int i;
+    int ret;
     assert(page);
-    for (i = 0; i < PAGE_SIZE/sizeof(long); i++) {
-	if (ptrace(PTRACE_POKETEXT, target, (void*)((long)addr+(i*sizeof(long))), p[i]) == -1) {
-	    perror("ptrace(PTRACE_POKETEXT)");
-	    free(page);
-	    return 0;
-	}
-    }
+    ret = mem_write_target(target, (unsigned long)addr, page, PAGE_SIZE);
     free(page);
-    return 1;
+    return ret;
 }
 
 int memcpy_into_target(pid_t pid, void* dest, const void* src, size_t n)
 {
     /* just like memcpy, but copies it into the space of the target pid */
-    /* n must be a multiple of word size, or will otherwise be rounded down to
-     * be so */
-    int i;
-    long *d, *s;
-    d = (long*) dest;
-    s = (long*) src;
-    n /= sizeof(long);
-    for (i = 0; i < n; i++) {
-	if (ptrace(PTRACE_POKETEXT, pid, d+i, s[i]) == -1) {
-	    perror("ptrace(PTRACE_POKETEXT)");
-	    return 0;
-	}
-    }
-    return 1;
+    return mem_write_target(pid, (unsigned long)dest, src, n);
 }
 
 int memcpy_from_target(pid_t pid, void* dest, const void* src, size_t n)
@@ -87,6 +72,7 @@ int memcpy_from_target(pid_t pid, void* dest, const void* src, size_t n)
     s = (long*) src;
     n /= sizeof(long);
     for (i = 0; i < n; i++) {
+	errno = 0;
 	d[i] = ptrace(PTRACE_PEEKTEXT, pid, s+i, 0);
 	if (errno) {
 	    perror("ptrace(PTRACE_PEEKTEXT)");
@@ -163,6 +149,7 @@ static void start_ptrace(pid_t pid)
 	perror("Failed to ptrace");
 	exit(1);
     }
+    stop_window_begin();
 
     if (process_was_stopped)
 	return; /* don't bother waiting for it, we'll just hang */
@@ -177,15 +164,62 @@ static void start_ptrace(pid_t pid)
     }
 }
 
-static void end_ptrace(pid_t pid)
+static void end_ptrace(pid_t pid, int flags)
 {
     long ret;
 
-    ret = ptrace(PTRACE_DETACH, pid, 0, 0);
-    if (ret == -1) {
-	perror("Failed to detach");
-	exit(1);
+    if (pid == snapshot_pid) {
+	/* Nobody wants it back */
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, __WALL);
+	snapshot_pid = 0;
+	return;
+    }
+
+    if (flags & KILL_ORIGINAL_PROCESS) {
+	ret = ptrace(PTRACE_KILL, pid, 0, 0);
+	if (ret == -1) {
+	    perror("Failed to kill the original process");
+	    exit(1);
+	}
+    } else {
+	ret = ptrace(PTRACE_DETACH, pid, 0, 0);
+	if (ret == -1) {
+	    perror("Failed to detach from the original process");
+	    exit(1);
+	}
+    }
+    stop_window_end();
+}
+
+static pid_t fork_snapshot(pid_t pid, struct user_regs_struct *r);
+
+/* Takes the target's fds, then forks it and lets it go. Everything else is
+ * taken from the copy, at our leisure. Returns the copy, or -1.
+ */
+static pid_t take_snapshot(pid_t pid, int flags, struct list *process_image,
+	struct user_regs_struct *r)
+{
+    char *pagebackup;
+    pid_t child;
+
+    find_remote_helpers(pid);
+    if (!scribble_zone || !syscall_loc) {
+	fprintf(stderr, "[-] No scribble zone or syscall to fork the process with.\n");
+	return -1;
     }
+
+    pagebackup = backup_page(pid, (void*)scribble_zone);
+    fetch_chunks_fd(pid, flags, process_image);
+    restore_page(pid, (void*)scribble_zone, pagebackup);
+
+    child = fork_snapshot(pid, r);
+    restore_registers(pid, r);
+    end_ptrace(pid, flags);
+
+    if (child != -1)
+	debug("[+] Saving snapshot in process %d.", child);
+    return child;
 }
 
 void get_process(pid_t pid, int flags, struct list *process_image, long *bin_offset)
@@ -201,6 +235,12 @@ void get_process(pid_t pid, int flags, struct list *process_image, long *bin_off
 	goto out_ptrace;
     }
 
+    if (flags & FORK_SNAPSHOT) {
+	if ((snapshot_pid = take_snapshot(pid, flags, process_image, &r)) == -1)
+	    abort();
+	pid = snapshot_pid;
+    }
+
     /* The order below is very important. Do not change without good reason and
      * careful thought.
      */
@@ -214,7 +254,8 @@ void get_process(pid_t pid, int flags, struct list *process_image, long *bin_off
     }
     pagebackup = backup_page(pid, (void*)scribble_zone);
 
-    fetch_chunks_fd(pid, flags, process_image);
+    if (!(flags & FORK_SNAPSHOT))
+	fetch_chunks_fd(pid, flags, process_image);
 
     fetch_chunks_sighand(pid, flags, process_image);
     fetch_chunks_regs(pid, flags, process_image, process_was_stopped);
@@ -223,11 +264,28 @@ void get_process(pid_t pid, int flags, struct list *process_image, long *bin_off
 
     restore_page(pid, (void*)scribble_zone, pagebackup);
     restore_registers(pid, &r);
+
+    /* The VMA data will be read while the image is written (or handed out
+     * by the page server after that), so leave the process stopped until
+     * release_process(). The checksums are read from there as well. */
+    if (success && (flags & (STREAM_VMA_DATA|SERVE_PAGES))) {
+	finish_chunks_vma();
+	return;
+    }
 out_ptrace:
-    end_ptrace(pid);
+    end_ptrace(pid, flags);
     
     if (!success)
 	abort();
+
+    /* The rest can wait until it's running again */
+    finish_chunks_vma();
+}
+
+void release_process(pid_t pid, int flags)
+{
+    if (flags & (STREAM_VMA_DATA|SERVE_PAGES))
+	end_ptrace(snapshot_pid ? snapshot_pid : pid, flags);
 }
 
 static inline unsigned long __remote_syscall(pid_t pid,
@@ -275,6 +333,19 @@ static inline unsigned long __remote_syscall(pid_t pid,
 	abort();
     }
 
+    /* A fork or clone stops for its ptrace event on the way through. Carry
+     * on to the end of the syscall. */
+    while (WIFSTOPPED(status) && (status >> 16)) {
+	if (ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL) < 0) {
+	    perror("ptrace singlestep");
+	    abort();
+	}
+	if (waitpid(pid, &status, 0) == -1) {
+	    perror("Failed to wait for child");
+	    abort();
+	}
+    }
+
     /* Get our new registers */
     if (save_registers(pid, &regs) < 0)
 	abort();
@@ -459,4 +530,238 @@ int r_arch_prctl(pid_t pid, int code, unsigned long addr)
     return ret;
 }
 
+/* Makes each call in turn, passing buffers through the scribble zone */
+static void r_syscall_one(pid_t pid, struct r_call *c)
+{
+    unsigned long a[5];
+
+    memcpy(a, c->args, sizeof(a));
+    if (c->buf) {
+	if (!mem_write_target(pid, scribble_zone+0x100, c->buf, c->buf_len))
+	    bail("Unable to write to the target's scribble zone!");
+	a[c->buf_arg] = scribble_zone+0x100;
+    }
+    c->ret = __remote_syscall(pid, c->nr, "r_syscalls",
+	    1, a[0], 1, a[1], 1, a[2], 1, a[3], 1, a[4]);
+    c->err = c->ret == -1 ? errno : 0;
+    if (c->buf && c->buf_out && c->ret != -1 &&
+	    !mem_read_target(pid, c->buf, scribble_zone+0x100, c->buf_len))
+	bail("Unable to read from the target's scribble zone!");
+}
+
+/* The parasite (parasite.S) sits at the start of the scribble zone, and the
+ * commands it's given follow it, then the buffers they need. */
+extern char parasite_code;
+extern int parasite_code_size;
+#define PARASITE_CMDS	0x80
+
+struct parasite_cmd {
+    unsigned long nr, args[6], ret;
+};
+
+static int install_parasite(pid_t pid)
+{
+    if (!scribble_zone || !syscall_loc || !scribble_prot ||
+	    parasite_code_size > PARASITE_CMDS)
+	return 0;
+    if (r_mprotect(pid, (void*)scribble_zone, PAGE_SIZE,
+		PROT_READ|PROT_WRITE|PROT_EXEC) == -1)
+	return 0;
+    if (!mem_write_target(pid, scribble_zone, &parasite_code,
+		parasite_code_size)) {
+	r_mprotect(pid, (void*)scribble_zone, PAGE_SIZE, scribble_prot);
+	return 0;
+    }
+    return 1;
+}
+
+/* Lets the parasite loose on the commands at cmds. Signals that turn up
+ * before it's blocked them are sent again once it's done. */
+static void run_parasite(pid_t pid, unsigned long cmds)
+{
+    struct user_regs_struct orig_regs, regs;
+    int status, sigs[8], n_sigs = 0, i;
+
+    if (save_registers(pid, &orig_regs) < 0)
+	abort();
+    memcpy(&regs, &orig_regs, sizeof(regs));
+    regs.rip = scribble_zone;
+    regs.rbx = cmds;
+    regs.rax = 0;
+    regs.orig_rax = -1; /* so it doesn't look like a syscall to restart */
+    if (restore_registers(pid, &regs) < 0)
+	abort();
+
+    for (;;) {
+	if (ptrace(PTRACE_CONT, pid, NULL, NULL) < 0) {
+	    perror("ptrace cont");
+	    abort();
+	}
+	if (waitpid(pid, &status, 0) == -1) {
+	    perror("Failed to wait for child");
+	    abort();
+	}
+	if (!WIFSTOPPED(status))
+	    bail("Process %d died running a batch of syscalls!", pid);
+	if (WSTOPSIG(status) == SIGTRAP) {
+	    if (save_registers(pid, &regs) < 0)
+		abort();
+	    if (regs.rip == scribble_zone + parasite_code_size)
+		break;
+	}
+	if (n_sigs < sizeof(sigs)/sizeof(int))
+	    sigs[n_sigs++] = WSTOPSIG(status);
+    }
+
+    if (restore_registers(pid, &orig_regs) < 0)
+	abort();
+    for (i = 0; i < n_sigs; i++)
+	kill(pid, sigs[i]);
+}
+
+static void set_cmd(struct parasite_cmd *cmd, int nr, unsigned long a0,
+	unsigned long a1, unsigned long a2, unsigned long a3)
+{
+    memset(cmd, 0, sizeof(struct parasite_cmd));
+    cmd->nr = nr;
+    cmd->args[0] = a0;
+    cmd->args[1] = a1;
+    cmd->args[2] = a2;
+    cmd->args[3] = a3;
+}
+
+/* Makes all of the calls, with as few trips into the target as will fit in
+ * the scribble zone. Each trip blocks signals for its duration, so that
+ * none of the target's handlers run in the middle of it.
+ */
+void r_syscalls(pid_t pid, struct r_call *calls, int n)
+{
+    static char page[PAGE_SIZE];
+    int done = 0, i;
+
+    if (!install_parasite(pid)) {
+	for (i = 0; i < n; i++)
+	    r_syscall_one(pid, &calls[i]);
+	return;
+    }
+
+    while (done < n) {
+	struct parasite_cmd *cmd = (struct parasite_cmd*)(page + PARASITE_CMDS);
+	unsigned long base = scribble_zone + PARASITE_CMDS;
+	unsigned long mask, data, end;
+	int k, used;
+
+	/* How many fit? That's a command each, two for the signal mask and
+	 * the end marker, and the buffers. */
+	used = 3 * sizeof(struct parasite_cmd) + 2 * sizeof(arch_sigset_t);
+	for (k = 0; done + k < n; k++) {
+	    int need = sizeof(struct parasite_cmd) +
+		((calls[done + k].buf_len + 7) & ~7);
+	    if (used + need > PAGE_SIZE - PARASITE_CMDS)
+		break;
+	    used += need;
+	}
+	if (k == 0)
+	    bail("Remote syscall buffer of %d bytes is too big!",
+		    calls[done].buf_len);
+
+	mask = base + (k + 3) * sizeof(struct parasite_cmd);
+	memset(page + (mask - scribble_zone), 0xff, sizeof(arch_sigset_t));
+	set_cmd(cmd++, __NR_rt_sigprocmask, SIG_SETMASK, mask,
+		mask + sizeof(arch_sigset_t), sizeof(arch_sigset_t));
+	data = mask + 2 * sizeof(arch_sigset_t);
+	for (i = 0; i < k; i++, cmd++) {
+	    struct r_call *c = &calls[done + i];
+
+	    set_cmd(cmd, c->nr, c->args[0], c->args[1], c->args[2], c->args[3]);
+	    cmd->args[4] = c->args[4];
+	    if (c->buf) {
+		memcpy(page + (data - scribble_zone), c->buf, c->buf_len);
+		cmd->args[c->buf_arg] = data;
+		data += (c->buf_len + 7) & ~7;
+	    }
+	}
+	set_cmd(cmd++, __NR_rt_sigprocmask, SIG_SETMASK,
+		mask + sizeof(arch_sigset_t), 0, sizeof(arch_sigset_t));
+	set_cmd(cmd, -1, 0, 0, 0, 0);
+	end = data;
+
+	if (!mem_write_target(pid, base, page + PARASITE_CMDS, end - base))
+	    bail("Unable to write to the target's scribble zone!");
+	run_parasite(pid, base);
+	if (!mem_read_target(pid, page + PARASITE_CMDS, base, end - base))
+	    bail("Unable to read from the target's scribble zone!");
+
+	cmd = (struct parasite_cmd*)(page + PARASITE_CMDS) + 1;
+	for (i = 0; i < k; i++, cmd++) {
+	    struct r_call *c = &calls[done + i];
+
+	    c->ret = cmd->ret;
+	    c->err = 0;
+	    if ((unsigned long)c->ret > -4096UL) {
+		c->err = -c->ret;
+		c->ret = -1;
+	    }
+	    if (c->buf && c->buf_out && c->ret != -1)
+		memcpy(c->buf, page + (cmd->args[c->buf_arg] - scribble_zone),
+			c->buf_len);
+	}
+	done += k;
+    }
+
+    r_mprotect(pid, (void*)scribble_zone, PAGE_SIZE, scribble_prot);
+}
+
+__rsyscall5(long, clone, unsigned long, flags, void*, newsp, void*, ptid, void*, ctid, unsigned long, tls);
+
+/* Forks the target into a copy of itself, which starts out stopped and
+ * traced by us. It's made a sibling of the target (CLONE_PARENT), so the
+ * target never hears of it, unless it's an init, which can't have siblings.
+ * Either way it exits with SIGCHLD, so that whichever is its parent hears of
+ * it and reaps it once we've killed it, rather than leaving a zombie.
+ */
+static pid_t fork_snapshot(pid_t pid, struct user_regs_struct *r)
+{
+    pid_t child;
+    int status;
+
+    if (ptrace(PTRACE_SETOPTIONS, pid, 0,
+		PTRACE_O_TRACEFORK|PTRACE_O_TRACECLONE) == -1) {
+	perror("ptrace(PTRACE_SETOPTIONS)");
+	return -1;
+    }
+    child = __r_clone(pid, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, 0);
+    if (child == -1 && errno == EINVAL)
+	child = __r_clone(pid, SIGCHLD, NULL, NULL, NULL, 0);
+    ptrace(PTRACE_SETOPTIONS, pid, 0, 0);
+    if (child == -1) {
+	perror("Failed to fork process");
+	return -1;
+    }
+
+    if (waitpid(child, &status, __WALL) == -1 || !WIFSTOPPED(status)) {
+	fprintf(stderr, "Forked process %d didn't stop.\n", child);
+	goto fail;
+    }
+
+    /* Maps marked MADV_DONTFORK aren't copied, and the image would be
+     * missing them. */
+    if (maps_not_forked(pid, child)) {
+	fprintf(stderr, "[-] Those can't be saved from a forked copy. "
+		"Save the process without -F.\n");
+	goto fail;
+    }
+
+    /* It's left with the registers of the syscall that made it */
+    if (restore_registers(child, r) < 0)
+	goto fail;
+
+    return child;
+
+fail:
+    kill(child, SIGKILL);
+    waitpid(child, NULL, __WALL);
+    return -1;
+}
+
 /* vim:set ts=8 sw=4 noet: */
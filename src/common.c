@@ -6,6 +6,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/user.h>
 
 #include "cryopid.h"
@@ -237,10 +238,12 @@ static void cp_malloc_init_hook()
 
 #endif /* COMPILING_STUB */
 
+/* Asking for nothing (an empty table, say) is fine, and isn't mistaken for
+ * running out when malloc(0) gives NULL. */
 void *xmalloc(int len)
 {
     void *p;
-    p = malloc(len);
+    p = malloc(len ? len : 1);
     if (!p)
 	    bail("Out of memory!");
     return p;
@@ -251,7 +254,21 @@ void xfree(void *p)
     free(p);
 }
 
-unsigned int checksum(char *ptr, int len, unsigned int start)
+long long now_usecs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* How the image is checksummed. The writer picks it, and the stub takes it
+ * from the image's header. */
+int checksum_type = CHECKSUM_CRC32C;
+
+char *checksum_names[N_CHECKSUMS] = { "none", "djb", "crc32c" };
+
+/* The one version 3 images have: simple, but a byte at a time */
+static unsigned int checksum_djb(char *ptr, int len, unsigned int start)
 {
     int sum = start, i;
     for (i = 0; i < len; i++)
@@ -259,4 +276,94 @@ unsigned int checksum(char *ptr, int len, unsigned int start)
     return sum;
 }
 
+/* CRC32C (Castagnoli), eight bytes at a time with tables, for CPUs without
+ * an instruction for it. The bytes are put together one by one, so it comes
+ * out the same on big and little endian machines alike. */
+static unsigned int crc32c_table[8][256];
+static int crc32c_ready;
+
+static void crc32c_init()
+{
+    unsigned int c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+	c = i;
+	for (j = 0; j < 8; j++)
+	    c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+	crc32c_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+	for (j = 1; j < 8; j++)
+	    crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^
+		crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+    crc32c_ready = 1;
+}
+
+static unsigned int crc32c_sw(unsigned int crc, const unsigned char *p,
+	int len)
+{
+    unsigned int (*t)[256] = crc32c_table;
+
+    if (!crc32c_ready)
+	crc32c_init();
+    for (; len >= 8; p += 8, len -= 8) {
+	crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+	    t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+	    t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+    while (len-- > 0)
+	crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+static unsigned int checksum_crc32c(char *ptr, int len, unsigned int start)
+{
+#ifdef ARCH_HAS_CRC32C
+    static int hw = -1;
+
+    if (hw == -1)
+	hw = arch_has_crc32c();
+    if (hw)
+	return ~arch_crc32c(~start, (unsigned char*)ptr, len);
+#endif
+    return ~crc32c_sw(~start, (unsigned char*)ptr, len);
+}
+
+/* The checksum of len bytes at ptr, carrying on from start (0 to begin
+ * with), so a bit can be checksummed a piece at a time. */
+unsigned int checksum(char *ptr, int len, unsigned int start)
+{
+    switch (checksum_type) {
+	case CHECKSUM_NONE:
+	    return start;
+	case CHECKSUM_DJB:
+	    return checksum_djb(ptr, len, start);
+    }
+    return checksum_crc32c(ptr, len, start);
+}
+
+/* Checksums of maps are also how unsaved libraries are checked against the
+ * files they came from, so they can't be turned off. */
+unsigned int map_checksum(char *ptr, int len, unsigned int start)
+{
+    if (checksum_type == CHECKSUM_NONE)
+	return checksum_crc32c(ptr, len, start);
+    return checksum(ptr, len, start);
+}
+
+int set_checksum(char *name)
+{
+    int i;
+
+    for (i = 0; i < N_CHECKSUMS; i++) {
+	if (strcmp(name, checksum_names[i]) == 0) {
+	    checksum_type = i;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
 /* vim:set ts=8 sw=4 noet: */
@@ -45,7 +45,7 @@ void read_chunk_fd_file(void *fptr, struct cp_fd *fd, int action)
     read_bit(fptr, &have_contents, sizeof(int));
     if (have_contents) {
 	fd->file.contents = xmalloc(fd->file.size);
-	read_bit(fptr, fd->file.contents, fd->file.size);
+	read_data(fptr, fd->file.contents, fd->file.size);
     } else
 	fd->file.contents = NULL;
 
@@ -10,6 +10,7 @@
 #include "cryopid.h"
 #include "cpimage.h"
 #include "tcpcp.h"
+#include "tcprepair.h"
 
 #define PROTO_UNIX	1
 #define PROTO_TCP	6
@@ -22,6 +23,9 @@ static void read_chunk_fd_socket_tcp(void *fptr, int fd, struct cp_socket_tcp *t
 #ifdef USE_TCPCP
     void *ici;
     int len, s;
+#elif defined(USE_TCP_REPAIR)
+    struct tcprepair_state *st;
+    int len, s;
 #endif
 
     if (action & ACTION_PRINT)
@@ -42,6 +46,32 @@ static void read_chunk_fd_socket_tcp(void *fptr, int fd, struct cp_socket_tcp *t
 	}
 	syscall_check(tcpcp_activate(fd), 0, "tcpcp_activate");
     }
+#elif defined(USE_TCP_REPAIR)
+    /* Version 3 images only ever had tcpcp's */
+    if (image_version == IMAGE_VERSION_V3)
+	return;
+    read_bit(fptr, &len, sizeof(int));
+    if (!len)
+	return;
+    st = xmalloc(len);
+    read_bit(fptr, st, len);
+
+    if (action & ACTION_PRINT)
+	fprintf(stderr, "(state %d, %d bytes queued) ", st->state,
+		st->snd_len + st->rcv_len);
+
+    if (action & ACTION_LOAD) {
+	if ((s = tcprepair_create(st)) < 0) {
+	    fprintf(stderr, "tcprepair_create: %s", strerror(errno));
+	    return;
+	}
+	if (s != fd) {
+	    syscall_check(dup2(s, fd), 0, "dup2");
+	    close(s);
+	}
+	if (tcprepair_activate(fd, st) < 0)
+	    fprintf(stderr, "tcprepair_activate: %s", strerror(errno));
+    }
 #endif
 }
 
@@ -108,9 +138,64 @@ static void read_chunk_fd_socket_x(void *fptr, int fd, int action)
     }
 }
 
+/* Asks the cryopid left holding the original socket for it, and puts it on
+ * fd. Returns 0 if it got it. */
+static int take_handoff(int fd, struct sockaddr_un *addr)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char c, buf[CMSG_SPACE(sizeof(int))];
+    int s, got, ret = -1;
+
+    if ((s = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+	return -1;
+    if (connect(s, (struct sockaddr*)addr, SUN_LEN(addr)) < 0 ||
+	    write(s, &fd, sizeof(int)) != sizeof(int))
+	goto out;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+    if (recvmsg(s, &msg, 0) != 1)
+	goto out;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+	goto out;
+    memcpy(&got, CMSG_DATA(cmsg), sizeof(int));
+    if (got != fd) {
+	dup2(got, fd);
+	close(got);
+    }
+    ret = 0;
+out:
+    /* If s was on fd (the lowest free one), dup2() has already closed it,
+     * and the socket that's there now is the one we were given. */
+    if (ret != 0 || s != fd)
+	close(s);
+    return ret;
+}
+
 void read_chunk_fd_socket(void *fptr, struct cp_fd *fd, int action)
 {
     read_bit(fptr, &fd->socket.proto, sizeof(int));
+    fd->socket.handoff = 0;
+    if (image_version != IMAGE_VERSION_V3)
+	read_bit(fptr, &fd->socket.handoff, sizeof(int));
+    if (fd->socket.handoff) {
+	struct sockaddr_un *addr = &fd->socket.handoff_addr;
+
+	read_bit(fptr, addr, sizeof(struct sockaddr_un));
+	if (action & ACTION_PRINT)
+	    fprintf(stderr, "(handed over at %s) ", addr->sun_path);
+	/* Failing that, it's made anew as usual */
+	if ((action & ACTION_LOAD) && take_handoff(fd->fd, addr) == 0)
+	    action &= ~ACTION_LOAD;
+    }
     switch (fd->socket.proto) {
 	case PROTO_TCP:
 	    read_chunk_fd_socket_tcp(fptr, fd->fd, &fd->socket.s_tcp, action);
@@ -2,8 +2,22 @@
 #include "cryopid.h"
 #include "cpimage.h"
 
+/* The header comes first, and says how the rest of the image is checksummed.
+ * It's always checksummed with CRC32C itself. Version 3 images had no use for
+ * one. */
 void read_chunk_header(void *fptr, int action)
 {
+    int type;
+
+    if (image_version == IMAGE_VERSION_V3)
+	return;
+    read_bit(fptr, &type, sizeof(int));
+    if (type < 0 || type >= N_CHECKSUMS)
+	bail("Unknown checksum type in image header (%d)!", type);
+    checksum_type = type;
+
+    if (action & ACTION_PRINT)
+	fprintf(stderr, "Header: %s checksums ", checksum_names[type]);
 }
 
 /* vim:set ts=8 sw=4 noet: */
@@ -0,0 +1,722 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/userfaultfd.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+
+/* Lazy restore: rather than being read in before resuming, anonymous memory
+ * is left in the image, and registered with userfaultfd. A helper sharing
+ * our memory (but nothing else) fills pages in from the image as they're
+ * touched, and reads the rest in the background until there's nothing left,
+ * then goes away. It follows the process through forks, mremap()s and the
+ * like until then, so that nothing is filled in where it shouldn't be.
+ *
+ * The pages have to be found in the image file, so only streams that store
+ * them verbatim (raw and buffered) can do this.
+ *
+ * Maps that cryopid left in the process it saved (VMA_DATA_REMOTE) are
+ * paged in the same way, but asked for from its page server instead (see
+ * pageserver.c). They're always left until after resuming if they can be,
+ * and fetched up front if not.
+ */
+
+/* sys/ioctl.h and linux/termios.h don't get along */
+extern int ioctl(int fd, unsigned long req, ...);
+
+#define LAZY_FEATURES	(UFFD_FEATURE_EVENT_FORK | UFFD_FEATURE_EVENT_REMAP | \
+	UFFD_FEATURE_EVENT_REMOVE | UFFD_FEATURE_EVENT_UNMAP)
+#define LAZY_CHUNK	(256 * 1024)	/* read in the background at a time */
+#define LAZY_STACK_LEN	(64 * 1024)
+
+extern int verbosity;
+
+int lazy_restore;
+
+/* Each bit of the image left behind */
+struct lazy_range {
+    unsigned long addr, len;
+    long file_off;
+    unsigned int checksum;
+    int prot;
+    int remote; /* from the page server, not the image, and not checksummed */
+    unsigned long first_page; /* in each process's bitmap */
+};
+
+static struct lazy_range *ranges;
+static int n_ranges, max_ranges;
+static unsigned long n_pages;
+static int uffd = -1, lazy_fd = -1, server_fd = -1;
+static int lazy_failed;
+static int not_served; /* only describing the image */
+static pid_t resumed_pid, helper_pid;
+
+struct lazy_remap {
+    unsigned long from, to, len;
+};
+
+/* A process being paged in: the resumed one, and any it forks before it's
+ * done. Pages are known by where they were when it was resumed. */
+struct lazy_mm {
+    int uffd;
+    unsigned char *done; /* a bit for each page that's there, or gone */
+    struct lazy_remap *remaps;
+    int n_remaps, max_remaps;
+    unsigned long *faults; /* not yet served */
+    int n_faults, max_faults;
+    int range; /* how far the background reading's got */
+    unsigned long off;
+    unsigned int sum;
+    int verify, dead;
+};
+
+static struct lazy_mm **mms;
+static int n_mms, max_mms;
+
+/* No realloc() in the stub, and free() doesn't, but this doubles */
+static void *grow(void *p, int *max, int n, int size, int first)
+{
+    void *q;
+
+    if (n < *max)
+	return p;
+    *max = *max ? *max * 2 : first;
+    q = xmalloc(*max * size);
+    memcpy(q, p, n * size);
+    free(p);
+    return q;
+}
+
+static void pread_all(int fd, char *buf, unsigned long len, long off)
+{
+    long r;
+
+    while (len > 0) {
+	r = pread(fd, buf, len, off);
+	if (r <= 0)
+	    bail("Reading the image for lazy restore: %s",
+		    r ? strerror(errno) : "short read");
+	buf += r;
+	off += r;
+	len -= r;
+    }
+}
+
+/* Asks the page server for len bytes of what was at addr. If it's gone
+ * once the process is running, the pages it was to get never will, and it's
+ * better killed than left running with them zeroed. */
+static void ask_server(unsigned long addr, char *buf, unsigned long len)
+{
+    unsigned long req[2];
+    long r;
+
+    req[0] = addr;
+    req[1] = len;
+    r = write(server_fd, req, sizeof(req));
+    while (r == sizeof(req) && len > 0) {
+	if ((r = read(server_fd, buf, len)) <= 0)
+	    break;
+	buf += r;
+	len -= r;
+    }
+    if (len == 0)
+	return;
+    if (getpid() == helper_pid) {
+	kill(resumed_pid, SIGKILL);
+	_exit(1);
+    }
+    bail("Lost the page server: %s", r ? strerror(errno) : "closed");
+}
+
+/* Gets len bytes of a range, from off into it */
+static void fetch(struct lazy_range *r, unsigned long off, char *buf,
+	unsigned long len)
+{
+    if (r->remote)
+	ask_server(r->addr + off, buf, len);
+    else
+	pread_all(lazy_fd, buf, len, r->file_off + off);
+}
+
+/* Reads a range in now, when it can't be paged in later */
+static void fill_range(struct lazy_range *r)
+{
+    syscall_check(mprotect((void*)r->addr, r->len, PROT_READ|PROT_WRITE), 0,
+	    "mprotect");
+    fetch(r, 0, (char*)r->addr, r->len);
+    if (!r->remote && !checksum_matches(r->checksum,
+		checksum((char*)r->addr, r->len, 0)))
+	debug("CHECKSUM MISMATCH (len %ld): should be 0x%x", r->len,
+		r->checksum);
+    syscall_check(mprotect((void*)r->addr, r->len, r->prot), 0, "mprotect");
+}
+
+static int lazy_init()
+{
+#ifdef __NR_userfaultfd
+    struct uffdio_api api;
+
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd == -1) {
+	fprintf(stderr, "[-] userfaultfd: %s. Restoring memory up front.\n",
+		strerror(errno));
+	lazy_restore = 0;
+	return 0;
+    }
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    api.features = LAZY_FEATURES;
+    if (ioctl(uffd, UFFDIO_API, &api) == -1) {
+	fprintf(stderr, "[-] This kernel's userfaultfd can't follow forks and "
+		"remaps. Restoring memory up front.\n");
+	close(uffd);
+	uffd = -1;
+	lazy_restore = 0;
+	return 0;
+    }
+    return 1;
+#else
+    lazy_restore = 0;
+    return 0;
+#endif
+}
+
+static struct lazy_range *add_range(unsigned long addr, unsigned long len,
+	int prot)
+{
+    struct lazy_range *r;
+
+    ranges = grow(ranges, &max_ranges, n_ranges, sizeof(struct lazy_range),
+	    256);
+    r = &ranges[n_ranges++];
+    memset(r, 0, sizeof(*r));
+    r->addr = addr;
+    r->len = len;
+    r->prot = prot;
+    r->first_page = n_pages;
+    n_pages += len / _getpagesize;
+    return r;
+}
+
+/* Leaves a bit of the image bound for addr where it is, to be paged in once
+ * resumed, if lazy restore's on and this stream allows it. Returns 0 if it's
+ * to be read in as usual. */
+int lazy_bit(void *fptr, unsigned long addr, unsigned long len, int prot)
+{
+    struct lazy_range *r;
+    long off;
+    int fd;
+
+    if (!lazy_restore || !len || ((addr | len) & (_getpagesize - 1)))
+	return 0;
+    if (!stream_ops->file_offset || !stream_ops->skip) {
+	fprintf(stderr, "[-] Can't page in from a compressed image. Restoring "
+		"memory up front.\n");
+	lazy_restore = 0;
+	return 0;
+    }
+    /* They're looked up by address, so they must come in order */
+    if (n_ranges && addr < ranges[n_ranges-1].addr + ranges[n_ranges-1].len)
+	return 0;
+    if (uffd == -1 && !lazy_init())
+	return 0;
+    if ((off = stream_ops->file_offset(fptr, &fd)) == -1)
+	return 0;
+
+    r = add_range(addr, len, prot);
+    stream_ops->read(fptr, &r->checksum, sizeof(r->checksum));
+    r->file_off = off + sizeof(r->checksum);
+    stream_ops->skip(fptr, len);
+    lazy_fd = fd;
+    return 1;
+}
+
+/* Connects to the page server that VMA_DATA_REMOTE maps are to come from */
+void read_chunk_page_server(void *fptr, int action)
+{
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    read_string(fptr, sun.sun_path, sizeof(sun.sun_path) - 1);
+    if (action & ACTION_PRINT)
+	fprintf(stderr, "Memory served from %s", sun.sun_path);
+    if (!(action & ACTION_LOAD)) {
+	not_served = 1;
+	return;
+    }
+
+    syscall_check(server_fd = socket(PF_UNIX, SOCK_STREAM, 0), 0, "socket");
+    if (connect(server_fd, (struct sockaddr*)&sun, SUN_LEN(&sun)) == -1)
+	bail("Couldn't reach the page server at %s: %s", sun.sun_path,
+		strerror(errno));
+    fcntl(server_fd, F_SETFD, FD_CLOEXEC);
+}
+
+/* Leaves a range of a map that was kept in the saved process to be asked for
+ * once resumed, or asks for it now if that can't be done. The map is still
+ * writable. */
+void lazy_remote(unsigned long addr, unsigned long len, int prot)
+{
+    struct lazy_range *r;
+
+    if (!len || not_served)
+	return;
+    if (server_fd == -1)
+	bail("Memory at 0x%lx is to come from a page server, and there isn't "
+		"one!", addr);
+    if ((uffd == -1 && !lazy_init()) ||
+	    (n_ranges && addr < ranges[n_ranges-1].addr + ranges[n_ranges-1].len)) {
+	ask_server(addr, (char*)addr, len);
+	return;
+    }
+    r = add_range(addr, len, prot);
+    r->remote = 1;
+}
+
+static struct lazy_range *find_range(unsigned long addr)
+{
+    int lo = 0, hi = n_ranges;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (ranges[mid].addr + ranges[mid].len <= addr)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < n_ranges && ranges[lo].addr <= addr)
+	return &ranges[lo];
+    return NULL;
+}
+
+/* A duplicate page may be a copy of one that's been left in the image, and
+ * isn't there to copy yet. Reads it from the image into buf if so, and
+ * returns 0 if it's in memory already. */
+int lazy_read_page(unsigned long addr, void *buf)
+{
+    struct lazy_range *r;
+
+    if (!n_ranges || !(r = find_range(addr)))
+	return 0;
+    fetch(r, addr - r->addr, buf, _getpagesize);
+    return 1;
+}
+
+/* ----- The helper --------------------------------------------------------- */
+
+static unsigned long page_index(struct lazy_range *r, unsigned long addr)
+{
+    return r->first_page + (addr - r->addr) / _getpagesize;
+}
+
+#define is_done(mm, i)	((mm)->done[(i) >> 3] & (1 << ((i) & 7)))
+#define set_done(mm, i)	((mm)->done[(i) >> 3] |= (1 << ((i) & 7)))
+
+/* Where a page that was at addr is now */
+static unsigned long now_at(struct lazy_mm *mm, unsigned long addr)
+{
+    int i;
+
+    for (i = 0; i < mm->n_remaps; i++) {
+	struct lazy_remap *m = &mm->remaps[i];
+	if (addr >= m->from && addr < m->from + m->len)
+	    addr = m->to + (addr - m->from);
+    }
+    return addr;
+}
+
+/* And where a page that's at addr now was */
+static unsigned long was_at(struct lazy_mm *mm, unsigned long addr)
+{
+    int i;
+
+    for (i = mm->n_remaps - 1; i >= 0; i--) {
+	struct lazy_remap *m = &mm->remaps[i];
+	if (addr >= m->to && addr < m->to + m->len)
+	    addr = m->from + (addr - m->to);
+    }
+    return addr;
+}
+
+static struct lazy_mm *add_mm(int fd, struct lazy_mm *parent)
+{
+    int bytes = (n_pages + 7) / 8;
+    struct lazy_mm *mm = xmalloc(sizeof(struct lazy_mm));
+
+    memset(mm, 0, sizeof(*mm));
+    mm->uffd = fd;
+    mm->done = xmalloc(bytes);
+    if (parent) {
+	/* It has whatever its parent had, where its parent had it */
+	memcpy(mm->done, parent->done, bytes);
+	mm->max_remaps = parent->n_remaps;
+	mm->n_remaps = parent->n_remaps;
+	if (mm->n_remaps) {
+	    mm->remaps = xmalloc(mm->n_remaps * sizeof(struct lazy_remap));
+	    memcpy(mm->remaps, parent->remaps,
+		    mm->n_remaps * sizeof(struct lazy_remap));
+	}
+    } else
+	memset(mm->done, 0, bytes);
+
+    mms = grow(mms, &max_mms, n_mms, sizeof(struct lazy_mm*), 8);
+    mms[n_mms++] = mm;
+    return mm;
+}
+
+static void add_remap(struct lazy_mm *mm, unsigned long from,
+	unsigned long to, unsigned long len)
+{
+    mm->remaps = grow(mm->remaps, &mm->max_remaps, mm->n_remaps,
+	    sizeof(struct lazy_remap), 16);
+    mm->remaps[mm->n_remaps].from = from;
+    mm->remaps[mm->n_remaps].to = to;
+    mm->remaps[mm->n_remaps].len = len;
+    mm->n_remaps++;
+}
+
+/* The page of ours that's at addr now, if any */
+static struct lazy_range *ours(struct lazy_mm *mm, unsigned long addr,
+	unsigned long *was)
+{
+    *was = was_at(mm, addr);
+    if (now_at(mm, *was) != addr)
+	return NULL; /* Moved away, and something else is here */
+    return find_range(*was);
+}
+
+/* Pages unmapped or thrown away (by madvise()) needn't be filled in. An
+ * mremap() unmaps where they were too, but they're not there any more. */
+static void forget(struct lazy_mm *mm, unsigned long start, unsigned long end)
+{
+    struct lazy_range *r;
+    unsigned long a, was;
+
+    for (a = start; a < end; a += _getpagesize)
+	if ((r = ours(mm, a, &was)))
+	    set_done(mm, page_index(r, was));
+}
+
+/* Takes what's waiting to be read from mm's userfaultfd. Faults are left for
+ * serve(), everything else is dealt with here. */
+static void read_events(struct lazy_mm *mm)
+{
+    static struct uffd_msg msg[16];
+    int n, i;
+
+    while ((n = read(mm->uffd, msg, sizeof(msg))) > 0) {
+	for (i = 0; i < n / sizeof(struct uffd_msg); i++) {
+	    switch (msg[i].event) {
+		case UFFD_EVENT_PAGEFAULT:
+		    mm->faults = grow(mm->faults, &mm->max_faults,
+			    mm->n_faults, sizeof(unsigned long), 64);
+		    mm->faults[mm->n_faults++] = msg[i].arg.pagefault.address;
+		    break;
+		case UFFD_EVENT_FORK:
+		    add_mm(msg[i].arg.fork.ufd, mm);
+		    break;
+		case UFFD_EVENT_REMAP:
+		    add_remap(mm, msg[i].arg.remap.from, msg[i].arg.remap.to,
+			    msg[i].arg.remap.len);
+		    break;
+		case UFFD_EVENT_REMOVE:
+		case UFFD_EVENT_UNMAP:
+		    forget(mm, msg[i].arg.remove.start, msg[i].arg.remove.end);
+		    break;
+	    }
+	}
+    }
+}
+
+/* Its memory's changing (it's in the middle of a fork, mremap() or such), so
+ * what was asked for may not be where it was. Anything waiting on addr is
+ * let go to fault again, once what's changed has been heard about. */
+static void changing(struct lazy_mm *mm, unsigned long addr, unsigned long len)
+{
+    struct uffdio_range w;
+
+    read_events(mm);
+    w.start = addr;
+    w.len = len;
+    ioctl(mm->uffd, UFFDIO_WAKE, &w);
+}
+
+/* Puts len bytes from buf at addr in mm. Returns how many bytes are done
+ * with, whether they went in or were there already, or 0 if it's to be
+ * tried again. */
+static unsigned long copy_in(struct lazy_mm *mm, unsigned long addr,
+	char *buf, unsigned long len)
+{
+    struct uffdio_copy c;
+
+    c.dst = addr;
+    c.src = (unsigned long)buf;
+    c.len = len;
+    c.mode = 0;
+    c.copy = 0;
+    if (ioctl(mm->uffd, UFFDIO_COPY, &c) == 0)
+	return len;
+    if ((long)c.copy > 0)
+	return c.copy;
+    switch (errno) {
+	case EAGAIN:
+	    changing(mm, addr, len);
+	    return 0;
+	case EEXIST:
+	    /* Somebody may be waiting on it all the same */
+	    changing(mm, addr, _getpagesize);
+	    return _getpagesize;
+	case ENOENT:
+	    return _getpagesize; /* Gone */
+	default:
+	    mm->dead = 1;
+	    return len;
+    }
+}
+
+static void fault(struct lazy_mm *mm, unsigned long addr)
+{
+    static char buf[65536];
+    struct uffdio_zeropage z;
+    struct lazy_range *r;
+    unsigned long page = _getpagesize, was;
+
+    addr &= ~(page - 1);
+    if ((r = ours(mm, addr, &was)) && !is_done(mm, page_index(r, was))) {
+	fetch(r, was - r->addr, buf, page);
+	if (copy_in(mm, addr, buf, page))
+	    set_done(mm, page_index(r, was));
+	return;
+    }
+
+    /* Not ours, or thrown away since: a fresh page, then */
+    z.range.start = addr;
+    z.range.len = page;
+    z.mode = 0;
+    if (ioctl(mm->uffd, UFFDIO_ZEROPAGE, &z) == -1 &&
+	    (errno == EAGAIN || errno == EEXIST))
+	changing(mm, addr, page);
+}
+
+static void serve(struct lazy_mm *mm)
+{
+    read_events(mm);
+    while (mm->n_faults && !mm->dead)
+	fault(mm, mm->faults[--mm->n_faults]);
+}
+
+/* Reads the next piece of the image in, for the pages mm still lacks.
+ * Returns 0 once there's nothing left. */
+static int prefetch(struct lazy_mm *mm)
+{
+    static char buf[LAZY_CHUNK];
+    unsigned long page = _getpagesize, len, i, j, k, done, n;
+    struct lazy_range *r;
+
+    if (mm->range == n_ranges)
+	return 0;
+    r = &ranges[mm->range];
+    len = r->len - mm->off;
+    if (len > LAZY_CHUNK)
+	len = LAZY_CHUNK;
+    fetch(r, mm->off, buf, len);
+
+    /* In runs of pages that are missing, and still together */
+    for (i = 0; i < len && !mm->dead; i = j) {
+	unsigned long start = r->addr + mm->off + i;
+
+	if (is_done(mm, page_index(r, start))) {
+	    j = i + page;
+	    continue;
+	}
+	for (j = i + page; j < len; j += page) {
+	    unsigned long a = r->addr + mm->off + j;
+	    if (is_done(mm, page_index(r, a)) ||
+		    now_at(mm, a) != now_at(mm, start) + (j - i))
+		break;
+	}
+	for (done = 0; done < j - i && !mm->dead; done += n) {
+	    /* If it's moved meanwhile, this piece is started over */
+	    if (!(n = copy_in(mm, now_at(mm, start) + done, buf + i + done,
+			    j - i - done)))
+		return 1;
+	    n = (n + page - 1) & ~(page - 1);
+	    for (k = 0; k < n; k += page)
+		set_done(mm, page_index(r, start + done + k));
+	}
+    }
+
+    if (mm->verify && !r->remote)
+	mm->sum = checksum(buf, len, mm->sum);
+    mm->off += len;
+    if (mm->off == r->len) {
+	if (mm->verify && !r->remote && !checksum_matches(r->checksum, mm->sum))
+	    debug("CHECKSUM MISMATCH (len %ld): should be 0x%x, measured 0x%x",
+		    r->len, r->checksum, mm->sum);
+	mm->range++;
+	mm->off = 0;
+	mm->sum = 0;
+    }
+    return 1;
+}
+
+/* Closes fds lo to hi (inclusive) */
+static void close_fds(unsigned int lo, unsigned int hi)
+{
+    struct rlimit rl;
+    unsigned int fd;
+
+#ifdef __NR_close_range
+    if (lo > hi || syscall(__NR_close_range, lo, hi, 0) == 0)
+	return;
+#endif
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur > 65536)
+	rl.rlim_cur = 65536;
+    for (fd = lo; fd <= hi && fd < rl.rlim_cur; fd++)
+	close(fd);
+}
+
+/* The helper gets a copy of every fd restored so far. Held open here, pipes
+ * would never see EOF and sockets closed by the process would never really
+ * close, until every page was in. So it keeps only what it needs. */
+static void close_all_but_ours()
+{
+    int keep[3] = { uffd, lazy_fd, server_fd }, i, j, t;
+    unsigned int lo = 0;
+
+    for (i = 0; i < 3; i++)
+	for (j = i + 1; j < 3; j++)
+	    if (keep[j] < keep[i]) {
+		t = keep[i];
+		keep[i] = keep[j];
+		keep[j] = t;
+	    }
+    for (i = 0; i < 3; i++) {
+	if (keep[i] < 0 || keep[i] < lo)
+	    continue;
+	if (keep[i] > lo)
+	    close_fds(lo, keep[i] - 1);
+	lo = keep[i] + 1;
+    }
+    close_fds(lo, ~0U);
+}
+
+static int lazy_run(void *arg)
+{
+    sigset_t all;
+    int i;
+
+    /* The signal handlers we have are the resumed process's. Stay out of
+     * their way, and out of its terminal's. */
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, NULL);
+    setsid();
+    helper_pid = getpid();
+    close_all_but_ours();
+
+    add_mm(uffd, NULL)->verify = 1;
+    while (n_mms) {
+	for (i = 0; i < n_mms; i++) {
+	    struct lazy_mm *mm = mms[i];
+
+	    serve(mm);
+	    if (!mm->dead && prefetch(mm))
+		continue;
+	    serve(mm);
+	    /* That unregisters it all, and lets anything still waiting go */
+	    close(mm->uffd);
+	    mms[i--] = mms[--n_mms];
+	}
+    }
+    _exit(0);
+}
+
+/* Leaves the helper to init, so that nobody has to wait for it */
+static int lazy_detach(void *arg)
+{
+    char *stack = xmalloc(LAZY_STACK_LEN);
+    char *sp = (char*)((unsigned long)(stack + LAZY_STACK_LEN) & ~15UL);
+
+    if (clone(lazy_run, sp, CLONE_VM | SIGCHLD, NULL) == -1)
+	lazy_failed = 1;
+    _exit(0);
+}
+
+/* Registers what's been left in the image, and starts the helper. Called
+ * once everything else is restored, with the image still open. */
+void start_lazy_pager()
+{
+    struct uffdio_register reg;
+    char *stack, *sp;
+    pid_t pid;
+    int i, n = 0;
+
+    if (!n_ranges) {
+	/* Everything the page server had has been fetched */
+	if (server_fd != -1)
+	    close(server_fd);
+	return;
+    }
+
+    /* Our own copy of the image, as its stream is about to be closed */
+    if (lazy_fd != -1)
+	syscall_check(lazy_fd = dup(lazy_fd), 0, "dup");
+    resumed_pid = getpid();
+
+    for (i = 0; i < n_ranges; i++) {
+	memset(&reg, 0, sizeof(reg));
+	reg.range.start = ranges[i].addr;
+	reg.range.len = ranges[i].len;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	if (ioctl(uffd, UFFDIO_REGISTER, &reg) == -1 ||
+		!(reg.ioctls & (1ULL << _UFFDIO_COPY))) {
+	    /* Nobody else will, so it's read in now */
+	    fill_range(&ranges[i]);
+	    ranges[i].len = 0;
+	    continue;
+	}
+	n++;
+    }
+
+    stack = xmalloc(LAZY_STACK_LEN);
+    sp = (char*)((unsigned long)(stack + LAZY_STACK_LEN) & ~15UL);
+    pid = clone(lazy_detach, sp, CLONE_VM | SIGCHLD, NULL);
+    if (pid != -1)
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+	    ;
+    if (pid == -1 || lazy_failed) {
+	fprintf(stderr, "[-] Couldn't start the lazy pager. Restoring memory "
+		"up front.\n");
+	close(uffd);
+	for (i = 0; i < n_ranges; i++)
+	    if (ranges[i].len)
+		fill_range(&ranges[i]);
+	close(lazy_fd);
+	close(server_fd);
+	return;
+    }
+
+    if (verbosity > 0)
+	fprintf(stderr, "Paging in %d ranges lazily.\n", n);
+
+    /* They're the helper's now */
+    close(uffd);
+    close(lazy_fd);
+    close(server_fd);
+}
+
+/* vim:set ts=8 sw=4 noet: */
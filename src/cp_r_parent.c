@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+#include "stub.h"
+
+/* Pages an incremental image leaves to its parent image are restored once
+ * everything else is, by reading through the parent for them. The parent may
+ * leave some of those to its own parent in turn, and so on down the chain.
+ *
+ * They're kept as runs of pages: src is where the page was in the memory of
+ * the image being read, and dest where it's going.
+ */
+struct parent_hole {
+    unsigned long src, dest, len;
+};
+
+struct hole_list {
+    struct parent_hole *h;
+    int n, max;
+};
+
+extern int verbosity;
+
+static struct hole_list holes;	/* what the image being read is to supply */
+static struct hole_list next_holes; /* what's left for the next one down */
+static struct hole_list copies;	/* pages that were copies of others */
+static unsigned long handled;
+static char *parent_name, *next_parent_name;
+
+/* Maps with holes stay writable until they're filled */
+struct deferred_prot {
+    unsigned long start, len;
+    int prot;
+};
+static struct deferred_prot *prots;
+static int n_prots, max_prots;
+
+static void add_hole(struct hole_list *l, unsigned long src,
+	unsigned long dest, unsigned long len, int merge)
+{
+    struct parent_hole *last = l->n ? &l->h[l->n - 1] : NULL;
+
+    if (merge && last && last->src + last->len == src &&
+	    last->dest + last->len == dest) {
+	last->len += len;
+	return;
+    }
+
+    /* No realloc() in the stub, and free() doesn't, but this doubles */
+    if (l->n == l->max) {
+	struct parent_hole *h;
+
+	l->max = l->max ? l->max * 2 : 256;
+	h = xmalloc(l->max * sizeof(struct parent_hole));
+	memcpy(h, l->h, l->n * sizeof(struct parent_hole));
+	free(l->h);
+	l->h = h;
+    }
+    l->h[l->n].src = src;
+    l->h[l->n].dest = dest;
+    l->h[l->n].len = len;
+    l->n++;
+}
+
+/* Called as the image being restored leaves pages to its parent */
+void add_parent_hole(unsigned long addr, unsigned long len)
+{
+    add_hole(&next_holes, addr, addr, len, 1);
+}
+
+void defer_mprotect(unsigned long start, unsigned long len, int prot)
+{
+    if (n_prots == max_prots) {
+	struct deferred_prot *p;
+
+	max_prots = max_prots ? max_prots * 2 : 64;
+	p = xmalloc(max_prots * sizeof(struct deferred_prot));
+	memcpy(p, prots, n_prots * sizeof(struct deferred_prot));
+	free(prots);
+	prots = p;
+    }
+    prots[n_prots].start = start;
+    prots[n_prots].len = len;
+    prots[n_prots].prot = prot;
+    n_prots++;
+}
+
+/* Where to start looking for holes overlapping addr. The holes are sorted
+ * by src, and none is longer than max_hole, so nothing before this can reach
+ * addr. */
+static unsigned long max_hole;
+
+static int first_hole(unsigned long addr)
+{
+    int lo = 0, hi = holes.n;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (holes.h[mid].src + max_hole <= addr)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+int parent_holes_in(unsigned long addr, unsigned long len)
+{
+    int i;
+
+    for (i = first_hole(addr); i < holes.n && holes.h[i].src < addr + len; i++)
+	if (holes.h[i].src + holes.h[i].len > addr)
+	    return 1;
+    return 0;
+}
+
+/* The image being read has [addr, addr+len) as described by how. Deal with
+ * any holes that wanted it. */
+void fill_parent_holes(unsigned long addr, unsigned long len, int how,
+	char *buf, unsigned long from)
+{
+    int i;
+
+    for (i = first_hole(addr); i < holes.n && holes.h[i].src < addr + len; i++) {
+	struct parent_hole *h = &holes.h[i];
+	unsigned long s = h->src > addr ? h->src : addr;
+	unsigned long e = h->src + h->len < addr + len ? h->src + h->len : addr + len;
+	unsigned long dest = h->dest + (s - h->src);
+	unsigned long p;
+
+	if (e <= s)
+	    continue;
+	switch (how) {
+	    case FILL_DATA:
+		memcpy((void*)dest, buf + (s - addr), e - s);
+		break;
+	    case FILL_ZERO:
+		/* Still as fresh from mmap */
+		break;
+	    case FILL_PARENT:
+		add_hole(&next_holes, s, dest, e - s, 1);
+		break;
+	    case FILL_COPY:
+		/* The page it's a copy of came earlier in this image, so it
+		 * takes another pass to get it. */
+		for (p = s; p < e; p += _getpagesize)
+		    add_hole(&copies, from + (p - addr), dest + (p - s),
+			    _getpagesize, 0);
+		break;
+	}
+	handled += e - s;
+    }
+}
+
+void read_chunk_parent(void *fptr, int action)
+{
+    char *name;
+
+    name = read_string(fptr, NULL, 0);
+
+    if (action & ACTION_PRINT)
+	fprintf(stderr, "Parent image: %s", name);
+
+    if (action & ACTION_PARENT)
+	next_parent_name = name;
+    else
+	parent_name = name;
+}
+
+static int hole_cmp(const void *a, const void *b)
+{
+    const struct parent_hole *x = a, *y = b;
+
+    if (x->src != y->src)
+	return x->src < y->src ? -1 : 1;
+    return 0;
+}
+
+/* Makes one pass over a parent image for the holes in l */
+static void read_parent(char *name, struct hole_list *l)
+{
+    unsigned long total = 0;
+    void *fptr;
+    int fd, i, version, type;
+
+    holes = *l;
+    memset(l, 0, sizeof(struct hole_list));
+    qsort(holes.h, holes.n, sizeof(struct parent_hole), hole_cmp);
+    handled = 0;
+    max_hole = 0;
+    for (i = 0; i < holes.n; i++) {
+	total += holes.h[i].len;
+	if (holes.h[i].len > max_hole)
+	    max_hole = holes.h[i].len;
+    }
+
+    fd = open(name, O_RDONLY);
+    if (fd == -1)
+	bail("Unable to open parent image %s: %s", name, strerror(errno));
+    /* The parent may be an older version, or checksummed differently */
+    version = image_version;
+    type = checksum_type;
+    seek_to_image(fd);
+
+    fptr = stream_ops->init(fd, O_RDONLY);
+    if (!fptr)
+	bail("Unable to initialize reader for %s.", name);
+    while (read_chunk(fptr, ACTION_PARENT));
+    stream_ops->finish(fptr);
+    image_version = version;
+    checksum_type = type;
+
+    if (handled != total)
+	bail("%ld KB of memory missing from parent image %s!",
+		(total - handled) >> 10, name);
+
+    free(holes.h);
+    memset(&holes, 0, sizeof(struct hole_list));
+}
+
+/* Fills in the pages left to parent images, once the rest of the image has
+ * been restored. */
+void restore_from_parents()
+{
+    char *name = parent_name;
+    int i;
+
+    while (next_holes.n) {
+	if (!name)
+	    bail("Image needs pages from a parent image, but names none!");
+	if (verbosity > 0)
+	    fprintf(stderr, "Reading unchanged pages from %s...\n", name);
+
+	next_parent_name = NULL;
+	read_parent(name, &next_holes);
+	if (copies.n)
+	    read_parent(name, &copies);
+	name = next_parent_name;
+    }
+
+    for (i = 0; i < n_prots; i++)
+	syscall_check(mprotect((void*)prots[i].start, prots[i].len,
+		    prots[i].prot), 0, "mprotect");
+    n_prots = 0;
+}
+
+/* vim:set ts=8 sw=4 noet: */
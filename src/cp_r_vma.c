@@ -11,6 +11,300 @@
 
 int extra_prot_flags;
 
+static void read_chunk_vma_ranges(void *fptr, struct cp_vma *vma)
+{
+    read_bit(fptr, &vma->n_ranges, sizeof(int));
+    vma->ranges = NULL;
+    if (vma->n_ranges) {
+	vma->ranges = xmalloc(vma->n_ranges * sizeof(struct cp_vma_range));
+	read_bit(fptr, vma->ranges,
+		vma->n_ranges * sizeof(struct cp_vma_range));
+    }
+}
+
+/* Reads in a VMA_DATA_PAGES map, or skips over it if discard is set. The
+ * literal pages of each group come packed together, so they're read to the
+ * start of the group and spread out from there. Returns how many pages are
+ * left to the parent image.
+ */
+static int read_vma_pages(void *fptr, struct cp_vma *vma, int discard)
+{
+    static unsigned long desc[VMA_PAGE_GROUP];
+    int page = _getpagesize;
+    int i, j, k, from_parent = 0;
+
+    for (i = 0; i < vma->n_ranges; i++) {
+	char *dest = (char*)vma->data + vma->ranges[i].offset;
+	unsigned long left = vma->ranges[i].length / page;
+
+	while (left > 0) {
+	    int n = left > VMA_PAGE_GROUP ? VMA_PAGE_GROUP : left;
+	    int lit = 0;
+
+	    read_bit(fptr, desc, n * sizeof(unsigned long));
+	    for (j = 0; j < n; j++)
+		if (desc[j] == VMA_PAGE_LITERAL)
+		    lit++;
+
+	    if (discard) {
+		discard_bit(fptr, lit * page);
+	    } else {
+		read_data(fptr, dest, lit * page);
+
+		/* Working backwards, nothing is overwritten before it's moved.
+		 * Only the pages that held literal data need clearing; the
+		 * rest are still fresh from mmap. */
+		for (j = n - 1, k = lit; j >= 0; j--) {
+		    if (desc[j] == VMA_PAGE_LITERAL) {
+			if (--k != j)
+			    memcpy(dest + j * page, dest + k * page, page);
+		    } else if ((desc[j] == VMA_PAGE_ZERO ||
+				desc[j] == VMA_PAGE_PARENT) && j < lit)
+			memset(dest + j * page, 0, page);
+		}
+		for (j = 0; j < n; j++) {
+		    if (desc[j] == VMA_PAGE_PARENT) {
+			add_parent_hole((unsigned long)dest + j * page, page);
+			from_parent++;
+		    } else if (desc[j] != VMA_PAGE_LITERAL &&
+			    desc[j] != VMA_PAGE_ZERO &&
+			    !lazy_read_page(desc[j], dest + j * page))
+			memcpy(dest + j * page, (void*)desc[j], page);
+		}
+	    }
+
+	    dest += n * page;
+	    left -= n;
+	}
+    }
+    return from_parent;
+}
+
+/* Like read_data(), but for data belonging at addr in a parent image's
+ * memory, which is handed to any holes that want it. */
+static void fill_from_bit(void *fptr, unsigned long addr, unsigned long len)
+{
+    static char buf[65536];
+    unsigned long off;
+    unsigned int want, sum = 0;
+
+    if (!len)
+	return;
+    if (!parent_holes_in(addr, len)) {
+	discard_bit(fptr, len);
+	return;
+    }
+
+    want = read_bit_begin(fptr);
+    for (off = 0; off < len; off += sizeof(buf)) {
+	int n = len - off > sizeof(buf) ? sizeof(buf) : len - off;
+	read_bit_part(fptr, buf, n, &sum);
+	fill_parent_holes(addr + off, n, FILL_DATA, buf, 0);
+    }
+    read_bit_end(want, sum, len);
+}
+
+static void fill_from_pages(void *fptr, unsigned long addr, unsigned long len)
+{
+    static unsigned long desc[VMA_PAGE_GROUP];
+    static char buf[65536];
+    int page = _getpagesize;
+    unsigned long left = len / page;
+
+    while (left > 0) {
+	int n = left > VMA_PAGE_GROUP ? VMA_PAGE_GROUP : left;
+	int j, lit = 0;
+	unsigned int want = 0, sum = 0;
+
+	read_bit(fptr, desc, n * sizeof(unsigned long));
+	for (j = 0; j < n; j++)
+	    if (desc[j] == VMA_PAGE_LITERAL)
+		lit++;
+
+	if (!parent_holes_in(addr, n * page)) {
+	    discard_bit(fptr, lit * page);
+	} else {
+	    if (lit)
+		want = read_bit_begin(fptr);
+	    for (j = 0; j < n; j++) {
+		unsigned long pa = addr + j * page;
+
+		switch (desc[j]) {
+		    case VMA_PAGE_LITERAL:
+			read_bit_part(fptr, buf, page, &sum);
+			fill_parent_holes(pa, page, FILL_DATA, buf, 0);
+			break;
+		    case VMA_PAGE_ZERO:
+			fill_parent_holes(pa, page, FILL_ZERO, NULL, 0);
+			break;
+		    case VMA_PAGE_PARENT:
+			fill_parent_holes(pa, page, FILL_PARENT, NULL, 0);
+			break;
+		    default:
+			fill_parent_holes(pa, page, FILL_COPY, NULL, desc[j]);
+			break;
+		}
+	    }
+	    if (lit)
+		read_bit_end(want, sum, lit * page);
+	}
+
+	addr += n * page;
+	left -= n;
+    }
+}
+
+/* A map that wasn't saved came from its file, which had better not have
+ * changed since. */
+static void fill_from_file(struct cp_vma *vma)
+{
+    static char buf[65536];
+    unsigned long off;
+    unsigned int c = 0;
+    int fd;
+
+    syscall_check(fd = open(vma->filename, O_RDONLY), 0, "open(%s)",
+	    vma->filename);
+    syscall_check(lseek(fd, vma->pg_off, SEEK_SET), 0, "lseek(%s)",
+	    vma->filename);
+    for (off = 0; off < vma->length; off += sizeof(buf)) {
+	int n = vma->length - off > sizeof(buf) ? sizeof(buf) : vma->length - off;
+	int got = 0, r;
+
+	while (got < n && (r = read(fd, buf + got, n - got)) > 0)
+	    got += r;
+	memset(buf + got, 0, n - got); /* past the end of the file */
+	c = map_checksum(buf, n, c);
+	fill_parent_holes(vma->start + off, n, FILL_DATA, buf, 0);
+    }
+    close(fd);
+
+    if (c != vma->checksum)
+	bail("%s has changed since the parent image was taken!", vma->filename);
+}
+
+/* Reading a parent image: hands over whatever a map has for the holes left
+ * by the images after it. */
+static void fill_from_vma(void *fptr, struct cp_vma *vma)
+{
+    unsigned long prev = 0;
+    int i, fd;
+
+    switch (vma->have_data) {
+	case VMA_DATA_NONE:
+	    if (vma->filename[0] && parent_holes_in(vma->start, vma->length))
+		fill_from_file(vma);
+	    break;
+	case VMA_DATA_FULL:
+	    read_align(fptr, &fd);
+	    fill_from_bit(fptr, vma->start, vma->length);
+	    break;
+	case VMA_DATA_SPARSE:
+	case VMA_DATA_PAGES:
+	    /* Anything outside the ranges was zero */
+	    for (i = 0; i < vma->n_ranges; i++) {
+		unsigned long addr = vma->start + vma->ranges[i].offset;
+
+		fill_parent_holes(vma->start + prev,
+			vma->ranges[i].offset - prev, FILL_ZERO, NULL, 0);
+		if (vma->have_data == VMA_DATA_SPARSE) {
+		    read_align(fptr, &fd);
+		    fill_from_bit(fptr, addr, vma->ranges[i].length);
+		} else
+		    fill_from_pages(fptr, addr, vma->ranges[i].length);
+		prev = vma->ranges[i].offset + vma->ranges[i].length;
+	    }
+	    fill_parent_holes(vma->start + prev, vma->length - prev, FILL_ZERO,
+		    NULL, 0);
+	    break;
+	case VMA_DATA_REMOTE:
+	    if (parent_holes_in(vma->start, vma->length))
+		bail("The parent image left its memory at 0x%lx to a page "
+			"server!", vma->start);
+	    break;
+    }
+}
+
+static void discard_vma_data(void *fptr, struct cp_vma *vma)
+{
+    int i, fd;
+
+    switch (vma->have_data) {
+	case VMA_DATA_FULL:
+	    read_align(fptr, &fd);
+	    discard_bit(fptr, vma->length);
+	    break;
+	case VMA_DATA_SPARSE:
+	    for (i = 0; i < vma->n_ranges; i++) {
+		read_align(fptr, &fd);
+		discard_bit(fptr, vma->ranges[i].length);
+	    }
+	    break;
+	case VMA_DATA_PAGES:
+	    read_vma_pages(fptr, vma, 1);
+	    break;
+    }
+    vma->have_data = VMA_DATA_NONE;
+}
+
+/* Where the data's page aligned in an uncompressed image, it's mapped
+ * straight from the file rather than read in. That's private, so the image
+ * is left alone, and processes resumed from the same image share the pages
+ * until they write to them. It isn't checksummed, as that would mean reading
+ * it all in anyway. Returns 0 if it has to be read. */
+static int map_bit(void *fptr, struct cp_vma *vma, unsigned long addr,
+	unsigned long len)
+{
+    unsigned int c;
+    long off;
+    int fd;
+
+    off = read_align(fptr, &fd);
+    if (off == -1 || !vma_mappable(vma) || (len & (_getpagesize - 1)))
+	return 0;
+
+    stream_ops->read(fptr, &c, sizeof(c));
+    syscall_check((long)mmap((void*)addr, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_FIXED, fd, off), 0,
+	    "mmap(0x%lx, 0x%lx) from the image", addr, len);
+    stream_ops->skip(fptr, len);
+    return 1;
+}
+
+/* Returns how many pages are left to the parent image */
+static int read_vma_data(void *fptr, struct cp_vma *vma)
+{
+    int prot = vma->prot | extra_prot_flags;
+    int i;
+
+    switch (vma->have_data) {
+	case VMA_DATA_FULL:
+	    if (!map_bit(fptr, vma, vma->start, vma->length) &&
+		    !lazy_bit(fptr, vma->start, vma->length, prot))
+		read_data(fptr, vma->data, vma->length);
+	    break;
+	case VMA_DATA_SPARSE:
+	    /* Anything not listed stays as the zero pages from mmap */
+	    for (i = 0; i < vma->n_ranges; i++) {
+		char *p = (char*)vma->data + vma->ranges[i].offset;
+		unsigned long len = vma->ranges[i].length;
+
+		if (!map_bit(fptr, vma, (unsigned long)p, len) &&
+			!lazy_bit(fptr, (unsigned long)p, len, prot))
+		    read_data(fptr, p, len);
+	    }
+	    break;
+	case VMA_DATA_PAGES:
+	    return read_vma_pages(fptr, vma, 0);
+	case VMA_DATA_REMOTE:
+	    for (i = 0; i < vma->n_ranges; i++)
+		lazy_remote(vma->start + vma->ranges[i].offset,
+			vma->ranges[i].length, prot);
+	    break;
+    }
+    return 0;
+}
+
 void read_chunk_vma(void *fptr, int action)
 {
     struct cp_vma vma;
@@ -28,6 +322,14 @@ void read_chunk_vma(void *fptr, int action)
     read_bit(fptr, &vma.have_data, sizeof(vma.have_data));
     read_bit(fptr, &vma.checksum, sizeof(vma.checksum));
     read_bit(fptr, &vma.is_heap, sizeof(vma.is_heap));
+    if (image_version == IMAGE_VERSION_V3 && vma.have_data > VMA_DATA_FULL)
+	bail("Bad data type for a map in a version 3 image (%d)!",
+		vma.have_data);
+    vma.n_ranges = 0;
+    vma.ranges = NULL;
+    if (vma.have_data == VMA_DATA_SPARSE || vma.have_data == VMA_DATA_PAGES ||
+	    vma.have_data == VMA_DATA_REMOTE)
+	read_chunk_vma_ranges(fptr, &vma);
 
     if (action & ACTION_PRINT) {
 	fprintf(stderr, "VMA %08lx-%08lx (size:%8ld) %c%c%c%c %08lx %02x:%02x %d\t%s",
@@ -42,6 +344,18 @@ void read_chunk_vma(void *fptr, int action)
 		vma.inode,
 		vma.filename
 		);
+	if (vma.have_data == VMA_DATA_SPARSE)
+	    fprintf(stderr, " (sparse, %d ranges)", vma.n_ranges);
+	if (vma.have_data == VMA_DATA_PAGES)
+	    fprintf(stderr, " (paged, %d ranges)", vma.n_ranges);
+	if (vma.have_data == VMA_DATA_REMOTE)
+	    fprintf(stderr, " (served, %d ranges)", vma.n_ranges);
+    }
+
+    if (action & ACTION_PARENT) {
+	fill_from_vma(fptr, &vma);
+	free(vma.ranges);
+	return;
     }
 
     fd = -1;
@@ -64,7 +378,7 @@ void read_chunk_vma(void *fptr, int action)
 		rlen = read(fd, buf, len);
 		if (rlen == 0)
 		    break;
-		c = checksum(buf, rlen, c);
+		c = map_checksum(buf, rlen, c);
 		remaining -= rlen;
 	    }
 	    /* Pad out the rest with NULLs */
@@ -73,16 +387,14 @@ void read_chunk_vma(void *fptr, int action)
 		int remsz = sizeof(buf);
 		if (remsz > remaining)
 		    remsz = remaining;
-		c = checksum(buf, remsz, c);
+		c = map_checksum(buf, remsz, c);
 		remaining -= remsz;
 	    }
 	    if (remaining == 0) {
 		if (c == vma.checksum) {
 		    /* we can just load it from disk, save memory */
-		    if (vma.have_data) {
-			vma.have_data = 0;
-			discard_bit(fptr, vma.length);
-		    }
+		    if (vma.have_data)
+			discard_vma_data(fptr, &vma);
 		    good_lib = 1;
 		} else
 		    close(fd);
@@ -107,9 +419,11 @@ void read_chunk_vma(void *fptr, int action)
 		0, "mmap(0x%lx, 0x%lx, 0x%x, 0x%x, -1, 0)",
 		vma.data, vma.length, vma.prot,
 		MAP_ANONYMOUS | MAP_FIXED | vma.flags);
-	read_bit(fptr, vma.data, vma.length);
-	syscall_check(mprotect((void*)vma.data, vma.length,
-		    vma.prot | extra_prot_flags), 0, "mprotect");
+	if (read_vma_data(fptr, &vma))
+	    defer_mprotect(vma.start, vma.length, vma.prot | extra_prot_flags);
+	else
+	    syscall_check(mprotect((void*)vma.data, vma.length,
+			vma.prot | extra_prot_flags), 0, "mprotect");
     } else if (vma.filename[0]) {
 	if (fd == -1)
 	    syscall_check(fd = open(vma.filename, O_RDONLY), 0,
@@ -125,6 +439,7 @@ void read_chunk_vma(void *fptr, int action)
 		    vma.prot | extra_prot_flags), 0, "mprotect");
     } else
 	bail("No source for map 0x%lx (size 0x%lx)", vma.start, vma.length);
+    free(vma.ranges);
 }
 
 /* vim:set ts=8 sw=4 noet: */
@@ -5,6 +5,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 
 #include "cryopid.h"
 #include "process.h"
@@ -73,53 +74,219 @@ static dev_t get_term_dev(pid_t pid)
     return term_dev;
 }
 
+/* The fds the target has open, from /proc/pid/fd */
+static int *list_fds(pid_t pid, int *n)
+{
+    struct dirent *fd_dirent;
+    DIR *proc_fd;
+    char tmp_fn[30];
+    int *fds = NULL, max = 0;
+
+    *n = 0;
+    snprintf(tmp_fn, 30, "/proc/%d/fd", pid);
+    proc_fd = opendir(tmp_fn);
+    if (proc_fd == NULL)
+	bail("Unable to open %s: %s", tmp_fn, strerror(errno));
+    while ((fd_dirent = readdir(proc_fd)) != NULL) {
+	if (fd_dirent->d_type != DT_LNK)
+	    continue;
+	if (*n == max) {
+	    max = max ? max * 2 : 64;
+	    fds = realloc(fds, max * sizeof(int));
+	    if (!fds)
+		bail("Out of memory!");
+	}
+	fds[(*n)++] = atoi(fd_dirent->d_name);
+    }
+    closedir(proc_fd);
+    return fds;
+}
+
+/* Copies n of the target's fds into our own, with pidfd_getfd(), leaving
+ * each copy (or -1) in local. Returns how many were had.
+ */
+int take_fds(pid_t pid, int n, int *fds, int *local)
+{
+#if defined(__NR_pidfd_open) && defined(__NR_pidfd_getfd)
+    int pidfd, i, got = 0;
+
+    for (i = 0; i < n; i++)
+	local[i] = -1;
+    if ((pidfd = syscall(__NR_pidfd_open, pid, 0)) == -1) {
+	debug("[-] pidfd_open: %s", strerror(errno));
+	return 0;
+    }
+    for (i = 0; i < n; i++) {
+	local[i] = syscall(__NR_pidfd_getfd, pidfd, fds[i], 0);
+	if (local[i] == -1)
+	    debug("[-] pidfd_getfd(%d): %s", fds[i], strerror(errno));
+	else
+	    got++;
+    }
+    close(pidfd);
+    return got;
+#else
+    int i;
+
+    for (i = 0; i < n; i++)
+	local[i] = -1;
+    debug("[-] No pidfd_getfd() to take the target's fds with.");
+    return 0;
+#endif
+}
+
+/* Reads what fcntl() and lseek() would say about an fd from
+ * /proc/pid/fdinfo/fd, without bothering the target. Kernels before 3.15
+ * (which added mnt_id) don't always say if it's close-on-exec there, so it
+ * returns 0 for those, to be asked the slow way.
+ */
+static int read_fdinfo(pid_t pid, int fd, struct cp_fd *cfd)
+{
+    char fn[40], buf[512], *p;
+    int ifd, len, have = 0;
+    unsigned long fl = 0;
+
+    snprintf(fn, sizeof(fn), "/proc/%d/fdinfo/%d", pid, fd);
+    if ((ifd = open(fn, O_RDONLY)) == -1)
+	return 0;
+    len = read(ifd, buf, sizeof(buf) - 1);
+    close(ifd);
+    if (len <= 0)
+	return 0;
+    buf[len] = '\0';
+
+    for (p = buf; p && *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : NULL) {
+	if (strncmp(p, "pos:", 4) == 0) {
+	    cfd->offset = strtoll(p + 4, NULL, 10);
+	    have |= 1;
+	} else if (strncmp(p, "flags:", 6) == 0) {
+	    fl = strtoul(p + 6, NULL, 8);
+	    have |= 2;
+	} else if (strncmp(p, "mnt_id:", 7) == 0)
+	    have |= 4;
+    }
+    if (have != 7)
+	return 0;
+
+    cfd->close_on_exec = (fl & O_CLOEXEC) ? FD_CLOEXEC : 0;
+    cfd->fcntl_status = fl & ~O_CLOEXEC;
+    cfd->mode = fl & O_ACCMODE;
+    return 1;
+}
+
+static void add_call(struct r_call *c, int nr, unsigned long a0,
+	unsigned long a1, unsigned long a2)
+{
+    memset(c, 0, sizeof(struct r_call));
+    c->nr = nr;
+    c->args[0] = a0;
+    c->args[1] = a1;
+    c->args[2] = a2;
+}
+
 void fetch_chunks_fd(pid_t pid, int flags, struct list *l)
 {
     struct cp_chunk *chunk = NULL;
-    struct dirent *fd_dirent;
     struct stat stat_buf;
-    DIR *proc_fd;
+    struct r_call *calls;
+    struct cp_fd *info;
     char tmp_fn[1024];
     dev_t term_dev = get_term_dev(pid);
     int max_fd = 0;
+    int *fds, *slow, *seek, *chr, *chr_fds, *local, n_fds, n_chr = 0;
+    int n_calls = 0, i;
 
-    snprintf(tmp_fn, 30, "/proc/%d/fd", pid);
-    proc_fd = opendir(tmp_fn);
-    for (;;) {
-	if (!chunk)
-	    chunk = xmalloc(sizeof(struct cp_chunk));
+    /* Most kernels tell us all we need in /proc/pid/fdinfo. The rest ask the
+     * target, in one batch of remote calls. */
+    fds = list_fds(pid, &n_fds);
+    info = xmalloc(n_fds * sizeof(struct cp_fd));
+    slow = xmalloc(n_fds * sizeof(int));
+    seek = xmalloc(n_fds * sizeof(int));
+    chr = xmalloc(n_fds * sizeof(int));
+    chr_fds = xmalloc(n_fds * sizeof(int));
+    local = xmalloc(n_fds * sizeof(int));
+    calls = xmalloc(3 * n_fds * sizeof(struct r_call));
+    for (i = 0; i < n_fds; i++) {
+	slow[i] = seek[i] = -1;
+	if (read_fdinfo(pid, fds[i], &info[i])) {
+	    snprintf(tmp_fn, 1024, "/proc/%d/fd/%d", pid, fds[i]);
+	    if (stat(tmp_fn, &stat_buf) == 0 && S_ISCHR(stat_buf.st_mode))
+		chr[n_chr++] = i;
+	    continue;
+	}
+	slow[i] = n_calls;
+	add_call(&calls[n_calls++], __NR_fcntl, fds[i], F_GETFD, 0);
+	add_call(&calls[n_calls++], __NR_fcntl, fds[i], F_GETFL, 0);
+	add_call(&calls[n_calls++], __NR_lseek, fds[i], 0, SEEK_CUR);
+    }
 
-	fd_dirent = readdir(proc_fd);
-	if (fd_dirent == NULL)
-	    break;
+    /* fdinfo has a position for character devices too, but it only means
+     * anything if they're seekable (unlike ttys), which only lseek() can
+     * say. That's asked of copies of them where possible, or else of the
+     * target. */
+    for (i = 0; i < n_chr; i++)
+	chr_fds[i] = fds[chr[i]];
+    if (n_chr)
+	take_fds(pid, n_chr, chr_fds, local);
+    for (i = 0; i < n_chr; i++) {
+	if (local[i] == -1) {
+	    seek[chr[i]] = n_calls;
+	    add_call(&calls[n_calls++], __NR_lseek, fds[chr[i]], 0, SEEK_CUR);
+	} else {
+	    if (lseek(local[i], 0, SEEK_CUR) == -1)
+		info[chr[i]].offset = -1;
+	    close(local[i]);
+	}
+    }
 
-	if (fd_dirent->d_type != DT_LNK)
-	    continue;
+    if (n_calls)
+	r_syscalls(pid, calls, n_calls);
 
-	chunk->fd.fd = atoi(fd_dirent->d_name);
+    for (i = 0; i < n_fds; i++) {
+	if (!chunk)
+	    chunk = xmalloc(sizeof(struct cp_chunk));
+
+	chunk->fd.fd = fds[i];
 
 	if (chunk->fd.fd > max_fd)
 	    max_fd = chunk->fd.fd;
 
-	/* Find out if it's open for r/w/rw */
 	snprintf(tmp_fn, 1024, "/proc/%d/fd/%d", pid, chunk->fd.fd);
-	lstat(tmp_fn, &stat_buf);
 
-	if ((stat_buf.st_mode & S_IRUSR) && (stat_buf.st_mode & S_IWUSR))
-	    chunk->fd.mode = O_RDWR;
-	else if (stat_buf.st_mode & S_IWUSR)
-	    chunk->fd.mode = O_WRONLY;
-	else
-	    chunk->fd.mode = O_RDONLY;
+	if (slow[i] == -1) {
+	    chunk->fd.mode = info[i].mode;
+	    chunk->fd.close_on_exec = info[i].close_on_exec;
+	    chunk->fd.fcntl_status = info[i].fcntl_status;
+	    chunk->fd.offset = info[i].offset;
+	} else {
+	    struct r_call *c = &calls[slow[i]];
 
-	chunk->fd.close_on_exec = r_fcntl(pid, chunk->fd.fd, F_GETFD);
-	chunk->fd.fcntl_status = r_fcntl(pid, chunk->fd.fd, F_GETFL);
-	chunk->fd.offset = r_lseek(pid, chunk->fd.fd, 0, SEEK_CUR);
+	    /* Find out if it's open for r/w/rw */
+	    lstat(tmp_fn, &stat_buf);
+
+	    if ((stat_buf.st_mode & S_IRUSR) && (stat_buf.st_mode & S_IWUSR))
+		chunk->fd.mode = O_RDWR;
+	    else if (stat_buf.st_mode & S_IWUSR)
+		chunk->fd.mode = O_WRONLY;
+	    else
+		chunk->fd.mode = O_RDONLY;
+
+	    chunk->fd.close_on_exec = c[0].ret;
+	    chunk->fd.fcntl_status = c[1].ret;
+	    chunk->fd.offset = c[2].ret;
+	}
 
 	/* This time stat the file/fifo/socket/etc, not the link */
 	if (stat(tmp_fn, &stat_buf) < 0)
 	    bail("Failed to stat(%s): %s", tmp_fn, strerror(errno));
 
+	/* fdinfo has a position for everything, but lseek() wouldn't */
+	if (slow[i] == -1 && (S_ISFIFO(stat_buf.st_mode) ||
+		    S_ISSOCK(stat_buf.st_mode)))
+	    chunk->fd.offset = -1;
+	if (seek[i] != -1 && calls[seek[i]].ret == -1)
+	    chunk->fd.offset = -1;
+
 	switch (stat_buf.st_mode & S_IFMT) {
 	    case S_IFCHR:
 		/* FIXME - only save termios for consoles once */
@@ -165,6 +332,17 @@ void fetch_chunks_fd(pid_t pid, int flags, struct list *l)
 	chunk = NULL;
     }
 
+    finish_fd_sockets(pid, flags);
+
+    free(calls);
+    free(local);
+    free(chr_fds);
+    free(chr);
+    free(seek);
+    free(slow);
+    free(info);
+    free(fds);
+
     /* Note the highest used fd */
     chunk = xmalloc(sizeof(struct cp_chunk));
     chunk->type = CP_CHUNK_FD;
@@ -10,19 +10,14 @@
 #include "cpimage.h"
 #include "process.h"
 
-static int get_file_size(pid_t pid, int fd)
+/* The same file is open here, so there's no need to ask the target */
+static int get_file_size(char *fd_path)
 {
-    int offset, sz;
-    offset = r_lseek(pid, fd, 0, SEEK_CUR);
-    if (offset == -1)
-	goto out_err;
-    sz = r_lseek(pid, fd, 0, SEEK_END);
-    if (sz == -1)
-	goto out_err;
-    r_lseek(pid, fd, offset, SEEK_SET);
-    return sz;
-out_err:
-    return 0;
+    struct stat st;
+
+    if (stat(fd_path, &st) == -1)
+	return 0;
+    return st.st_size;
 }
 
 static int scrape_contents(pid_t pid, int fd, int size, void* data)
@@ -54,7 +49,7 @@ void fetch_fd_file(pid_t pid, int flags, int fd, int inode, char *fd_path,
 
     file->filename = NULL;
     file->deleted = 0;
-    file->size = get_file_size(pid, fd);
+    file->size = get_file_size(fd_path);
     file->contents = NULL;
 
     do {
@@ -96,7 +91,7 @@ void write_chunk_fd_file(void *fptr, struct cp_file *file)
     write_bit(fptr, &file->size, sizeof(int));
     write_bit(fptr, &have_contents, sizeof(int));
     if (file->contents)
-	write_bit(fptr, file->contents, file->size);
+	write_data(fptr, file->contents, file->size);
 }
 
 /* vim:set ts=8 sw=4 noet: */
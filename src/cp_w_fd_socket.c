@@ -6,11 +6,20 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/unix_diag.h>
 
 #include "cryopid.h"
 #include "process.h"
 #include "cpimage.h"
 #include "tcpcp.h"
+#include "tcprepair.h"
 
 /* dietlibc doesn't play ball with isdigit */
 #define isdigit(x) ((x) >= '0' && (x) <= '9')
@@ -20,81 +29,191 @@
 #define PROTO_UDP	17
 #define PROTO_X		666
 
-struct unix_sock_info_t {
+/* Every TCP and UNIX socket on the system, by inode. It's built once, the
+ * first time a socket's looked up, from the kernel's sock_diag interface or,
+ * failing that, /proc/net/tcp and /proc/net/unix.
+ */
+struct sock_entry {
+    unsigned long inode;
+    int proto;
     int listening;
-    int type;
-    int state;
-    char path[108]; /* As defined in sys/un.h */
+    struct sockaddr_in peer; /* For TCP sockets */
+    int type, state; /* For UNIX sockets */
 };
+static struct sock_entry *sock_table;
+static unsigned long sock_table_size, sock_table_used;
+static int sock_table_built;
 
-static int get_tcp_socket(struct cp_socket_tcp *tcp, pid_t pid, int fd, int inode)
+static void grow_sock_table()
+{
+    struct sock_entry *old = sock_table;
+    unsigned long i, j, old_size = sock_table_size;
+
+    sock_table_size = old_size ? old_size * 2 : 1024;
+    sock_table = xmalloc(sock_table_size * sizeof(struct sock_entry));
+    memset(sock_table, 0, sock_table_size * sizeof(struct sock_entry));
+    for (i = 0; i < old_size; i++) {
+	if (!old[i].inode)
+	    continue;
+	for (j = old[i].inode & (sock_table_size - 1); sock_table[j].inode;
+		j = (j + 1) & (sock_table_size - 1))
+	    ;
+	sock_table[j] = old[i];
+    }
+    free(old);
+}
+
+static struct sock_entry *add_sock(unsigned long inode, int proto)
+{
+    unsigned long i;
+
+    if (sock_table_used * 2 >= sock_table_size)
+	grow_sock_table();
+    for (i = inode & (sock_table_size - 1); sock_table[i].inode;
+	    i = (i + 1) & (sock_table_size - 1))
+	if (sock_table[i].inode == inode)
+	    return &sock_table[i];
+    sock_table[i].inode = inode;
+    sock_table[i].proto = proto;
+    sock_table_used++;
+    return &sock_table[i];
+}
+
+static struct sock_entry *find_sock(unsigned long inode)
+{
+    unsigned long i;
+
+    if (!sock_table_size || !inode)
+	return NULL;
+    for (i = inode & (sock_table_size - 1); sock_table[i].inode;
+	    i = (i + 1) & (sock_table_size - 1))
+	if (sock_table[i].inode == inode)
+	    return &sock_table[i];
+    return NULL;
+}
+
+/* Asks for a dump of one family's sockets over NETLINK_SOCK_DIAG, and adds
+ * them to the table. Returns 0 if the kernel can't do it. */
+static int diag_dump(int family)
+{
+    struct {
+	struct nlmsghdr nlh;
+	union {
+	    struct inet_diag_req_v2 inet_req;
+	    struct unix_diag_req unix_req;
+	};
+    } req;
+    struct sockaddr_nl sa;
+    static char buf[32768];
+    int nl, done = 0, ok = 0;
+
+    if ((nl = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_SOCK_DIAG)) == -1)
+	return 0;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+    if (family == AF_UNIX) {
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct unix_diag_req));
+	req.unix_req.sdiag_family = AF_UNIX;
+	req.unix_req.udiag_states = ~0U;
+    } else {
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct inet_diag_req_v2));
+	req.inet_req.sdiag_family = AF_INET;
+	req.inet_req.sdiag_protocol = IPPROTO_TCP;
+	req.inet_req.idiag_states = ~0U;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    if (sendto(nl, &req, req.nlh.nlmsg_len, 0, (struct sockaddr*)&sa,
+		sizeof(sa)) == -1)
+	goto out;
+
+    while (!done) {
+	struct nlmsghdr *h;
+	int len = recv(nl, buf, sizeof(buf), 0);
+
+	if (len <= 0)
+	    goto out;
+	for (h = (struct nlmsghdr*)buf; NLMSG_OK(h, len);
+		h = NLMSG_NEXT(h, len)) {
+	    if (h->nlmsg_type == NLMSG_DONE) {
+		done = 1;
+		break;
+	    }
+	    if (h->nlmsg_type == NLMSG_ERROR)
+		goto out;
+	    if (family == AF_UNIX) {
+		struct unix_diag_msg *m = NLMSG_DATA(h);
+		struct sock_entry *e = add_sock(m->udiag_ino, PROTO_UNIX);
+
+		e->type = m->udiag_type;
+		e->listening = (m->udiag_state == TCP_LISTEN);
+		/* As /proc/net/unix would have it */
+		e->state = (m->udiag_state == TCP_ESTABLISHED) ?
+		    SS_CONNECTED : SS_UNCONNECTED;
+	    } else {
+		struct inet_diag_msg *m = NLMSG_DATA(h);
+		struct sock_entry *e = add_sock(m->idiag_inode, PROTO_TCP);
+
+		e->listening = (m->idiag_state == TCP_LISTEN);
+		e->peer.sin_family = AF_INET;
+		e->peer.sin_addr.s_addr = m->id.idiag_dst[0];
+		e->peer.sin_port = m->id.idiag_dport;
+	    }
+	}
+    }
+    ok = 1;
+out:
+    close(nl);
+    return ok;
+}
+
+static void scan_proc_tcp()
 {
     char line[200], *p;
+    unsigned long addr;
+    unsigned int port, state;
+    struct sock_entry *e;
     int i;
     FILE *f;
-    struct sockaddr_in sin;
-    int sz;
-    
+
     f = fopen("/proc/net/tcp", "r");
     if (f == NULL) {
 	debug("Couldn't open /proc/net/tcp!");
-	return 0;
+	return;
     }
 
     fgets(line, 200, f); /* ignore first line */
-    while ((p = fgets(line, 200, f))) {
+    while (fgets(line, 200, f)) {
+	/* The remote address is as the kernel has it, the port isn't */
+	if (sscanf(line, "%*d: %*x:%*x %lx:%x %x", &addr, &port, &state) != 3)
+	    continue;
 	p = line;
 	for (i = 0; i < 9; i++) {
 	    while(*p && (*p == ' ' || *p == '\t')) p++;
 	    while(*p && (*p != ' ' && *p != '\t')) p++;
 	}
 	/* p now points at inode */
-	if (atoi(p) == inode)
-	    break;
-    }
-    if (!p) /* no match */
-	return 0;
-
-    /* We have a match, now just parse the line */
-
-
-
-    /* If it is on port 6000-6003, consider it an X display */
-    sz = sizeof(sin);
-    if (r_getpeername(pid, fd, (struct sockaddr*)&sin, &sz) == 0) {
-	int port = htons(sin.sin_port);
-	printf("fd %d connects to %d.%d.%d.%d:%d\n", fd,
-		(sin.sin_addr.s_addr >> 0 ) & 0xff,
-		(sin.sin_addr.s_addr >> 8 ) & 0xff,
-		(sin.sin_addr.s_addr >> 16) & 0xff,
-		(sin.sin_addr.s_addr >> 24) & 0xff,
-		port);
-	if (6000 <= port && port <= 6003)
-	    return PROTO_X;
+	e = add_sock(strtoul(p, NULL, 10), PROTO_TCP);
+	e->listening = (state == TCP_LISTEN);
+	e->peer.sin_family = AF_INET;
+	e->peer.sin_addr.s_addr = addr;
+	e->peer.sin_port = htons(port);
     }
-
-#ifdef USE_TCPCP
-    /* FIXME: verify state and handle other ones */
-
-    p = line;
-    tcp->ici = tcpcp_get(pid, fd);
-
-    if (!tcp->ici)
-	debug("tcpcp_get(%d, %d): %s (%d)", pid, fd, strerror(errno), errno);
-    debug("ici is %p", tcp->ici);
-#endif
-    return PROTO_TCP;
+    fclose(f);
 }
 
-static int get_socket_info(int inode, struct unix_sock_info_t *info)
+static void scan_proc_unix()
 {
     FILE *f;
     char line[512], *p;
+    struct sock_entry e;
 
     f = fopen("/proc/net/unix", "r");
     if (f == NULL) {
 	debug("Couldn't open /proc/net/unix!");
-	return 0;
+	return;
     }
 
     /*
@@ -115,58 +234,115 @@ static int get_socket_info(int inode, struct unix_sock_info_t *info)
 	/* Protocol */
 	skip_to_next();
 	/* Flags */
-	info->listening = (strtoul(p, NULL, 16) & __SO_ACCEPTCON);
+	e.listening = (strtoul(p, NULL, 16) & __SO_ACCEPTCON);
 	skip_to_next();
 	/* Type */
-	info->type = strtoul(p, NULL, 16);
+	e.type = strtoul(p, NULL, 16);
 	skip_to_next();
 	/* State */
-	info->state = strtoul(p, NULL, 16);
+	e.state = strtoul(p, NULL, 16);
 	skip_to_next();
 	/* Inode */
-	if (atoi(p) == inode)
-	    break;
+	e.inode = strtoul(p, NULL, 10);
+	e.proto = PROTO_UNIX;
+	*add_sock(e.inode, PROTO_UNIX) = e;
     }
+#undef skip_to_next
     fclose(f);
+}
 
-    if (!p) /* no match */
-	return 0;
+static void build_sock_table()
+{
+    if (!diag_dump(AF_INET)) {
+	debug("[-] No sock_diag for TCP. Falling back to /proc/net/tcp.");
+	scan_proc_tcp();
+    }
+    if (!diag_dump(AF_UNIX)) {
+	debug("[-] No sock_diag for UNIX sockets. Falling back to /proc/net/unix.");
+	scan_proc_unix();
+    }
+    sock_table_built = 1;
+}
 
-    /* We have a match. The socket name follows. */
-    skip_to_next();
-    /* Path */
-    strncpy(info->path, p, sizeof(info->path));
-    info->path[sizeof(info->path)-1] = '\0';
-    for (p = info->path; *p != '\0' && *p != '\r' && *p != '\n'; *p++);
-    *p = '\0';
-#undef skip_to_next
+#ifdef USE_TCP_REPAIR
+/* The TCP sockets found, to be saved all together by finish_fd_sockets() */
+static int *tcp_fds;
+static struct cp_socket_tcp **tcp_socks;
+static int n_tcp, max_tcp;
+#endif
+
+static int get_tcp_socket(struct cp_socket_tcp *tcp, pid_t pid, int fd,
+	struct sock_entry *e)
+{
+    struct sockaddr_in *sin = &tcp->sin;
 
-    return 1;
+    /* The peer comes from the table, which saves asking the target */
+    *sin = e->peer;
+
+    /* If it is on port 6000-6003, consider it an X display */
+    if (sin->sin_port) {
+	int port = htons(sin->sin_port);
+	printf("fd %d connects to %d.%d.%d.%d:%d\n", fd,
+		(sin->sin_addr.s_addr >> 0 ) & 0xff,
+		(sin->sin_addr.s_addr >> 8 ) & 0xff,
+		(sin->sin_addr.s_addr >> 16) & 0xff,
+		(sin->sin_addr.s_addr >> 24) & 0xff,
+		port);
+	if (6000 <= port && port <= 6003)
+	    return PROTO_X;
+    }
+
+#ifdef USE_TCPCP
+    /* FIXME: verify state and handle other ones */
+
+    tcp->ici = tcpcp_get(pid, fd);
+
+    if (!tcp->ici)
+	debug("tcpcp_get(%d, %d): %s (%d)", pid, fd, strerror(errno), errno);
+    debug("ici is %p", tcp->ici);
+#elif defined(USE_TCP_REPAIR)
+    tcp->repair = NULL;
+    if (n_tcp == max_tcp) {
+	int *fds;
+	struct cp_socket_tcp **socks;
+
+	max_tcp = max_tcp ? max_tcp * 2 : 64;
+	fds = xmalloc(max_tcp * sizeof(int));
+	socks = xmalloc(max_tcp * sizeof(struct cp_socket_tcp*));
+	if (n_tcp) {
+	    memcpy(fds, tcp_fds, n_tcp * sizeof(int));
+	    memcpy(socks, tcp_socks, n_tcp * sizeof(struct cp_socket_tcp*));
+	}
+	free(tcp_fds);
+	free(tcp_socks);
+	tcp_fds = fds;
+	tcp_socks = socks;
+    }
+    tcp_fds[n_tcp] = fd;
+    tcp_socks[n_tcp++] = tcp;
+#endif
+    return PROTO_TCP;
 }
 
 static int get_unix_socket(struct cp_socket_unix *u, pid_t pid, int fd,
-	int inode)
+	int inode, struct sock_entry *usi)
 {
 #ifdef USE_GTK
     int xsocket;
     char *p;
 #endif
-    struct unix_sock_info_t usi;
     socklen_t sz;
 
-    if (!get_socket_info(inode, &usi))
-	return 0;
-
     memset(u, 0, sizeof(*u));
 
-    u->type = usi.type;
-    u->listening = usi.listening;
+    u->type = usi->type;
+    u->listening = usi->listening;
 
     sz = sizeof(u->sockname);
     if (r_getsockname(pid, fd, (struct sockaddr*)&u->sockname, &sz) < 0)
 	perror("r_getsockname");
 
-    if (usi.state & SS_CONNECTED) {
+    if (usi->state & SS_CONNECTED) {
 	sz = sizeof(u->sockname);
 	r_getpeername(pid, fd, (struct sockaddr*)&u->peername, &sz);
     }
@@ -210,6 +386,15 @@ static void write_chunk_fd_socket_tcp(void *fptr, struct cp_socket_tcp *tcp)
     len = tcpcp_size(tcp->ici);
     write_bit(fptr, &len, sizeof(int));
     write_bit(fptr, tcp->ici, len);
+#elif defined(USE_TCP_REPAIR)
+    int len = 0;
+    if (!tcp->repair) {
+	write_bit(fptr, &len, sizeof(int));
+	return;
+    }
+    len = tcprepair_size(tcp->repair);
+    write_bit(fptr, &len, sizeof(int));
+    write_bit(fptr, tcp->repair, len);
 #endif
 }
 
@@ -218,20 +403,213 @@ static void write_chunk_fd_socket_unix(void *fptr, struct cp_socket_unix *u)
     write_bit(fptr, u, sizeof(*u));
 }
 
+/* Listening sockets to be kept open, and handed to the resumed process by
+ * serve_handoff(), if handoff_path is set. */
+char *handoff_path;
+static int *handoff_fds, *handoff_local;
+static int n_handoff, max_handoff;
+
+/* How long the sockets are kept for the resumed process, and how long any
+ * one connection asking for them may take, in seconds. */
+#define HANDOFF_WAIT	600
+#define HANDOFF_CONN_WAIT 5
+
+static void add_handoff(int fd, struct cp_socket *socket)
+{
+    int *fds;
+
+    if (n_handoff == max_handoff) {
+	max_handoff = max_handoff ? max_handoff * 2 : 16;
+	fds = xmalloc(max_handoff * sizeof(int));
+	if (n_handoff)
+	    memcpy(fds, handoff_fds, n_handoff * sizeof(int));
+	free(handoff_fds);
+	handoff_fds = fds;
+    }
+    handoff_fds[n_handoff++] = fd;
+
+    socket->handoff = 1;
+    memset(&socket->handoff_addr, 0, sizeof(socket->handoff_addr));
+    socket->handoff_addr.sun_family = AF_UNIX;
+    strncpy(socket->handoff_addr.sun_path, handoff_path,
+	    sizeof(socket->handoff_addr.sun_path) - 1);
+}
+
+/* Passes one fd over a UNIX socket */
+static int send_fd(int s, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char c = 0, buf[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(s, &msg, 0);
+}
+
+/* Keeps the listening sockets alive after we're done, in a process of their
+ * own, which gives each to the first to ask for it by fd number at
+ * handoff_path. Until then the kernel queues up connections to them, rather
+ * than refusing them as it would once the original's gone. It gives up on
+ * any that haven't been asked for after HANDOFF_WAIT seconds.
+ */
+void serve_handoff()
+{
+    struct sockaddr_un sun;
+    struct timeval tv = { HANDOFF_CONN_WAIT, 0 };
+    struct pollfd pfd;
+    struct dirent *d;
+    DIR *dir;
+    time_t deadline;
+    int srv, c, fd, i, n, left = 0;
+
+    for (i = 0; i < n_handoff; i++)
+	if (handoff_local[i] != -1)
+	    left++;
+    if (!left)
+	return;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, handoff_path, sizeof(sun.sun_path) - 1);
+    unlink(sun.sun_path);
+    syscall_check(srv = socket(PF_UNIX, SOCK_STREAM, 0), 0, "socket");
+    syscall_check(bind(srv, (struct sockaddr*)&sun, SUN_LEN(&sun)), 0,
+	    "bind(%s)", sun.sun_path);
+    syscall_check(listen(srv, 8), 0, "listen");
+
+    fflush(stdout);
+    switch (fork()) {
+	case -1:
+	    bail("fork: %s", strerror(errno));
+	case 0:
+	    break;
+	default:
+	    printf("[+] Handing over %d listening sockets at %s\n",
+		    left, handoff_path);
+	    close(srv);
+	    for (i = 0; i < n_handoff; i++)
+		if (handoff_local[i] != -1)
+		    close(handoff_local[i]);
+	    return;
+    }
+
+    setsid();
+    /* Let go of everything else, frozen connections included */
+    if ((dir = opendir("/proc/self/fd"))) {
+	while ((d = readdir(dir))) {
+	    fd = atoi(d->d_name);
+	    if (fd <= 2 || fd == srv || fd == dirfd(dir))
+		continue;
+	    for (i = 0; i < n_handoff; i++)
+		if (handoff_local[i] == fd)
+		    break;
+	    if (i == n_handoff)
+		close(fd);
+	}
+	closedir(dir);
+    }
+
+    deadline = time(NULL) + HANDOFF_WAIT;
+    pfd.fd = srv;
+    pfd.events = POLLIN;
+    while (left && time(NULL) < deadline) {
+	n = poll(&pfd, 1, (deadline - time(NULL)) * 1000);
+	if (n == -1 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break; /* Timed out, or broken */
+	if ((c = accept(srv, NULL, NULL)) == -1) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    break;
+	}
+	/* Don't let one stuck client hold up the rest */
+	setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (read(c, &fd, sizeof(int)) == sizeof(int)) {
+	    for (i = 0; i < n_handoff; i++) {
+		if (handoff_fds[i] != fd || handoff_local[i] == -1)
+		    continue;
+		if (send_fd(c, handoff_local[i]) != -1) {
+		    close(handoff_local[i]);
+		    handoff_local[i] = -1;
+		    left--;
+		}
+		break;
+	    }
+	}
+	close(c);
+    }
+    close(srv);
+    unlink(sun.sun_path);
+    exit(0);
+}
+
 void fetch_fd_socket(pid_t pid, int flags, int fd, int inode,
 		struct cp_socket *socket)
 {
-    int ret;
-    ret = get_tcp_socket(&socket->s_tcp, pid, fd, inode);
-    if (ret == 0)
-	ret = get_unix_socket(&socket->s_unix, pid, fd, inode);
+    struct sock_entry *e;
+    int ret = 0;
+
+    if (!sock_table_built)
+	build_sock_table();
+
+    e = find_sock(inode);
+    if (e && e->proto == PROTO_TCP)
+	ret = get_tcp_socket(&socket->s_tcp, pid, fd, e);
+    else if (e && e->proto == PROTO_UNIX)
+	ret = get_unix_socket(&socket->s_unix, pid, fd, inode, e);
     if (ret != 0)
 	socket->proto = ret;
+
+    socket->handoff = 0;
+    if (handoff_path && e && e->listening)
+	add_handoff(fd, socket);
+}
+
+/* Called once all the target's fds have been fetched, while it's still
+ * stopped. */
+void finish_fd_sockets(pid_t pid, int flags)
+{
+#ifdef USE_TCP_REPAIR
+    void **states;
+    int i;
+
+    if (n_tcp) {
+	states = xmalloc(n_tcp * sizeof(void*));
+	tcprepair_get(pid, n_tcp, tcp_fds, states,
+		flags & KILL_ORIGINAL_PROCESS);
+	for (i = 0; i < n_tcp; i++)
+	    tcp_socks[i]->repair = states[i];
+	free(states);
+	n_tcp = 0;
+    }
+#endif
+
+    if (n_handoff) {
+	handoff_local = xmalloc(n_handoff * sizeof(int));
+	take_fds(pid, n_handoff, handoff_fds, handoff_local);
+    }
 }
 
 void write_chunk_fd_socket(void *fptr, struct cp_socket *socket)
 {
     write_bit(fptr, &socket->proto, sizeof(int));
+    write_bit(fptr, &socket->handoff, sizeof(int));
+    if (socket->handoff)
+	write_bit(fptr, &socket->handoff_addr, sizeof(struct sockaddr_un));
     switch (socket->proto) {
 	case PROTO_TCP:
 	    write_chunk_fd_socket_tcp(fptr, &socket->s_tcp);
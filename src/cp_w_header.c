@@ -5,6 +5,7 @@
 
 void write_chunk_header(void *fptr, struct cp_header *data)
 {
+    write_bit(fptr, &data->checksum_type, sizeof(int));
 }
 
 void fetch_chunks_header(pid_t pid, int flags, struct list *l)
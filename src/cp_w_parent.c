@@ -0,0 +1,30 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+
+void write_chunk_parent(void *fptr, struct cp_parent *data)
+{
+    write_string(fptr, data->filename);
+}
+
+/* Names the image an incremental image gets its unchanged pages from. It's
+ * looked for at restore time by this name, so it wants to be absolute. */
+void fetch_chunk_parent(char *filename, struct list *l)
+{
+    struct cp_chunk *chunk;
+    char path[PATH_MAX];
+
+    if (!realpath(filename, path))
+	bail("Parent image %s: %s", filename, strerror(errno));
+
+    chunk = xmalloc(sizeof(struct cp_chunk));
+    chunk->type = CP_CHUNK_PARENT;
+    chunk->parent.filename = strdup(path);
+    list_append(l, chunk);
+}
+
+/* vim:set ts=8 sw=4 noet: */
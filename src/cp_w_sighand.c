@@ -8,45 +8,47 @@
 #include "process.h"
 #include "cpimage.h"
 
-static int get_signal_handler(pid_t pid, int sig, struct k_sigaction *ksa)
-{
-    int ret;
-
-    ret = r_rt_sigaction(pid, sig, NULL, ksa, sizeof(arch_sigset_t));
-
-    /* Error checking! */
-    if (ret == -1)
-	bail("rt_sigaction on target: %s", strerror(errno));
-
-    //printf("%d: sigaction %d was 0x%lx mask 0x%x flags 0x%x restorer 0x%x\n", ret, sig, ksa->sa_hand, ksa->sa_mask.sig[0], ksa->sa_flags, ksa->sa_restorer);
-
-    return 1;
-}
-
 void write_chunk_sighand(void *fptr, struct cp_sighand *data)
 {
     write_bit(fptr, &data->sig_num, sizeof(int));
     write_bit(fptr, data->ksa, sizeof(struct k_sigaction));
 }
 
+/* All of the handlers are fetched in one batch of rt_sigaction calls */
 void fetch_chunks_sighand(pid_t pid, int flags, struct list *l)
 {
+    struct r_call calls[MAX_SIGS];
     struct cp_chunk *chunk;
-    struct k_sigaction *ksa = NULL;
-    int i;
+    int i, n = 0;
+
     for (i = 1; i < MAX_SIGS; i++) {
 	if (i == SIGKILL || i == SIGSTOP)
 	    continue;
 
-	if (!ksa)
-	    ksa = xmalloc(sizeof(struct k_sigaction));
-	if (!get_signal_handler(pid, i, ksa))
-	    continue;
+	memset(&calls[n], 0, sizeof(struct r_call));
+	calls[n].nr = __NR_rt_sigaction;
+	calls[n].args[0] = i;
+#ifdef ARCH_SIGACTION_HAS_RESTORER
+	calls[n].args[4] = sizeof(arch_sigset_t);
+#else
+	calls[n].args[3] = sizeof(arch_sigset_t);
+#endif
+	calls[n].buf = xmalloc(sizeof(struct k_sigaction));
+	calls[n].buf_arg = 2;
+	calls[n].buf_len = sizeof(struct k_sigaction);
+	calls[n].buf_out = 1;
+	n++;
+    }
+    r_syscalls(pid, calls, n);
+
+    for (i = 0; i < n; i++) {
+	if (calls[i].ret == -1)
+	    bail("rt_sigaction on target: %s", strerror(calls[i].err));
+
 	chunk = xmalloc(sizeof(struct cp_chunk));
 	chunk->type = CP_CHUNK_SIGHAND;
-	chunk->sighand.sig_num = i;
-	chunk->sighand.ksa = ksa;
-	ksa = NULL;
+	chunk->sighand.sig_num = calls[i].args[0];
+	chunk->sighand.ksa = calls[i].buf;
 	list_append(l, chunk);
     }
 }
@@ -1,3 +1,4 @@
+#define _LARGEFILE64_SOURCE
 #include <bits/types.h>
 #include <linux/kdev_t.h>
 #include <sys/mman.h>
@@ -5,6 +6,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "cpimage.h"
 #include "process.h"
@@ -16,10 +18,146 @@ static int warn;
 #endif
 
 unsigned long scribble_zone = 0; /* somewhere to scribble on in child */
+int scribble_prot = 0;            /* and how it's protected             */
 unsigned long syscall_loc   = 0; /* address of a syscall instruction  */
 unsigned long vdso_start    = 0; /* start address of vdso page        */
 unsigned long vdso_end      = 0; /* end address of vdso page          */
 
+/* Keep ranges small enough to pass to write_data() */
+#define VMA_RANGE_MAX	(1UL << 30)
+
+/* In streaming mode (vma_window != 0), VMA data isn't buffered in full.
+ * It's checksummed in windows of vma_window bytes as the maps are read, and
+ * read again a window at a time while the image is written, with the
+ * process kept stopped in between.
+ */
+unsigned long vma_window = 0;
+static char *window;
+static pid_t vma_pid;
+
+/* Only the target's memory is read while it's stopped. Checksumming it,
+ * comparing maps against the libraries they came from and looking for
+ * duplicate pages waits for finish_chunks_vma(), once it's running again (or
+ * until the image is written, if it's being streamed).
+ */
+struct pending_vma {
+    struct cp_vma *vma;
+    int sparse, stream, keep, remote;
+};
+static struct pending_vma *pending;
+static int n_pending, max_pending;
+
+/* Every literal page saved so far that a later page may refer to, hashed by
+ * content. data is NULL if the page is only in the target. */
+struct page_hash {
+    unsigned long long hash;
+    unsigned long addr;
+    char *data;
+};
+static struct page_hash *page_table;
+static unsigned long page_table_size, page_table_used;
+static long zero_pages, dup_pages;
+
+/* In an incremental image, pages that haven't been written to since the
+ * parent image was taken (ie, aren't soft-dirty) are left to the parent.
+ */
+static int incremental;
+static long parent_pages;
+
+/* With a page server, private anonymous memory is left in the target, for
+ * the resumed process to ask for (see pageserver.c). */
+static int serve_pages_too;
+static long remote_pages;
+
+/* Same as write_data(), but with the data coming straight out of the target.
+ * The checksum has to be known in advance.
+ */
+static void write_bit_from_target(void *fptr, unsigned long addr,
+	unsigned long len, unsigned int c)
+{
+    if (len == 0)
+	return;
+
+    flush_bits(fptr);
+    stream_ops->write(fptr, &c, sizeof(c));
+    while (len > 0) {
+	int n = len > vma_window ? vma_window : len;
+	if (!mem_read_target(vma_pid, window, addr, n))
+	    bail("Unable to read map at 0x%lx from target!", addr);
+	if (stream_ops->write(fptr, window, n) != n)
+	    bail("Write error!");
+	addr += n;
+	len -= n;
+    }
+}
+
+static void write_chunk_vma_sparse(void *fptr, struct cp_vma *data)
+{
+    char *p = data->data;
+    int i;
+
+    write_bit(fptr, &data->n_ranges, sizeof(int));
+    write_bit(fptr, data->ranges, data->n_ranges * sizeof(struct cp_vma_range));
+    for (i = 0; i < data->n_ranges; i++) {
+	write_align(fptr, vma_mappable(data));
+	if (p) {
+	    write_data(fptr, p, data->ranges[i].length);
+	    p += data->ranges[i].length;
+	} else
+	    write_bit_from_target(fptr, data->start + data->ranges[i].offset,
+		    data->ranges[i].length, data->range_sums[i]);
+    }
+}
+
+/* Each group's table, then its literal pages gathered up together */
+static void write_chunk_vma_pages(void *fptr, struct cp_vma *data)
+{
+    static char *group;
+    int page = _getpagesize;
+    unsigned long *desc = data->pages;
+    char *p = data->data;
+    int i;
+
+    if (!group)
+	group = xmalloc(VMA_PAGE_GROUP * page);
+
+    write_bit(fptr, &data->n_ranges, sizeof(int));
+    write_bit(fptr, data->ranges, data->n_ranges * sizeof(struct cp_vma_range));
+    for (i = 0; i < data->n_ranges; i++) {
+	unsigned long addr = data->start + data->ranges[i].offset;
+	unsigned long left = data->ranges[i].length / page;
+
+	while (left > 0) {
+	    int n = left > VMA_PAGE_GROUP ? VMA_PAGE_GROUP : left;
+	    int j, k, lit = 0;
+
+	    write_bit(fptr, desc, n * sizeof(unsigned long));
+	    for (j = 0; j < n; j = k) {
+		/* Copy runs of literal pages at a time */
+		for (k = j; k < n && desc[k] == VMA_PAGE_LITERAL; k++)
+		    ;
+		if (k == j) {
+		    k++;
+		    continue;
+		}
+		if (p)
+		    memcpy(group + lit * page, p + j * page, (k - j) * page);
+		else if (!mem_read_target(vma_pid, group + lit * page,
+			    addr + j * page, (k - j) * page))
+		    bail("Unable to read map at 0x%lx from target!", addr + j * page);
+		lit += k - j;
+	    }
+	    write_data(fptr, group, lit * page);
+
+	    desc += n;
+	    addr += n * page;
+	    if (p)
+		p += n * page;
+	    left -= n;
+	}
+    }
+}
+
 void write_chunk_vma(void *fptr, struct cp_vma *data)
 {
     write_bit(fptr, &data->start, sizeof(unsigned long));
@@ -33,8 +171,27 @@ void write_chunk_vma(void *fptr, struct cp_vma *data)
     write_bit(fptr, &data->have_data, sizeof(data->have_data));
     write_bit(fptr, &data->checksum, sizeof(data->checksum));
     write_bit(fptr, &data->is_heap, sizeof(data->is_heap));
-    if (data->have_data)
-	write_bit(fptr, data->data, data->length);
+    switch (data->have_data) {
+	case VMA_DATA_FULL:
+	    write_align(fptr, vma_mappable(data));
+	    if (data->data)
+		write_data(fptr, data->data, data->length);
+	    else
+		write_bit_from_target(fptr, data->start, data->length,
+			data->checksum);
+	    break;
+	case VMA_DATA_SPARSE:
+	    write_chunk_vma_sparse(fptr, data);
+	    break;
+	case VMA_DATA_PAGES:
+	    write_chunk_vma_pages(fptr, data);
+	    break;
+	case VMA_DATA_REMOTE:
+	    write_bit(fptr, &data->n_ranges, sizeof(int));
+	    write_bit(fptr, data->ranges,
+		    data->n_ranges * sizeof(struct cp_vma_range));
+	    break;
+    }
 }
 
 #ifdef __i386__
@@ -44,8 +201,540 @@ int fetch_chunk_libcgp(struct cp_chunk **ptr)
     *ptr = gp_chunk;
     return warn;
 }
+
+static void find_libcgp(struct cp_vma *vma)
+{
+    if (vma->filename != NULL)
+	if (((strstr(vma->filename, "libc-") != NULL) ||
+	    (strstr(vma->filename, "libc.") != NULL) ||
+	    (strstr(vma->filename, "libc_") != NULL)) && !gp_chunk) {
+	    warn = 0;
+	    info("[+] libc mapping found: %s\n", vma->filename);
+	    gp_chunk = xmalloc(sizeof(struct cp_chunk));
+	    gp_chunk->type = CP_CHUNK_GETPID;
+	    if (libc_hack_fetch(vma->filename, &gp_chunk->signature.code) == EXIT_FAILURE) {
+		info("[W] failed to fetch __getpid signature. Probably a call to getpid will return the old PID\n");
+		free(gp_chunk);
+		warn++;
+	    }
+	}
+}
 #endif
 
+static void add_vma_range(struct cp_vma *vma, unsigned long offset,
+	unsigned long length, int *max_ranges)
+{
+    if (vma->n_ranges == *max_ranges) {
+	*max_ranges = *max_ranges ? *max_ranges * 2 : 16;
+	vma->ranges = realloc(vma->ranges,
+		*max_ranges * sizeof(struct cp_vma_range));
+	if (!vma->ranges)
+	    bail("Out of memory!");
+    }
+    vma->ranges[vma->n_ranges].offset = offset;
+    vma->ranges[vma->n_ranges].length = length;
+    vma->n_ranges++;
+}
+
+/* Treat a map as a sparse one with everything present */
+static void full_vma_ranges(struct cp_vma *vma)
+{
+    unsigned long off;
+    int max_ranges = 0;
+
+    vma->n_ranges = 0;
+    vma->ranges = NULL;
+    for (off = 0; off < vma->length; off += VMA_RANGE_MAX)
+	add_vma_range(vma, off, vma->length - off > VMA_RANGE_MAX ?
+		VMA_RANGE_MAX : vma->length - off, &max_ranges);
+}
+
+/* Find the parts of a map that have ever been touched (ie, are resident or
+ * swapped out) from /proc/pid/pagemap. Everything else will come back as
+ * fresh zero pages. Returns 0 if we can't tell.
+ */
+static int get_vma_ranges(pid_t pid, struct cp_vma *vma)
+{
+    static unsigned long long pm[PM_ENTRIES];
+    char fn[32];
+    unsigned long page, npages, run_start = 0;
+    int fd, in_run = 0, max_ranges = 0;
+
+    snprintf(fn, sizeof(fn), "/proc/%d/pagemap", pid);
+    if ((fd = open(fn, O_RDONLY)) == -1)
+	return 0;
+
+    vma->n_ranges = 0;
+    vma->ranges = NULL;
+    npages = vma->length / _getpagesize;
+
+    for (page = 0; page < npages; page += PM_ENTRIES) {
+	unsigned long i, n = npages - page;
+	off64_t pm_off;
+
+	if (n > PM_ENTRIES)
+	    n = PM_ENTRIES;
+	pm_off = ((off64_t)(vma->start / _getpagesize) + page) * sizeof(pm[0]);
+	if (pread64(fd, pm, n * sizeof(pm[0]), pm_off) != n * sizeof(pm[0])) {
+	    free(vma->ranges);
+	    vma->ranges = NULL;
+	    vma->n_ranges = 0;
+	    close(fd);
+	    return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+	    unsigned long off = (page + i) * _getpagesize;
+	    int populated = (pm[i] & (PM_PRESENT|PM_SWAPPED)) != 0;
+
+	    if (populated && in_run && off - run_start >= VMA_RANGE_MAX) {
+		add_vma_range(vma, run_start, off - run_start, &max_ranges);
+		run_start = off;
+	    }
+	    if (populated && !in_run) {
+		run_start = off;
+		in_run = 1;
+	    } else if (!populated && in_run) {
+		add_vma_range(vma, run_start, off - run_start, &max_ranges);
+		in_run = 0;
+	    }
+	}
+    }
+    if (in_run)
+	add_vma_range(vma, run_start, vma->length - run_start, &max_ranges);
+
+    close(fd);
+    return 1;
+}
+
+/* Marks the pages in a map's ranges that are clean since the soft-dirty bits
+ * were last cleared as VMA_PAGE_PARENT in vma->pages, and returns how many
+ * there were. */
+static unsigned long get_soft_dirty(pid_t pid, struct cp_vma *vma)
+{
+    static unsigned long long pm[PM_ENTRIES];
+    char fn[32];
+    unsigned long n_pages = 0, pg = 0, clean = 0;
+    int fd, i;
+
+    snprintf(fn, sizeof(fn), "/proc/%d/pagemap", pid);
+    if ((fd = open(fn, O_RDONLY)) == -1)
+	bail("Unable to open %s for an incremental image: %s", fn,
+		strerror(errno));
+
+    for (i = 0; i < vma->n_ranges; i++)
+	n_pages += vma->ranges[i].length / _getpagesize;
+    vma->pages = xmalloc(n_pages * sizeof(unsigned long));
+
+    for (i = 0; i < vma->n_ranges; i++) {
+	unsigned long page = (vma->start + vma->ranges[i].offset) / _getpagesize;
+	unsigned long left = vma->ranges[i].length / _getpagesize;
+
+	while (left > 0) {
+	    unsigned long j, n = left > PM_ENTRIES ? PM_ENTRIES : left;
+
+	    if (pread64(fd, pm, n * sizeof(pm[0]),
+			(off64_t)page * sizeof(pm[0])) != n * sizeof(pm[0]))
+		bail("Unable to read %s for an incremental image!", fn);
+	    for (j = 0; j < n; j++) {
+		if (pm[j] & PM_SOFT_DIRTY) {
+		    vma->pages[pg++] = VMA_PAGE_LITERAL;
+		} else {
+		    vma->pages[pg++] = VMA_PAGE_PARENT;
+		    clean++;
+		}
+	    }
+	    page += n;
+	    left -= n;
+	}
+    }
+
+    close(fd);
+    return clean;
+}
+
+/* Reads the pages of a sparse map that are going to be saved into
+ * vma->data, which holds the ranges back to back. In an incremental image,
+ * that's only the dirty ones, and the rest of the buffer is never touched.
+ */
+static void fetch_vma_ranges(pid_t pid, struct cp_vma *vma)
+{
+    int page = _getpagesize;
+    struct iovec *local, *remote;
+    unsigned long pg = 0;
+    char *p = vma->data;
+    int i, n = 0, max = 0;
+
+    local = remote = NULL;
+    for (i = 0; i < vma->n_ranges; i++) {
+	unsigned long addr = vma->start + vma->ranges[i].offset;
+	unsigned long end = addr + vma->ranges[i].length;
+
+	while (addr < end) {
+	    unsigned long len = end - addr;
+
+	    if (vma->pages) {
+		if (vma->pages[pg] == VMA_PAGE_PARENT) {
+		    addr += page;
+		    p += page;
+		    pg++;
+		    continue;
+		}
+		for (len = 0; addr + len < end &&
+			vma->pages[pg] != VMA_PAGE_PARENT; len += page)
+		    pg++;
+	    }
+	    if (n == max) {
+		max = max ? max * 2 : 16;
+		local = realloc(local, max * sizeof(struct iovec));
+		remote = realloc(remote, max * sizeof(struct iovec));
+		if (!local || !remote)
+		    bail("Out of memory!");
+	    }
+	    local[n].iov_base = p;
+	    local[n].iov_len = len;
+	    remote[n].iov_base = (void*)addr;
+	    remote[n].iov_len = len;
+	    n++;
+	    addr += len;
+	    p += len;
+	}
+    }
+
+    if (!precopy_readv_target(pid, local, remote, n))
+	bail("Unable to read map at 0x%lx from target!", vma->start);
+    free(local);
+    free(remote);
+}
+
+/* Checks that the kernel really tracks soft-dirty pages, by dirtying a page
+ * of our own. Without CONFIG_MEM_SOFT_DIRTY, every page looks clean. */
+int soft_dirty_works()
+{
+    static char buf[2 * 65536];
+    unsigned long long pm;
+    char *p;
+    int fd, ok;
+
+    p = (char*)(((unsigned long)buf + _getpagesize - 1) & ~(_getpagesize - 1));
+    if (!clear_soft_dirty(getpid()))
+	return 0;
+    *(volatile char*)p = 1;
+
+    if ((fd = open("/proc/self/pagemap", O_RDONLY)) == -1)
+	return 0;
+    ok = pread64(fd, &pm, sizeof(pm),
+	    (off64_t)((unsigned long)p / _getpagesize) * sizeof(pm)) == sizeof(pm)
+	&& (pm & PM_SOFT_DIRTY);
+    close(fd);
+    return ok;
+}
+
+/* Starts a new generation of soft-dirty tracking in the target, for the next
+ * incremental image to be relative to. */
+int clear_soft_dirty(pid_t pid)
+{
+    char fn[32];
+    int fd, ok;
+
+    snprintf(fn, sizeof(fn), "/proc/%d/clear_refs", pid);
+    if ((fd = open(fn, O_WRONLY)) == -1)
+	return 0;
+    ok = write(fd, "4", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+static void find_syscall_loc(char *data, unsigned long addr, unsigned long len)
+{
+    char *p, *end;
+
+    if (len < sizeof(long))
+	return;
+
+    p = data;
+    end = p + len - sizeof(long) + 1;
+    while (p < end) {
+	if (is_a_syscall(*(long*)p, 1)) {
+	    syscall_loc = addr + (p - data);
+	    debug("[+] Found a syscall location at 0x%lx", syscall_loc);
+	    break;
+	}
+#ifdef ARCH_HAS_ALIGNED_INSTRUCTIONS
+	p += sizeof(long);
+#else
+	p++;
+#endif
+    }
+}
+
+/* Checksum part of the target's memory, without holding more than a window
+ * of it at a time.
+ */
+static unsigned int scan_target(pid_t pid, unsigned long addr,
+	unsigned long len)
+{
+    unsigned int c = 0;
+
+    while (len > 0) {
+	int n = len > vma_window ? vma_window : len;
+	if (!mem_read_target(pid, window, addr, n))
+	    bail("Unable to read map at 0x%lx from target!", addr);
+	c = map_checksum(window, n, c);
+	addr += n;
+	len -= n;
+    }
+    return c;
+}
+
+/* Looks for a syscall in part of the target's memory that isn't being read
+ * in full just yet, stopping as soon as there is one. */
+static void scan_for_syscall(pid_t pid, unsigned long addr, unsigned long len)
+{
+    static char buf[65536];
+    unsigned long end = addr + len;
+
+    for (; addr < end && !syscall_loc; addr += sizeof(buf)) {
+	unsigned long n = end - addr > sizeof(buf) ? sizeof(buf) : end - addr;
+
+	if (!mem_read_target(pid, buf, addr, n))
+	    break;
+	find_syscall_loc(buf, addr, n);
+    }
+}
+
+/* Finds a scribble zone and a syscall to use, without reading all of the
+ * target's memory to do it, for when it's to be stopped for as little time
+ * as possible. */
+void find_remote_helpers(pid_t pid)
+{
+    char fn[30], line[1024], name[1024];
+    FILE *f;
+
+    snprintf(fn, sizeof(fn), "/proc/%d/maps", pid);
+    if ((f = fopen(fn, "r")) == NULL)
+	return;
+
+    while ((!scribble_zone || !syscall_loc) && fgets(line, sizeof(line), f)) {
+	unsigned long start, end;
+	char perms[5];
+
+	name[0] = '\0';
+	if (sscanf(line, "%lx-%lx %4s %*x %*s %*d %1023s", &start, &end, perms,
+		    name) < 3)
+	    continue;
+	if (start >= get_task_size())
+	    continue;
+
+	if (!scribble_zone && !name[0] && perms[0] == 'r' && perms[1] == 'w' &&
+		perms[3] == 'p') {
+	    scribble_zone = start;
+	    scribble_prot = PROT_READ|PROT_WRITE|(perms[2] == 'x' ? PROT_EXEC : 0);
+	    debug("[+] Found scribble zone: 0x%lx", scribble_zone);
+	}
+
+	if (!syscall_loc && perms[0] == 'r' && perms[2] == 'x')
+	    scan_for_syscall(pid, start, end - start);
+    }
+
+    fclose(f);
+}
+
+/* Lists the maps of pid that its forked copy doesn't have, which are the ones
+ * marked MADV_DONTFORK. Returns how many there are. */
+int maps_not_forked(pid_t pid, pid_t copy)
+{
+    char fn[30], line[1024], cline[1024];
+    unsigned long start, end, cstart = 0, cend = 0;
+    int missing = 0, more = 1;
+    FILE *f, *cf;
+
+    snprintf(fn, sizeof(fn), "/proc/%d/maps", pid);
+    if ((f = fopen(fn, "r")) == NULL)
+	return 0;
+    snprintf(fn, sizeof(fn), "/proc/%d/maps", copy);
+    if ((cf = fopen(fn, "r")) == NULL) {
+	fclose(f);
+	return 0;
+    }
+
+    /* Both are in order of address */
+    while (fgets(line, sizeof(line), f)) {
+	if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+	    continue;
+	while (more && cend <= start)
+	    more = fgets(cline, sizeof(cline), cf) &&
+		sscanf(cline, "%lx-%lx", &cstart, &cend) == 2;
+	if (more && cstart <= start)
+	    continue;
+	fprintf(stderr, "[-] Not in the forked copy (MADV_DONTFORK): %s", line);
+	missing++;
+    }
+
+    fclose(cf);
+    fclose(f);
+    return missing;
+}
+
+/* Hashes a page, noting whether it's all zero on the way */
+static unsigned long long hash_page(char *data, int *zero)
+{
+    unsigned long *p = (unsigned long*)data;
+    unsigned long *end = (unsigned long*)(data + _getpagesize);
+    unsigned long long h = 0;
+    unsigned long any = 0;
+
+    for (; p < end; p++) {
+	any |= *p;
+	h = (h ^ *p) * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 29;
+    }
+    *zero = !any;
+    return h;
+}
+
+static int same_page(pid_t pid, struct page_hash *e, char *data)
+{
+    static char *buf;
+
+    if (e->data)
+	return memcmp(e->data, data, _getpagesize) == 0;
+
+    if (!buf)
+	buf = xmalloc(_getpagesize);
+    if (!mem_read_target(pid, buf, e->addr, _getpagesize))
+	bail("Unable to read page at 0x%lx from target!", e->addr);
+    return memcmp(buf, data, _getpagesize) == 0;
+}
+
+static void grow_page_table()
+{
+    struct page_hash *old = page_table;
+    unsigned long i, j, old_size = page_table_size;
+
+    page_table_size = old_size ? old_size * 2 : 4096;
+    page_table = xmalloc(page_table_size * sizeof(struct page_hash));
+    memset(page_table, 0, page_table_size * sizeof(struct page_hash));
+    for (i = 0; i < old_size; i++) {
+	if (!old[i].addr)
+	    continue;
+	for (j = old[i].hash & (page_table_size - 1); page_table[j].addr;
+		j = (j + 1) & (page_table_size - 1))
+	    ;
+	page_table[j] = old[i];
+    }
+    free(old);
+}
+
+/* Works out what the table entry for a page should be. Pages that later
+ * ones may copy have to be readable when the image is restored. */
+static unsigned long classify_page(pid_t pid, struct cp_vma *vma, char *data,
+	unsigned long addr, int stream)
+{
+    unsigned long long h;
+    unsigned long i;
+    int zero;
+
+    h = hash_page(data, &zero);
+    if (zero) {
+	zero_pages++;
+	return VMA_PAGE_ZERO;
+    }
+
+    if (page_table_used * 2 >= page_table_size)
+	grow_page_table();
+    for (i = h & (page_table_size - 1); page_table[i].addr;
+	    i = (i + 1) & (page_table_size - 1)) {
+	if (page_table[i].hash == h && same_page(pid, &page_table[i], data)) {
+	    dup_pages++;
+	    return page_table[i].addr;
+	}
+    }
+
+    if (vma->prot & PROT_READ) {
+	page_table[i].hash = h;
+	page_table[i].addr = addr;
+	page_table[i].data = stream ? NULL : data;
+	page_table_used++;
+    }
+    return VMA_PAGE_LITERAL;
+}
+
+/* Looks for zero and duplicate pages in the data being saved, and switches
+ * the map to VMA_DATA_PAGES if there are any (or if it's part of an
+ * incremental image). */
+static void dedup_vma_pages(pid_t pid, struct cp_vma *vma, int stream)
+{
+    int page = _getpagesize;
+    unsigned long n_pages = 0, pg = 0, off, chunk, clean = 0;
+    long zeros = zero_pages, dups = dup_pages;
+    char *p = vma->data; /* the ranges, back to back */
+    int i;
+
+    /* An incremental image had these set up while the target was stopped */
+    if (vma->have_data == VMA_DATA_FULL && !vma->ranges)
+	full_vma_ranges(vma);
+
+    if (!vma->pages) {
+	for (i = 0; i < vma->n_ranges; i++)
+	    n_pages += vma->ranges[i].length / page;
+	vma->pages = xmalloc(n_pages * sizeof(unsigned long));
+	memset(vma->pages, 0, n_pages * sizeof(unsigned long));
+    }
+
+    chunk = vma_window - vma_window % page;
+    for (i = 0; i < vma->n_ranges; i++) {
+	unsigned long addr = vma->start + vma->ranges[i].offset;
+	unsigned long end = addr + vma->ranges[i].length;
+
+	while (addr < end) {
+	    unsigned long n = page;
+	    char *d = p;
+
+	    if (vma->pages[pg] == VMA_PAGE_PARENT) {
+		clean++;
+		pg++;
+	    } else if (stream) {
+		/* Read as many pages as we need to look at in one go */
+		while (addr + n < end && n < chunk &&
+			vma->pages[pg + n / page] != VMA_PAGE_PARENT)
+		    n += page;
+		if (!mem_read_target(pid, window, addr, n))
+		    bail("Unable to read map at 0x%lx from target!", addr);
+		for (off = 0; off < n; off += page, pg++)
+		    vma->pages[pg] = classify_page(pid, vma, window + off,
+			    addr + off, stream);
+	    } else
+		vma->pages[pg++] = classify_page(pid, vma, d, addr, stream);
+	    if (p)
+		p += n;
+	    addr += n;
+	}
+    }
+
+    zeros = zero_pages - zeros;
+    dups = dup_pages - dups;
+    parent_pages += clean;
+    if (!zeros && !dups && !incremental) {
+	free(vma->pages);
+	vma->pages = NULL;
+	if (vma->have_data == VMA_DATA_FULL) {
+	    free(vma->ranges);
+	    vma->ranges = NULL;
+	    vma->n_ranges = 0;
+	}
+	return;
+    }
+
+    if (clean)
+	debug("     %08lx: %ld zero, %ld duplicate and %ld unchanged pages.",
+		vma->start, zeros, dups, clean);
+    else
+	debug("     %08lx: %ld zero and %ld duplicate pages.", vma->start,
+		zeros, dups);
+    vma->have_data = VMA_DATA_PAGES;
+}
+
 static int get_one_vma(pid_t pid, char* line, struct cp_vma *vma,
 	int get_library_data, int vma_no, long *bin_offset)
 {
@@ -53,6 +742,8 @@ static int get_one_vma(pid_t pid, char* line, struct cp_vma *vma,
     int dminor, dmajor;
     int old_vma_prot = -1;
     int keep_vma_data = 0;
+    int sparse = 0, stream, want_syscall, remote;
+    unsigned long populated;
     static long last_vma_end;
 
     memset(vma, 0, sizeof(struct cp_vma));
@@ -223,108 +914,279 @@ static int get_one_vma(pid_t pid, char* line, struct cp_vma *vma,
 	    !(vma->flags & MAP_SHARED) &&
 	    ((vma->prot & (PROT_READ|PROT_WRITE)) == (PROT_READ|PROT_WRITE))) {
 	scribble_zone = vma->start;
+	scribble_prot = vma->prot;
 	debug("[+] Found scribble zone: 0x%lx", scribble_zone);
     }
 
-    /* Fetch the data, at least for checksumming purposes. */
-    vma->data = xmalloc(vma->length);
-    memcpy_from_target(pid, vma->data, (void*)vma->start, vma->length);
-    vma->checksum = checksum(vma->data, vma->length, 0);
+    /* Private anonymous maps (heaps, stacks, arenas, ...) are often huge
+     * reservations with very little of them ever touched. Only fetch the
+     * pages that are actually there.
+     */
+    if (!vma->inode && !(vma->flags & MAP_SHARED) &&
+	    get_vma_ranges(pid, vma)) {
+	int i;
+	populated = 0;
+	for (i = 0; i < vma->n_ranges; i++)
+	    populated += vma->ranges[i].length;
+	if (populated != vma->length || incremental)
+	    sparse = 1;
+	else {
+	    free(vma->ranges);
+	    vma->ranges = NULL;
+	    vma->n_ranges = 0;
+	}
+    }
 
-    /* Decide if it contains a syscall function that's of use to us */
-    if (syscall_loc == 0 &&
+    /* Decide if it might contain a syscall function that's of use to us */
+    want_syscall = (syscall_loc == 0 &&
 	    (vma->flags & MAP_PRIVATE) &&
 	    !(vma->flags & MAP_SHARED) &&
-	    (vma->prot & (PROT_READ|PROT_EXEC))) {
-	char *p, *end;
-	p = (char*)vma->data;
-	end = p + vma->length - sizeof(long) + 1;
-	while (p < end) {
-	    if (is_a_syscall(*(long*)p, 1)) {
-		syscall_loc = vma->start + (p - (char*)vma->data);
-		debug("[+] Found a syscall location at 0x%lx", syscall_loc);
-		break;
-	    }
-#ifdef ARCH_HAS_ALIGNED_INSTRUCTIONS
-	    p += sizeof(long);
-#else
-	    p++;
-#endif
-	}
-    }
+	    (vma->prot & (PROT_READ|PROT_EXEC)));
+
+    /* Maps we had to make readable have to be buffered, as they'll be
+     * unreadable again by the time the image is written. */
+    stream = vma_window && old_vma_prot == -1;
 
-    /* Cases where we want to keep the VMA in the image */
+    /* Cases where we want to keep the VMA in the image. Other maps of files
+     * are kept only if they turn out to differ from the file. */
     keep_vma_data = (
 	    get_library_data ||
 	    ((vma->prot & PROT_WRITE) && (vma->flags & MAP_PRIVATE)) || 
 	    (vma->flags & MAP_ANONYMOUS)
 	    );
 
+    /* Maps that the page server can hand out as they are. Maps we had to
+     * make readable would be unreadable again by then. */
+    remote = serve_pages_too && !vma->inode && old_vma_prot == -1 &&
+	(vma->flags & MAP_PRIVATE) && (vma->prot & PROT_WRITE);
 
-    /* If it's on disk and we're not saving libraries, checksum the source to
-     * verify it really is the same.
-     */
-    if (!keep_vma_data && vma->filename) {
-	int lfd;
-	int remaining;
-	unsigned int c;
-	static char buf[4096];
-
-	keep_vma_data = 1; /* Assume guilty until proven innocent */
+    /* Take what we need of the data while the process is stopped. */
+    if (remote) {
+	int i;
 
-	if ((lfd = open(vma->filename, O_RDONLY)) == -1)
-	    goto out;
+	if (!sparse)
+	    full_vma_ranges(vma);
+	for (i = 0; i < vma->n_ranges && want_syscall && !syscall_loc; i++)
+	    scan_for_syscall(pid, vma->start + vma->ranges[i].offset,
+		    vma->ranges[i].length);
+	page_server_add(pid, vma->start, vma->length);
+	debug("     Leaving it to the page server.");
+    } else if (sparse) {
+	/* Only fetch what's changed, in an incremental image. The checksum
+	 * only matters for maps of files, so there's no need to read the
+	 * rest for it. */
+	if (incremental)
+	    get_soft_dirty(pid, vma);
+	if (!stream) {
+	    char *p;
+	    int i;
 
-	if (lseek(lfd, vma->pg_off, SEEK_SET) != vma->pg_off)
-	    goto out_close;
+	    vma->data = populated ? xmalloc(populated) : NULL;
+	    fetch_vma_ranges(pid, vma);
+	    /* (unchanged pages of an incremental image aren't in the buffer) */
+	    if (want_syscall && !incremental) {
+		for (i = 0, p = vma->data; i < vma->n_ranges && !syscall_loc;
+			i++) {
+		    find_syscall_loc(p, vma->start + vma->ranges[i].offset,
+			    vma->ranges[i].length);
+		    p += vma->ranges[i].length;
+		}
+	    }
+	} else if (want_syscall) {
+	    int i;
 
-	remaining = vma->length;
-	c = 0;
-	while (remaining > 0) {
-	    int len = sizeof(buf), rlen;
-	    if (len > remaining)
-		len = remaining;
-	    rlen = read(lfd, buf, len);
-	    if (rlen == -1)
-		goto out_close;
-	    if (rlen == 0)
-		break;
-	    c = checksum(buf, rlen, c);
-	    remaining -= rlen;
+	    for (i = 0; i < vma->n_ranges && !syscall_loc; i++)
+		scan_for_syscall(pid, vma->start + vma->ranges[i].offset,
+			vma->ranges[i].length);
 	}
+	debug("     Saving %ld of %ld KB in %d ranges.", populated >> 10,
+		vma->length >> 10, vma->n_ranges);
+    } else if (stream) {
+	if (want_syscall)
+	    scan_for_syscall(pid, vma->start, vma->length);
+    } else {
+	vma->data = xmalloc(vma->length);
+	if (!precopy_read_target(pid, vma->data, vma->start, vma->length))
+	    bail("Unable to read map at 0x%lx from target!", vma->start);
+	if (want_syscall)
+	    find_syscall_loc(vma->data, vma->start, vma->length);
+    }
 
-	/* Pad out the rest with NULLs */
-	memset(buf, 0, sizeof(buf));
-	while (remaining > 0) {
-	    int remsz = sizeof(buf);
-	    if (remsz > remaining)
-		remsz = remaining;
-	    c = checksum(buf, remsz, c);
-	    remaining -= remsz;
-	}
+    /* Which pages have changed can't wait either. Shared maps are always
+     * saved in full, as others can write to them without setting the
+     * target's soft-dirty bits. */
+    if (incremental && !sparse && !(vma->flags & MAP_SHARED) &&
+	    (keep_vma_data || vma->filename)) {
+	full_vma_ranges(vma);
+	get_soft_dirty(pid, vma);
+    }
+
+    if (n_pending == max_pending) {
+	max_pending = max_pending ? max_pending * 2 : 64;
+	pending = realloc(pending, max_pending * sizeof(struct pending_vma));
+	if (!pending)
+	    bail("Out of memory!");
+    }
+    pending[n_pending].vma = vma;
+    pending[n_pending].sparse = sparse;
+    pending[n_pending].stream = stream;
+    pending[n_pending].keep = keep_vma_data;
+    pending[n_pending].remote = remote;
+    n_pending++;
+
+    if (old_vma_prot != -1)
+	r_mprotect(pid, (void*)vma->start, vma->length, old_vma_prot);
+
+    last_vma_end = vma->start + vma->length;
+    return 1;
+}
+
+/* Checksums what's on disk behind a map, to see if it really is the same as
+ * what the process has in memory. */
+static int same_as_file(struct cp_vma *vma)
+{
+    int lfd;
+    int remaining;
+    unsigned int c;
+    static char buf[4096];
+    int same = 0; /* Assume guilty until proven innocent */
+
+    if ((lfd = open(vma->filename, O_RDONLY)) == -1)
+	return 0;
+
+    if (lseek(lfd, vma->pg_off, SEEK_SET) != vma->pg_off)
+	goto out_close;
+
+    remaining = vma->length;
+    c = 0;
+    while (remaining > 0) {
+	int len = sizeof(buf), rlen;
+	if (len > remaining)
+	    len = remaining;
+	rlen = read(lfd, buf, len);
+	if (rlen == -1)
+	    goto out_close;
+	if (rlen == 0)
+	    break;
+	c = map_checksum(buf, rlen, c);
+	remaining -= rlen;
+    }
+
+    /* Pad out the rest with NULLs */
+    memset(buf, 0, sizeof(buf));
+    while (remaining > 0) {
+	int remsz = sizeof(buf);
+	if (remsz > remaining)
+	    remsz = remaining;
+	c = map_checksum(buf, remsz, c);
+	remaining -= remsz;
+    }
 
-	/* So did we have a good checksum after all that? */
-	if (c == vma->checksum)
-	    keep_vma_data = 0;
+    /* So did we have a good checksum after all that? */
+    same = (c == vma->checksum);
 
 out_close:
-	close(lfd);
+    close(lfd);
+    return same;
+}
+
+static void finish_one_vma(struct pending_vma *pv)
+{
+    struct cp_vma *vma = pv->vma;
+    int i, sum;
+
+    /* With checksums off, a map only needs one if it may be left to its
+     * file. */
+    sum = checksum_type != CHECKSUM_NONE || (!pv->keep && vma->filename);
+
+    /* Nothing's read from these until they're asked for */
+    if (pv->remote) {
+	vma->have_data = VMA_DATA_REMOTE;
+	vma->checksum = 0;
+	for (i = 0; i < vma->n_ranges; i++)
+	    remote_pages += vma->ranges[i].length / _getpagesize;
+	return;
+    }
+
+    if (pv->sparse) {
+	char *p;
+
+	/* The checksum of the whole map is made from those of the ranges */
+	vma->range_sums = xmalloc(vma->n_ranges * sizeof(unsigned int));
+	memset(vma->range_sums, 0, vma->n_ranges * sizeof(unsigned int));
+	for (i = 0, p = vma->data; i < vma->n_ranges && !incremental && sum;
+		i++) {
+	    if (pv->stream)
+		vma->range_sums[i] = scan_target(vma_pid,
+			vma->start + vma->ranges[i].offset,
+			vma->ranges[i].length);
+	    else {
+		vma->range_sums[i] = map_checksum(p, vma->ranges[i].length, 0);
+		p += vma->ranges[i].length;
+	    }
+	}
+	vma->checksum = map_checksum((char*)vma->range_sums,
+		vma->n_ranges * sizeof(unsigned int), 0);
+    } else if (!sum) {
+	vma->checksum = 0;
+    } else if (pv->stream) {
+	vma->checksum = scan_target(vma_pid, vma->start, vma->length);
+    } else {
+	vma->checksum = map_checksum(vma->data, vma->length, 0);
     }
-out:
+
+    /* If it's on disk and we're not saving libraries, checksum the source to
+     * verify it really is the same.
+     */
+    if (!pv->keep && vma->filename)
+	pv->keep = !same_as_file(vma);
 
     /* Figure out if we need to keep it */
-    if (vma->data && keep_vma_data) {
-	vma->have_data = 1;
+    if (pv->sparse) {
+	vma->have_data = VMA_DATA_SPARSE;
+    } else if ((vma->data || pv->stream) && pv->keep) {
+	vma->have_data = VMA_DATA_FULL;
     } else {
 	free(vma->data);
 	vma->data = NULL;
+	free(vma->ranges);
+	vma->ranges = NULL;
+	vma->n_ranges = 0;
+	free(vma->pages);
+	vma->pages = NULL;
     }
 
-    if (old_vma_prot != -1)
-	r_mprotect(pid, (void*)vma->start, vma->length, old_vma_prot);
+    if (vma->have_data)
+	dedup_vma_pages(vma_pid, vma, pv->stream);
+}
 
-    last_vma_end = vma->start + vma->length;
-    return 1;
+/* Does everything that was left until the target was let go (or, when it's
+ * being streamed, everything that doesn't need it stopped from the start).
+ */
+void finish_chunks_vma()
+{
+    int i;
+
+    for (i = 0; i < n_pending; i++) {
+	finish_one_vma(&pending[i]);
+#ifdef __i386__
+	find_libcgp(pending[i].vma);
+#endif
+    }
+    free(pending);
+    pending = NULL;
+    n_pending = max_pending = 0;
+
+    if (zero_pages || dup_pages)
+	debug("[+] Left out %ld zero and %ld duplicate pages (%ld KB).",
+		zero_pages, dup_pages,
+		(zero_pages + dup_pages) * (_getpagesize >> 10));
+    if (incremental)
+	debug("[+] Left %ld unchanged pages (%ld KB) to the parent image.",
+		parent_pages, parent_pages * (_getpagesize >> 10));
+    if (remote_pages)
+	debug("[+] Left %ld pages (%ld KB) to the page server.",
+		remote_pages, remote_pages * (_getpagesize >> 10));
 }
 
 void fetch_chunks_vma(pid_t pid, int flags, struct list *l, long *bin_offset)
@@ -339,6 +1201,16 @@ void fetch_chunks_vma(pid_t pid, int flags, struct list *l, long *bin_offset)
 
     list_init(work_list);
 
+    vma_pid = pid;
+    if (vma_window)
+	window = xmalloc(vma_window);
+
+    if ((flags & (INCREMENTAL_IMAGE|TRACK_DIRTY)) && !soft_dirty_works())
+	bail("This kernel doesn't track soft-dirty pages, which incremental "
+		"images need.");
+    incremental = flags & INCREMENTAL_IMAGE;
+    serve_pages_too = flags & SERVE_PAGES;
+
     snprintf(tmp_fn, 30, "/proc/%d/maps", pid);
     f = fopen(tmp_fn, "r");
 
@@ -371,22 +1243,6 @@ void fetch_chunks_vma(pid_t pid, int flags, struct list *l, long *bin_offset)
 		    i = work_list.head;
 		continue;
 	}
-    #ifdef __i386__
-	if (chunk->vma.filename != NULL)
-	    if (((strstr(chunk->vma.filename, "libc-") != NULL) ||
-		(strstr(chunk->vma.filename, "libc.") != NULL) ||
-		(strstr(chunk->vma.filename, "libc_") != NULL)) && !gp_chunk) {
-		warn = 0;
-		info("[+] libc mapping found: %s\n", chunk->vma.filename);
-		gp_chunk = xmalloc(sizeof(struct cp_chunk));
-		gp_chunk->type = CP_CHUNK_GETPID;
-		if (libc_hack_fetch(chunk->vma.filename, &gp_chunk->signature.code) == EXIT_FAILURE) {
-		    info("[W] failed to fetch __getpid signature. Probably a call to getpid will return the old PID\n");
-		    free(gp_chunk);
-		    warn++;
-		}
-	    }
-    #endif
 	vma_no++;
 	list_append(l, chunk);
 	chunk = NULL;
@@ -397,6 +1253,12 @@ void fetch_chunks_vma(pid_t pid, int flags, struct list *l, long *bin_offset)
     if (chunk)
 	free(chunk);
 
+    /* Everything's been read (or will be, with the process still stopped),
+     * so the next incremental image can start from here. */
+    if ((flags & TRACK_DIRTY) && !clear_soft_dirty(pid))
+	bail("Unable to clear soft-dirty bits of process %d: %s", pid,
+		strerror(errno));
+
     /* FIXME: free work_list and strings if we're ever going to be long
      * running. */
 
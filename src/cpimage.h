@@ -3,6 +3,7 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <linux/types.h>
 #include <netinet/in.h>
 #include <linux/unistd.h>
@@ -12,16 +13,29 @@
 #include "list.h"
 #include "cplayout.h"
 
-#define IMAGE_VERSION 0x03
+/* Version 4 writes each chunk's fields together, as one length and checksum
+ * and then the fields, and gives each block of map data a checksum of its
+ * own. Version 3 checksummed every field apart with djb, and can still be
+ * read: it has no header chunk, its maps are saved whole or not at all, and
+ * none of the fields added since are there. Readers check image_version
+ * before reading any of those. */
+#define IMAGE_VERSION		0x04
+#define IMAGE_VERSION_V3	0x03
 
 #define ACTION_LOAD		0x01
 #define ACTION_PRINT		0x02
 #define ACTION_LOADPRINT	0x03
+#define ACTION_PARENT		0x04 /* Reading a parent image for its pages */
 
 #define GET_LIBRARIES_TOO          0x01
 #define GET_OPEN_FILE_CONTENTS     0x02
 #define KILL_ORIGINAL_PROCESS	0x04
 #define REFRESH_PID	0x08
+#define STREAM_VMA_DATA	0x10 /* Leave VMA data in the target until written */
+#define INCREMENTAL_IMAGE	0x20 /* Only save pages dirtied since the parent */
+#define TRACK_DIRTY	0x40 /* Clear soft-dirty bits for the next increment */
+#define FORK_SNAPSHOT	0x80 /* Save a forked copy, and let the original go */
+#define SERVE_PAGES	0x100 /* Leave memory in the target for the page server */
 
 /* Constants for cp_chunk.type */
 #define CP_CHUNK_HEADER		0x01
@@ -34,6 +48,8 @@
 #define CP_CHUNK_SIGHAND	0x08
 #define CP_CHUNK_FINAL		0x0a
 #define CP_CHUNK_GETPID	0x09
+#define CP_CHUNK_PARENT		0x0b
+#define CP_CHUNK_PAGE_SERVER	0x0c
 
 #define CP_CHUNK_MAGIC		0xC0DE
 
@@ -52,6 +68,7 @@ struct cp_header {
     gid_t gid;
     int n_children;
     off_t *children_offsets;
+    int checksum_type; /* for everything after the header */
 };
 
 struct cp_misc {
@@ -80,6 +97,37 @@ struct cp_tls {
 };
 #endif
 
+/* Constants for cp_vma.have_data */
+#define VMA_DATA_NONE		0x00
+#define VMA_DATA_FULL		0x01
+#define VMA_DATA_SPARSE		0x02 /* Only the ranges listed are saved */
+#define VMA_DATA_PAGES		0x03 /* As SPARSE, with a table for each page */
+#define VMA_DATA_REMOTE		0x04 /* As SPARSE, from the page server */
+
+/* Entries in the VMA_DATA_PAGES table. Each group of VMA_PAGE_GROUP pages in
+ * a range has its table, followed by just the literal pages of the group.
+ * Zero pages aren't saved at all, and duplicates point to the address of the
+ * first copy, which is always a literal page earlier in the image.
+ */
+#define VMA_PAGE_LITERAL	0UL
+#define VMA_PAGE_ZERO		1UL
+#define VMA_PAGE_PARENT		2UL /* unchanged since the parent image */
+/* anything else is the (page aligned) address of a page to copy */
+#define VMA_PAGE_GROUP		256
+
+/* Private maps of files can be mapped straight from an uncompressed image
+ * rather than read in, so their data is page aligned in the file. See
+ * write_align(). Anonymous ones can't: they'd stop being anonymous, and pages
+ * dropped with MADV_DONTNEED would come back from the image, not as zeros. */
+#define vma_mappable(v) \
+	(((v)->flags & (MAP_PRIVATE|MAP_SHARED|MAP_GROWSDOWN)) == MAP_PRIVATE \
+	 && !((v)->flags & MAP_ANONYMOUS) && !(v)->is_heap && (v)->inode \
+	 && (v)->filename && (v)->filename[0])
+
+struct cp_vma_range {
+    unsigned long offset, length; /* relative to the start of the VMA */
+};
+
 struct cp_vma {
     unsigned long start, length;
     int prot;
@@ -92,6 +140,19 @@ struct cp_vma {
     char is_heap;
     unsigned int checksum;
     void* data; /* length end-start */ /* in file, simply true if is data */
+    int n_ranges; /* For VMA_DATA_SPARSE. data holds the ranges back to back */
+    struct cp_vma_range *ranges;
+    unsigned int *range_sums; /* checksum of each range's data */
+    unsigned long *pages; /* For VMA_DATA_PAGES, an entry for every page in
+			     the ranges */
+};
+
+struct cp_parent {
+    char *filename; /* the image unchanged pages are to be found in */
+};
+
+struct cp_page_server {
+    char *path; /* the UNIX socket VMA_DATA_REMOTE maps are to be had from */
 };
 
 struct cp_sighand {
@@ -113,6 +174,7 @@ struct cp_file {
 struct cp_socket_tcp {
     struct sockaddr_in sin;
     void *ici; /* If the system supports tcpcp. */
+    void *repair; /* Or TCP_REPAIR. */
 };
 
 struct cp_socket_udp {
@@ -127,6 +189,8 @@ struct cp_socket_unix {
 
 struct cp_socket {
     int proto;
+    int handoff; /* Ask for it at handoff_addr, rather than making it anew */
+    struct sockaddr_un handoff_addr;
     union {
 	struct cp_socket_tcp s_tcp;
 	struct cp_socket_udp s_udp;
@@ -157,11 +221,14 @@ struct cp_fd {
 struct cp_chunk {
     int type;
     union {
+	struct cp_header header;
 	struct cp_misc misc;
 	struct cp_regs regs;
 	struct cp_fd fd;
 	struct cp_vma vma;
 	struct cp_sighand sighand;
+	struct cp_parent parent;
+	struct cp_page_server page_server;
 #ifdef __i386__
 	struct cp_i387_data i387_data;
 	struct cp_tls tls;
@@ -175,23 +242,48 @@ struct stream_ops {
     void (*finish)(void *data);
     int (*read)(void *data, void *buf, int len);
     int (*write)(void *data, void *buf, int len);
+    /* Optional: writes several buffers at once, without copying big ones
+     * where the stream can help it. Returns the bytes written. */
+    int (*writev)(void *data, const struct iovec *iov, int iovcnt);
     long (*ftell)(void *data);
     void (*dup2)(void *data, int newfd);
+    /* Optional, for streams that store data as is: where in the file (fd)
+     * the next byte read comes from, and skipping ahead without reading */
+    long (*file_offset)(void *data, int *fd);
+    void (*skip)(void *data, long len);
+    /* Optional: reads straight into buf, with no copy on the way, adding
+     * what's read to *sum a piece of at most READ_SLICE bytes at a time */
+    int (*read_into)(void *data, void *buf, int len, unsigned int *sum);
 };
+
+/* Big bits are read and checksummed a piece at a time, so that each piece
+ * is still in cache when it's checksummed */
+#define READ_SLICE	(64 * 1024)
 extern struct stream_ops *stream_ops;
 
 
 /* cpimage.c */
 void read_bit(void *fptr, void *buf, int len);
 void write_bit(void *fptr, void *buf, int len);
+void read_data(void *fptr, void *buf, int len);
+void write_data(void *fptr, void *buf, int len);
+void flush_bits(void *fptr);
 char *read_string(void *fptr, char *buf, int maxlen);
 void write_string(void *fptr, char *buf);
 int read_chunk(void *fptr, int action);
 void write_chunk(void *fptr, struct cp_chunk *chunk);
 void write_process(int fd, struct list l);
 void discard_bit(void *fptr, int length);
+long read_align(void *fptr, int *fd);
+void write_align(void *fptr, int wanted);
+unsigned int read_bit_begin(void *fptr);
+void read_bit_part(void *fptr, void *buf, int len, unsigned int *sum);
+void read_bit_end(unsigned int want, unsigned int sum, long len);
 void get_process(pid_t pid, int flags, struct list *l, long *heap_start);
+void release_process(pid_t pid, int flags);
 unsigned int checksum(char *ptr, int len, unsigned int start);
+extern int image_version; /* of the image being read */
+void set_image_version(int version);
 
 /* cp_header.c */
 void fetch_chunk_header(void *fptr, int flags, struct list *process_image);
@@ -203,6 +295,14 @@ void fetch_chunk_misc(void *fptr, int flags, struct list *process_image);
 void read_chunk_misc(void *fptr, int action);
 void write_chunk_misc(void *fptr, struct cp_misc *data);
 
+/* cp_r_lazy.c */
+int lazy_bit(void *fptr, unsigned long addr, unsigned long len, int prot);
+int lazy_read_page(unsigned long addr, void *buf);
+void lazy_remote(unsigned long addr, unsigned long len, int prot);
+void start_lazy_pager();
+void read_chunk_page_server(void *fptr, int action);
+extern int lazy_restore;
+
 /* cp_regs.c */
 void fetch_chunks_regs(pid_t pid, int flags, struct list *process_image,
 	int stopped);
@@ -249,6 +349,9 @@ void write_chunk_fd_fifo(void *fptr, struct cp_fifo *fifo);
 /* cp_fd_socket.c */
 void fetch_fd_socket(pid_t pid, int flags, int fd, int inode,
 	struct cp_socket *socket);
+void finish_fd_sockets(pid_t pid, int flags);
+extern char *handoff_path;
+void serve_handoff();
 void read_chunk_fd_socket(void *fptr, struct cp_fd *fd, int action);
 void write_chunk_fd_socket(void *fptr, struct cp_socket *socket);
 
@@ -257,13 +360,42 @@ void write_chunk_fd_socket(void *fptr, struct cp_socket *socket);
 int fetch_chunk_libcgp(struct cp_chunk **ptr);
 #endif
 void fetch_chunks_vma(pid_t pid, int flags, struct list *l, long *bin_offset);
+void finish_chunks_vma();
 void read_chunk_vma(void *fptr, int action);
 void write_chunk_vma(void *fptr, struct cp_vma *data);
 extern int extra_prot_flags;
 extern unsigned long scribble_zone;
+extern int scribble_prot;
 extern unsigned long syscall_loc;
 extern unsigned long vdso_start;
 extern unsigned long vdso_end;
+extern unsigned long vma_window;
+int clear_soft_dirty(pid_t pid);
+int soft_dirty_works();
+void find_remote_helpers(pid_t pid);
+int maps_not_forked(pid_t pid, pid_t copy);
+
+/* cp_parent.c */
+void read_chunk_parent(void *fptr, int action);
+void write_chunk_parent(void *fptr, struct cp_parent *data);
+void fetch_chunk_parent(char *filename, struct list *l);
+#define FILL_DATA	0 /* the data is in buf */
+#define FILL_ZERO	1
+#define FILL_PARENT	2 /* the next image down the chain has it */
+#define FILL_COPY	3 /* it's a copy of the page at from */
+void add_parent_hole(unsigned long addr, unsigned long len);
+int parent_holes_in(unsigned long addr, unsigned long len);
+void fill_parent_holes(unsigned long addr, unsigned long len, int how,
+	char *buf, unsigned long from);
+void defer_mprotect(unsigned long start, unsigned long len, int prot);
+void restore_from_parents();
+
+/* pageserver.c */
+extern char *page_server_path;
+void fetch_chunk_page_server(struct list *l);
+void write_chunk_page_server(void *fptr, struct cp_page_server *data);
+void page_server_add(pid_t pid, unsigned long start, unsigned long len);
+void serve_pages();
 
 /* cp_sighand.c */
 void read_chunk_sighand(void *fptr, int action);
@@ -11,33 +11,132 @@
 
 extern int getpid_snippet;
 
-void read_bit(void *fptr, void *buf, int len)
+int image_version = IMAGE_VERSION;
+
+/* Called once the image is found. Version 3 images only had the one kind of
+ * checksum; version 4 images have a header saying which, checksummed with
+ * CRC32C. */
+void set_image_version(int version)
 {
-    int rlen;
-    int c1, c2;
+    image_version = version;
+    if (version == IMAGE_VERSION_V3)
+	checksum_type = CHECKSUM_DJB;
+    else
+	checksum_type = CHECKSUM_CRC32C;
+}
 
-    if (len == 0)
+/* A version 4 image's fields come a chunk at a time, and are handed out from
+ * here by read_bit() */
+static char *fields;
+static int fields_len, fields_pos, fields_max;
+
+/* Reads len bytes into buf, adding them to *sum as it goes */
+static void read_summed(void *fptr, char *buf, int len, unsigned int *sum)
+{
+    int rlen, n;
+
+    if (stream_ops->read_into) {
+	rlen = stream_ops->read_into(fptr, buf, len, sum);
+	if (rlen != len)
+	    bail("Read error (wanted %d bytes, got %d)!", len, rlen);
 	return;
+    }
+    while (len > 0) {
+	n = len > READ_SLICE ? READ_SLICE : len;
+	rlen = stream_ops->read(fptr, buf, n);
+	if (rlen != n)
+	    bail("Read error (wanted %d bytes, got %d)!", n, rlen);
+	*sum = checksum(buf, n, *sum);
+	buf += n;
+	len -= n;
+    }
+}
+
+/* The checksum, then len bytes of data: all of every bit in a version 3
+ * image, and blocks of data in version 4 */
+static void read_summed_bit(void *fptr, void *buf, int len)
+{
+    unsigned int c1, c2 = 0;
 
     stream_ops->read(fptr, &c1, sizeof(c1));
-    rlen = stream_ops->read(fptr, buf, len);
-    if (rlen != len)
-	bail("Read error (wanted %d bytes, got %d)!", len, rlen);
-    c2 = checksum(buf, len, 0);
-    if (c1 != c2)
+    read_summed(fptr, buf, len, &c2);
+    if (!checksum_matches(c1, c2))
 	debug("CHECKSUM MISMATCH (len %d): should be 0x%x, measured 0x%x",
 		len, c1, c2);
 }
 
-void discard_bit(void *fptr, int length)
+/* Reads in the next chunk's worth of fields from a version 4 image */
+static void read_fields(void *fptr)
+{
+    unsigned int head[2], sum = 0;
+    int rlen, len;
+
+    rlen = stream_ops->read(fptr, head, sizeof(head));
+    if (rlen != sizeof(head))
+	bail("Read error (wanted %d bytes, got %d)!", (int)sizeof(head), rlen);
+    len = head[0];
+    if (len <= 0)
+	bail("Bad length of fields in image (%d)!", len);
+
+    if (len > fields_max) {
+	free(fields);
+	fields_max = len < 4096 ? 4096 : len;
+	fields = xmalloc(fields_max);
+    }
+    read_summed(fptr, fields, len, &sum);
+    if (!checksum_matches(head[1], sum))
+	debug("CHECKSUM MISMATCH (len %d): should be 0x%x, measured 0x%x",
+		len, head[1], sum);
+    fields_len = len;
+    fields_pos = 0;
+}
+
+/* Anything read straight from the stream has to come after all of the fields
+ * before it have been read. */
+static void end_of_fields()
+{
+    if (image_version != IMAGE_VERSION_V3 && fields_pos != fields_len)
+	bail("%d bytes of fields left unread in image!",
+		fields_len - fields_pos);
+}
+
+void read_bit(void *fptr, void *buf, int len)
+{
+    if (len == 0)
+	return;
+
+    if (image_version == IMAGE_VERSION_V3) {
+	read_summed_bit(fptr, buf, len);
+	return;
+    }
+    if (fields_pos == fields_len)
+	read_fields(fptr);
+    if (len > fields_len - fields_pos)
+	bail("Field runs past the end of its chunk (wanted %d bytes, %d left)!",
+		len, fields_len - fields_pos);
+    memcpy(buf, fields + fields_pos, len);
+    fields_pos += len;
+}
+
+/* Reads what write_data() wrote */
+void read_data(void *fptr, void *buf, int len)
+{
+    if (len == 0)
+	return;
+
+    end_of_fields();
+    read_summed_bit(fptr, buf, len);
+}
+
+static void skip_bytes(void *fptr, int length)
 {
     static char null[4096];
     int remaining;
 
-    if (length == 0)
+    if (stream_ops->skip) {
+	stream_ops->skip(fptr, length);
 	return;
-
-    stream_ops->read(fptr, null, sizeof(unsigned int));
+    }
     remaining = length;
     while (remaining > 0) {
 	int len = sizeof(null);
@@ -47,6 +146,65 @@ void discard_bit(void *fptr, int length)
     }
 }
 
+void discard_bit(void *fptr, int length)
+{
+    unsigned int c;
+
+    if (length == 0)
+	return;
+
+    end_of_fields();
+    stream_ops->read(fptr, &c, sizeof(c));
+    skip_bytes(fptr, length);
+}
+
+/* Skips the padding from write_align(). If the next bit's data is page
+ * aligned in the image file, returns where it is in fd, so it can be mapped
+ * from there. Otherwise (or for streams that don't keep the data as is, or
+ * version 3 images, which have no padding) returns -1. */
+long read_align(void *fptr, int *fd)
+{
+    long off;
+    int pad;
+
+    if (image_version == IMAGE_VERSION_V3)
+	return -1;
+    read_bit(fptr, &pad, sizeof(pad));
+    end_of_fields();
+    if (pad)
+	skip_bytes(fptr, pad);
+    if (!stream_ops->file_offset || !stream_ops->skip ||
+	    (off = stream_ops->file_offset(fptr, fd)) == -1)
+	return -1;
+    off += sizeof(unsigned int);
+    return (off & (_getpagesize - 1)) ? -1 : off;
+}
+
+/* For bits too big to read in one go: read_bit_begin() gives the checksum
+ * the data should have, read_bit_part() reads each piece of it in turn, and
+ * read_bit_end() checks the result.
+ */
+unsigned int read_bit_begin(void *fptr)
+{
+    unsigned int c;
+
+    end_of_fields();
+    stream_ops->read(fptr, &c, sizeof(c));
+    return c;
+}
+
+void read_bit_part(void *fptr, void *buf, int len, unsigned int *sum)
+{
+    read_summed(fptr, buf, len, sum);
+}
+
+void read_bit_end(unsigned int want, unsigned int sum, long len)
+{
+    if (!checksum_matches(want, sum))
+	debug("CHECKSUM MISMATCH (len %ld): should be 0x%x, measured 0x%x",
+		len, want, sum);
+}
+
 char *read_string(void *fptr, char *buf, int maxlen)
 {
     /* maxlen is ignored if it is 0 */
@@ -73,6 +231,7 @@ int read_chunk(void *fptr, int action)
     if (action & ACTION_PRINT)
 	fprintf(stderr, "[%8lx] ", stream_ops->ftell(fptr));
 
+    end_of_fields();
     read_bit(fptr, &magic, sizeof(magic));
     if (magic != CP_CHUNK_MAGIC)
 	bail("Invalid magic in chunk header (0x%x)!", magic);
@@ -98,6 +257,12 @@ int read_chunk(void *fptr, int action)
 	case CP_CHUNK_SIGHAND:
 	    read_chunk_sighand(fptr, action);
 	    break;
+	case CP_CHUNK_PARENT:
+	    read_chunk_parent(fptr, action);
+	    break;
+	case CP_CHUNK_PAGE_SERVER:
+	    read_chunk_page_server(fptr, action);
+	    break;
 #ifdef __i386__
 	case CP_CHUNK_I387_DATA:
 	    read_chunk_i387_data(fptr, action);
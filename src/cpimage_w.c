@@ -10,17 +10,102 @@
 #endif
 
 
+/* The fields of a chunk are gathered up here, until flush_bits() writes them
+ * out together with one length and checksum. */
+static char *fields;
+static int fields_len, fields_max;
+
+/* Writes a header and then len bytes of buf, in one go if the stream can */
+static void write_framed(void *fptr, void *head, int head_len, void *buf,
+	int len)
+{
+    struct iovec iov[2];
+
+    if (stream_ops->writev) {
+	iov[0].iov_base = head;
+	iov[0].iov_len = head_len;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	if (stream_ops->writev(fptr, iov, 2) != head_len + len)
+	    bail("Write error!");
+	return;
+    }
+    stream_ops->write(fptr, head, head_len);
+    if (stream_ops->write(fptr, buf, len) != len)
+	bail("Write error!");
+}
+
 void write_bit(void *fptr, void *buf, int len)
 {
-    int c;
+    char *p;
 
     if (len == 0)
 	return;
 
+    if (fields_len + len > fields_max) {
+	fields_max = 2 * (fields_len + len);
+	if (fields_max < 4096)
+	    fields_max = 4096;
+	p = xmalloc(fields_max);
+	memcpy(p, fields, fields_len);
+	free(fields);
+	fields = p;
+    }
+    memcpy(fields + fields_len, buf, len);
+    fields_len += len;
+}
+
+/* Writes out the fields gathered so far. This has to be done before anything
+ * is written to the stream directly. */
+void flush_bits(void *fptr)
+{
+    unsigned int head[2];
+
+    if (fields_len == 0)
+	return;
+
+    head[0] = fields_len;
+    head[1] = checksum(fields, fields_len, 0);
+    write_framed(fptr, head, sizeof(head), fields, fields_len);
+    fields_len = 0;
+}
+
+/* Writes a block of map data (or anything else big), with its own checksum,
+ * rather than copying it in with the fields. */
+void write_data(void *fptr, void *buf, int len)
+{
+    unsigned int c;
+
+    if (len == 0)
+	return;
+
+    flush_bits(fptr);
     c = checksum(buf, len, 0);
-    stream_ops->write(fptr, &c, sizeof(c));
-    if (stream_ops->write(fptr, buf, len) != len)
-	bail("Write error!");
+    write_framed(fptr, &c, sizeof(c), buf, len);
+}
+
+/* Pads the image so that the next bit of data (after its checksum) starts on
+ * a page boundary in the file, if wanted and the stream can tell where it is
+ * in the file. The padding's length is always written, for read_align(), as
+ * the last of the fields before it. */
+void write_align(void *fptr, int wanted)
+{
+    static char zero[4096];
+    int pad = 0, fd;
+    long off;
+
+    if (wanted && stream_ops->file_offset &&
+	    (off = stream_ops->file_offset(fptr, &fd)) != -1)
+	pad = -(off + 2 * sizeof(unsigned int) + fields_len + sizeof(int) +
+		sizeof(unsigned int)) & (_getpagesize - 1);
+    write_bit(fptr, &pad, sizeof(pad));
+    flush_bits(fptr);
+    while (pad > 0) {
+	int n = pad > sizeof(zero) ? sizeof(zero) : pad;
+	if (stream_ops->write(fptr, zero, n) != n)
+	    bail("Write error!");
+	pad -= n;
+    }
 }
 
 void write_string(void *fptr, char *buf)
@@ -40,6 +125,7 @@ static void write_final_chunk(void *fptr)
     int magic = CP_CHUNK_MAGIC, type = CP_CHUNK_FINAL;
     write_bit(fptr, &magic, sizeof(int));
     write_bit(fptr, &type, sizeof(int));
+    flush_bits(fptr);
 }
 
 void write_chunk(void *fptr, struct cp_chunk *chunk)
@@ -50,6 +136,9 @@ void write_chunk(void *fptr, struct cp_chunk *chunk)
     write_bit(fptr, &chunk->type, sizeof(chunk->type));
 
     switch (chunk->type) {
+	case CP_CHUNK_HEADER:
+	    write_chunk_header(fptr, &chunk->header);
+	    break;
 	case CP_CHUNK_MISC:
 	    write_chunk_misc(fptr, &chunk->misc);
 	    break;
@@ -65,6 +154,12 @@ void write_chunk(void *fptr, struct cp_chunk *chunk)
 	case CP_CHUNK_SIGHAND:
 	    write_chunk_sighand(fptr, &chunk->sighand);
 	    break;
+	case CP_CHUNK_PARENT:
+	    write_chunk_parent(fptr, &chunk->parent);
+	    break;
+	case CP_CHUNK_PAGE_SERVER:
+	    write_chunk_page_server(fptr, &chunk->page_server);
+	    break;
 #ifdef __i386__
 	case CP_CHUNK_I387_DATA:
 	    write_chunk_i387_data(fptr, &chunk->i387_data);
@@ -79,17 +174,28 @@ void write_chunk(void *fptr, struct cp_chunk *chunk)
 	default:
 	    bail("Unknown chunk type to write (0x%x)", chunk->type)
     }
+    flush_bits(fptr);
 }
 
 void write_process(int fd, struct list l)
 {
     void *fptr;
     struct item *i;
+    struct cp_chunk header;
 
     fptr = stream_ops->init(fd, O_WRONLY);
     if (!fptr)
 	bail("Unable to initialize writer.");
 
+    /* The stub can't know how the header's checksummed until it's read it,
+     * so that's always with CRC32C. */
+    memset(&header, 0, sizeof(header));
+    header.type = CP_CHUNK_HEADER;
+    header.header.checksum_type = checksum_type;
+    checksum_type = CHECKSUM_CRC32C;
+    write_chunk(fptr, &header);
+    checksum_type = header.header.checksum_type;
+
     for (i = l.head; i; i = i->next) {
 	struct cp_chunk *cp = i->p;
 	write_chunk(fptr, cp);
@@ -39,17 +39,60 @@ long syscall_check(int retval, int can_be_fake, char* desc, ...);
 void safe_read(int fd, void* dest, size_t count, char* desc);
 void *xmalloc(int len);
 void xfree(void* p);
+long long now_usecs();
 unsigned int checksum(char *ptr, int len, unsigned int start);
+unsigned int map_checksum(char *ptr, int len, unsigned int start);
+int set_checksum(char *name);
+extern int checksum_type;
+extern char *checksum_names[];
+
+/* Values for checksum_type, as recorded in the image's header */
+#define CHECKSUM_NONE		0
+#define CHECKSUM_DJB		1 /* All there was before version 4 images */
+#define CHECKSUM_CRC32C		2
+#define N_CHECKSUMS		3
+
+/* Whether a checksum read back is what it should be, if they're on at all */
+#define checksum_matches(want, got) \
+	(checksum_type == CHECKSUM_NONE || (want) == (got))
 
 /* writer_raw.c */
 extern struct stream_ops raw_ops;
 
+/* writer_gzip.c */
+extern struct stream_ops gzip_ops;
+
 /* writer_buffered.c */
 extern struct stream_ops buf_ops;
 
 /* writer_lzo.c */
 extern struct stream_ops lzo_ops;
 
+/* writer_zblock.c */
+extern struct stream_ops zblock_ops;
+
+/* writer_zstd.c */
+extern struct stream_ops zstd_ops;
+
+/* freeze.c */
+extern int compression_level; /* -1 for the writer's default */
+
+/* A writer built into cryopid, along with the stub that reads its output */
+struct writer_info {
+    char *name;
+    char *desc;
+    struct stream_ops *ops;
+    char *stub_start;
+    long stub_size;
+};
+
+/* writers.c */
+extern struct stream_ops *stream_ops;
+extern char *stub_start;
+extern long stub_size;
+int set_writer(char *name);
+void list_writers();
+
 #define MAX_SIGS 31
 
 #ifdef COMPILING_STUB
@@ -58,9 +101,8 @@ extern struct stream_ops lzo_ops;
 #define declare_writer(s, x, desc) \
     extern char *_binary_stub_##s##_start; \
     extern int _binary_stub_##s##_size; \
-    struct stream_ops *stream_ops = &x; \
-    char *stub_start = (char*)&_binary_stub_##s##_start; \
-    long stub_size = (long)&_binary_stub_##s##_size
+    struct writer_info writer_##s = { #s, desc, &x, \
+	(char*)&_binary_stub_##s##_start, (long)&_binary_stub_##s##_size }
 
 #endif
 
@@ -7,8 +7,10 @@
 
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -16,8 +18,9 @@
 #include "cpimage.h"
 #include "process.h"
 #include "list.h"
+#include "pipeline.h"
 
-extern struct stream_ops *stream_ops;
+int compression_level = -1;
 
 void usage(char* argv0)
 {
@@ -30,8 +33,39 @@ void usage(char* argv0)
 "    -l      Include libraries in the image of the file for a full image.\n"
 "    -k      Kill the original process.\n"
 "    -P      Refresh the PID of the process at resume time.\n"
+"    -m <method> Access target memory with the given method (process_vm,\n"
+"            procmem or ptrace). The fastest available is used by default.\n"
+"    -s <KB> Stream memory into the image in windows of this size, rather\n"
+"            than holding all of it in memory first. The process is kept\n"
+"            stopped until the image is written.\n"
+"    -j <n>  Compress the image using n threads, where the writer supports\n"
+"            it.\n"
+"    -z <level> Compression level for the writer to use.\n"
+"    -w <writer> Nominate an output writer (and the stub to go with it).\n"
+"    --list-writers List the available writers, and how fast each is on\n"
+"            this host.\n"
+"    -I      Start tracking the pages the process dirties, so that the\n"
+"            next image can be incremental.\n"
+"    -i <parent> Make an incremental image, saving only the pages dirtied\n"
+"            since the parent image was taken (with -I or -i). The parent\n"
+"            image must be kept, and is needed to resume this one.\n"
+"    -p <rounds> Copy memory while the process keeps running, in up to this\n"
+"            many rounds, so it's only stopped to re-read what it dirtied\n"
+"            since the last one.\n"
+"    -F      Fork the process, and save the copy, so that the process is\n"
+"            only stopped for as long as it takes to fork it.\n"
+"    -H <path> Keep the process's listening sockets open after it's gone,\n"
+"            and hand them to the resumed process over a UNIX socket at\n"
+"            this path, so that connections made in between are queued\n"
+"            rather than refused. They're kept for up to ten minutes.\n"
+"    -S <path> Leave the process's private memory out of the image, and\n"
+"            keep the process stopped once it's written, serving that\n"
+"            memory over a UNIX socket at this path. The resumed process\n"
+"            starts straight away, and fetches it as it's touched.\n"
+"    -C <type> Checksum the image with crc32c (the default), djb (slower),\n"
+"            or none at all, for speed. Unsaved libraries are still checked\n"
+"            against the files they came from.\n"
 /*
-"    -w <writer> Nomiate an output writer to use.\n"
 "    -f      Save the contents of open files into the image.\n"
 "    -c      Save children of this process as well.\n"
 */
@@ -41,6 +75,33 @@ void usage(char* argv0)
     exit(1);
 }
 
+/* The image is written to a new file next to name, and only renamed over it
+ * once it's complete. Processes resumed from an earlier image of the same
+ * name may have parts of it mapped still (see map_bit()), and truncating it
+ * in place would take those pages away from under them. Anything that isn't
+ * a regular file (a pipe, say) is written to as is, and *tmp_name left NULL.
+ */
+static int open_image(char *name, char **tmp_name)
+{
+    struct stat st;
+    mode_t mask;
+    int fd;
+
+    *tmp_name = NULL;
+    if (stat(name, &st) == 0 && !S_ISREG(st.st_mode))
+	return open(name, O_WRONLY|O_TRUNC);
+
+    *tmp_name = xmalloc(strlen(name) + 8);
+    sprintf(*tmp_name, "%s.XXXXXX", name);
+    if ((fd = mkstemp(*tmp_name)) == -1)
+	return -1;
+    /* As open(name, O_CREAT, 0777) would have made it */
+    mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0777 & ~mask);
+    return fd;
+}
+
 int main(int argc, char** argv)
 {
     pid_t target_pid;
@@ -48,9 +109,15 @@ int main(int argc, char** argv)
     int c;
     int flags = 0;
     int get_children = 0;
+    int want_list = 0;
+    char *parent_image = NULL;
+    int precopy_rounds = 0;
     int fd;
+    char *tmp_name;
     long offset = 0;
 
+    set_writer(NULL);
+
     /* Parse options */
     while (1) {
 	int option_index = 0;
@@ -58,15 +125,27 @@ int main(int argc, char** argv)
 	    {"libraries", 0, 0, 'l'},
 	    {"kill", 0, 0, 'k'},
 	    {"pid", 0, 0, 'P'},
+	    {"mem", 1, 0, 'm'},
+	    {"stream", 1, 0, 's'},
+	    {"threads", 1, 0, 'j'},
+	    {"level", 1, 0, 'z'},
+	    {"writer", 1, 0, 'w'},
+	    {"list-writers", 0, 0, 'W'},
+	    {"track-dirty", 0, 0, 'I'},
+	    {"incremental", 1, 0, 'i'},
+	    {"precopy", 1, 0, 'p'},
+	    {"fork", 0, 0, 'F'},
+	    {"handoff", 1, 0, 'H'},
+	    {"serve", 1, 0, 'S'},
+	    {"checksum", 1, 0, 'C'},
 	    /*
 	    {"files", 0, 0, 'f'},
 	    {"children", 0, 0, 'c'},
-	    {"writer", 1, 0, 'w'},
 	    */
 	    {0, 0, 0, 0},
 	};
 
-	c = getopt_long(argc, argv, "lkP"/*"fcw:"*/, long_options, &option_index);
+	c = getopt_long(argc, argv, "lkPm:s:j:z:w:Ii:p:FH:S:C:"/*"fc"*/, long_options, &option_index);
 	if (c == -1)
 	    break;
 	switch(c) {
@@ -85,11 +164,81 @@ int main(int argc, char** argv)
 	    case 'c':
 		get_children = 1;
 		break;
-	    /*
+	    case 'm':
+		if (!mem_set_backend(optarg)) {
+		    fprintf(stderr, "Unknown memory access method: %s\n", optarg);
+		    usage(argv[0]);
+		}
+		break;
+	    case 's':
+		vma_window = strtoul(optarg, NULL, 10) * 1024;
+		if (vma_window < _getpagesize) {
+		    fprintf(stderr, "Invalid window size: %s\n", optarg);
+		    usage(argv[0]);
+		}
+		flags |= STREAM_VMA_DATA;
+		break;
+	    case 'j':
+		pipeline_threads = atoi(optarg);
+		if (pipeline_threads < 1) {
+		    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+		    usage(argv[0]);
+		}
+		break;
+	    case 'z':
+		compression_level = atoi(optarg);
+		if (compression_level < 0) {
+		    fprintf(stderr, "Invalid compression level: %s\n", optarg);
+		    usage(argv[0]);
+		}
+		break;
 	    case 'w':
-		set_writer(optarg);
+		if (!set_writer(optarg)) {
+		    fprintf(stderr, "Unknown writer: %s\n", optarg);
+		    usage(argv[0]);
+		}
+		break;
+	    case 'W':
+		want_list = 1;
+		break;
+	    case 'I':
+		flags |= TRACK_DIRTY;
+		break;
+	    case 'i':
+		parent_image = optarg;
+		flags |= INCREMENTAL_IMAGE | TRACK_DIRTY;
+		break;
+	    case 'F':
+		flags |= FORK_SNAPSHOT;
+		break;
+	    case 'H':
+		handoff_path = optarg;
+		if (strlen(handoff_path) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+		    fprintf(stderr, "Handoff path is too long: %s\n", optarg);
+		    usage(argv[0]);
+		}
+		break;
+	    case 'S':
+		page_server_path = optarg;
+		if (strlen(page_server_path) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+		    fprintf(stderr, "Page server path is too long: %s\n", optarg);
+		    usage(argv[0]);
+		}
+		flags |= SERVE_PAGES;
+		break;
+	    case 'C':
+		if (!set_checksum(optarg)) {
+		    fprintf(stderr, "Unknown checksum type: %s\n", optarg);
+		    usage(argv[0]);
+		}
+		break;
+	    case 'p':
+		precopy_rounds = atoi(optarg);
+		if (precopy_rounds < 1) {
+		    fprintf(stderr, "Invalid number of rounds: %s\n", optarg);
+		    usage(argv[0]);
+		}
 		break;
-		*/
 	    case '?':
 		/* invalid option */
 		usage(argv[0]);
@@ -97,6 +246,11 @@ int main(int argc, char** argv)
 	}
     }
 
+    if (want_list) {
+	list_writers();
+	return 0;
+    }
+
     if (argc - optind != 2) {
 	usage(argv[0]);
 	return 1;
@@ -104,6 +258,29 @@ int main(int argc, char** argv)
 
     assert(stream_ops != NULL);
 
+    /* Both rely on the soft-dirty bits, which pre-copying clears, and
+     * streaming would read the memory from the target regardless. */
+    if (precopy_rounds && (flags & (INCREMENTAL_IMAGE|STREAM_VMA_DATA))) {
+	fprintf(stderr, "-p can't be used with -i or -s.\n");
+	return 1;
+    }
+
+    /* The copy is a new process, with none of the original's soft-dirty
+     * bits, and there's no point killing one we've just let go. */
+    if ((flags & FORK_SNAPSHOT) &&
+	    (precopy_rounds || (flags & (TRACK_DIRTY|KILL_ORIGINAL_PROCESS)))) {
+	fprintf(stderr, "-F can't be used with -p, -i, -I or -k.\n");
+	return 1;
+    }
+
+    /* The memory it leaves out can't be anybody's parent, and isn't worth
+     * copying ahead of time. */
+    if ((flags & SERVE_PAGES) &&
+	    (precopy_rounds || (flags & (TRACK_DIRTY|INCREMENTAL_IMAGE)))) {
+	fprintf(stderr, "-S can't be used with -p, -i or -I.\n");
+	return 1;
+    }
+
     target_pid = atoi(argv[optind+1]);
     if (target_pid <= 1) {
 	fprintf(stderr, "Invalid pid: %d\n", target_pid);
@@ -111,9 +288,17 @@ int main(int argc, char** argv)
     }
 
     list_init(proc_image);
+    if (parent_image)
+	fetch_chunk_parent(parent_image, &proc_image);
+    if (page_server_path)
+	fetch_chunk_page_server(&proc_image);
+    if (precopy_rounds)
+	precopy_process(target_pid, precopy_rounds);
+
     get_process(target_pid, flags, &proc_image, &offset);
+    precopy_finish();
 
-    fd = open(argv[optind], O_CREAT|O_WRONLY|O_TRUNC, 0777);
+    fd = open_image(argv[optind], &tmp_name);
     if (fd == -1) {
 	fprintf(stderr, "Couldn't open %s for writing: %s\n", argv[optind],
 	    strerror(errno));
@@ -123,8 +308,19 @@ int main(int argc, char** argv)
     write_stub(fd, offset);
 
     write_process(fd, proc_image);
-
     close(fd);
+    if (tmp_name && rename(tmp_name, argv[optind]) == -1) {
+	fprintf(stderr, "Couldn't rename %s to %s: %s\n", tmp_name,
+		argv[optind], strerror(errno));
+	unlink(tmp_name);
+	return 1;
+    }
+
+    serve_pages();
+    release_process(target_pid, flags);
+    mem_report_stats();
+
+    serve_handoff();
 
     return 0;
 }
@@ -0,0 +1,224 @@
+/*
+ * Post-copy: rather than saving the target's private anonymous memory in the
+ * image, it's left where it is, and the target kept stopped after the image
+ * is written. The resumed process is started straight away, and asks for
+ * those pages over a UNIX socket as they're touched, while the stub's lazy
+ * pager reads in the rest behind it (see cp_r_lazy.c).
+ *
+ * Each request is an address and a length, both unsigned longs, and is
+ * answered with exactly that many bytes of the target's memory. Anything
+ * outside the maps left to us, or that can't be read, gets the connection
+ * closed instead.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+#include "process.h"
+
+/* How long to wait for the resumed process to turn up, and for each request
+ * once it has (its pager asks for more as fast as it can, so a long pause
+ * means it's gone), in seconds. */
+#define PAGE_SERVER_WAIT	600
+#define PAGE_SERVER_IDLE	60
+
+#define PAGE_SERVER_CHUNK	(1024 * 1024)
+
+char *page_server_path;
+static int server_fd = -1;
+static pid_t served_pid;
+
+/* The maps left in the target, in order of address */
+struct served_map {
+    unsigned long start, len;
+};
+static struct served_map *served;
+static int n_served, max_served;
+
+void write_chunk_page_server(void *fptr, struct cp_page_server *data)
+{
+    write_string(fptr, data->path);
+}
+
+/* Starts listening at page_server_path, so it's there by the time the image
+ * is, and tells the image where to look. */
+void fetch_chunk_page_server(struct list *l)
+{
+    struct cp_chunk *chunk;
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, page_server_path, sizeof(sun.sun_path) - 1);
+    unlink(sun.sun_path);
+    syscall_check(server_fd = socket(PF_UNIX, SOCK_STREAM, 0), 0, "socket");
+    syscall_check(bind(server_fd, (struct sockaddr*)&sun, SUN_LEN(&sun)), 0,
+	    "bind(%s)", sun.sun_path);
+    syscall_check(listen(server_fd, 1), 0, "listen");
+
+    chunk = xmalloc(sizeof(struct cp_chunk));
+    chunk->type = CP_CHUNK_PAGE_SERVER;
+    chunk->page_server.path = page_server_path;
+    list_append(l, chunk);
+}
+
+/* Called for each map that's left in the target, as it's read */
+void page_server_add(pid_t pid, unsigned long start, unsigned long len)
+{
+    if (n_served == max_served) {
+	max_served = max_served ? max_served * 2 : 64;
+	served = realloc(served, max_served * sizeof(struct served_map));
+	if (!served)
+	    bail("Out of memory!");
+    }
+    served[n_served].start = start;
+    served[n_served].len = len;
+    n_served++;
+    served_pid = pid;
+}
+
+static int is_served(unsigned long addr, unsigned long len)
+{
+    int lo = 0, hi = n_served;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (served[mid].start + served[mid].len <= addr)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo < n_served && served[lo].start <= addr &&
+	addr + len <= served[lo].start + served[lo].len && addr + len > addr;
+}
+
+static int read_all(int fd, void *buf, int len)
+{
+    int r, got = 0;
+
+    while (got < len) {
+	r = read(fd, (char*)buf + got, len - got);
+	if (r == -1 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return got;
+	got += r;
+    }
+    return got;
+}
+
+static int write_all(int fd, void *buf, int len)
+{
+    int r, done = 0;
+
+    while (done < len) {
+	r = write(fd, (char*)buf + done, len - done);
+	if (r == -1 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return 0;
+	done += r;
+    }
+    return 1;
+}
+
+/* Answers one connection's requests until it's done. Returns how many bytes
+ * it was sent. */
+static unsigned long serve_client(int c)
+{
+    static char *buf;
+    struct timeval tv = { PAGE_SERVER_IDLE, 0 };
+    unsigned long req[2], sent = 0;
+
+    if (!buf)
+	buf = xmalloc(PAGE_SERVER_CHUNK);
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while (read_all(c, req, sizeof(req)) == sizeof(req)) {
+	unsigned long addr = req[0], len = req[1];
+
+	if (!is_served(addr, len)) {
+	    fprintf(stderr, "[-] Page server: asked for 0x%lx-0x%lx, which "
+		    "isn't ours.\n", addr, addr + len);
+	    break;
+	}
+	while (len > 0) {
+	    int n = len > PAGE_SERVER_CHUNK ? PAGE_SERVER_CHUNK : len;
+
+	    if (!mem_read_target(served_pid, buf, addr, n)) {
+		fprintf(stderr, "[-] Page server: can't read 0x%lx from the "
+			"target.\n", addr);
+		return sent;
+	    }
+	    if (!write_all(c, buf, n))
+		return sent;
+	    addr += n;
+	    len -= n;
+	    sent += n;
+	}
+    }
+    return sent;
+}
+
+/* Once the image is written, hands out the memory that was left in the
+ * target to the first process to connect, until it's got all it wants. The
+ * target is let go (or killed) afterwards, as it would have been straight
+ * away otherwise. */
+void serve_pages()
+{
+    struct pollfd pfd;
+    unsigned long sent;
+    int c, n;
+
+    if (server_fd == -1)
+	return;
+
+    if (!n_served) {
+	fprintf(stderr, "[+] No memory was left for the page server.\n");
+	goto out;
+    }
+
+    printf("[+] Serving memory from %s. Waiting for the image to be "
+	    "resumed.\n", page_server_path);
+    fflush(stdout);
+
+    pfd.fd = server_fd;
+    pfd.events = POLLIN;
+    do {
+	n = poll(&pfd, 1, PAGE_SERVER_WAIT * 1000);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+	fprintf(stderr, "[-] Nobody came for the memory. Giving up.\n");
+	goto out;
+    }
+    do {
+	c = accept(server_fd, NULL, NULL);
+    } while (c == -1 && errno == EINTR);
+    if (c == -1) {
+	perror("accept");
+	goto out;
+    }
+
+    sent = serve_client(c);
+    close(c);
+    debug("[+] Served %ld KB.", sent >> 10);
+
+out:
+    close(server_fd);
+    server_fd = -1;
+    unlink(page_server_path);
+}
+
+/* vim:set ts=8 sw=4 noet: */
@@ -0,0 +1,294 @@
+/*
+ * Multi-threaded block compression pipeline.
+ *
+ * The thread writing the image is the only one that may touch the target
+ * (it's the one ptrace'ing it), so it stays the reader: it fills blocks and
+ * submits them. A pool of compressor threads picks them up in any order, and
+ * a single writer thread puts them back in order and emits them. A fixed
+ * number of blocks circulate, so memory use doesn't depend on the size of
+ * the image.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "cryopid.h"
+#include "pipeline.h"
+
+int pipeline_threads = 1;
+
+struct pipe_stats {
+    long long bytes_in, bytes_out;
+    long long usecs;		/* busy (or for the reader, stalled) time */
+    long long depth_sum;
+    int depth_max, samples;
+};
+
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv, done_cv, free_cv;
+    int n_threads, finishing;
+    pthread_t *compressors, writer;
+    int dict_size;
+
+    struct pipe_block *blocks, *cur, *prev;
+    struct pipe_block *free_list;
+    struct pipe_block *todo_head, *todo_tail;
+    struct pipe_block *done;	/* sorted by seq */
+    int n_todo, n_done;
+    long next_seq, next_write;
+
+    pipe_compress_fn compress;
+    pipe_write_fn write;
+    void *arg;
+
+    long long start;
+    struct pipe_stats read, comp, out;
+};
+
+static void sample_depth(struct pipe_stats *s, int depth)
+{
+    s->depth_sum += depth;
+    if (depth > s->depth_max)
+	s->depth_max = depth;
+    s->samples++;
+}
+
+static void *compressor_thread(void *data)
+{
+    struct pipeline *p = data;
+    struct pipe_block *b, **pp;
+    void *state = NULL;
+    long long t;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+	while (!p->todo_head && !p->finishing)
+	    pthread_cond_wait(&p->work_cv, &p->lock);
+	if (!p->todo_head)
+	    break;
+	b = p->todo_head;
+	p->todo_head = b->next;
+	if (!p->todo_head)
+	    p->todo_tail = NULL;
+	p->n_todo--;
+	pthread_mutex_unlock(&p->lock);
+
+	t = now_usecs();
+	p->compress(p->arg, &state, b);
+	t = now_usecs() - t;
+
+	pthread_mutex_lock(&p->lock);
+	p->comp.usecs += t;
+	p->comp.bytes_in += b->in_len;
+	p->comp.bytes_out += b->out_len;
+	for (pp = &p->done; *pp && (*pp)->seq < b->seq; pp = &(*pp)->next)
+	    ;
+	b->next = *pp;
+	*pp = b;
+	p->n_done++;
+	sample_depth(&p->out, p->n_done);
+	pthread_cond_broadcast(&p->done_cv);
+    }
+    pthread_mutex_unlock(&p->lock);
+    p->compress(p->arg, &state, NULL);
+    return NULL;
+}
+
+static void *writer_thread(void *data)
+{
+    struct pipeline *p = data;
+    struct pipe_block *b;
+    long long t;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+	while (!(p->done && p->done->seq == p->next_write) &&
+		!(p->finishing && p->next_write == p->next_seq))
+	    pthread_cond_wait(&p->done_cv, &p->lock);
+	if (!p->done || p->done->seq != p->next_write)
+	    break;
+	b = p->done;
+	p->done = b->next;
+	p->n_done--;
+	pthread_mutex_unlock(&p->lock);
+
+	t = now_usecs();
+	p->write(p->arg, b);
+	t = now_usecs() - t;
+
+	pthread_mutex_lock(&p->lock);
+	p->out.usecs += t;
+	p->out.bytes_out += b->out_len;
+	b->next = p->free_list;
+	p->free_list = b;
+	p->next_write++;
+	pthread_cond_signal(&p->free_cv);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* If dict_size is non-zero, each block comes with up to that many bytes of
+ * the input preceding it, for compressors that carry history over.
+ */
+struct pipeline *pipeline_start(int in_size, int out_size, int dict_size,
+	pipe_compress_fn compress, pipe_write_fn write, void *arg)
+{
+    struct pipeline *p;
+    int i, n_blocks;
+
+    p = xmalloc(sizeof(struct pipeline));
+    memset(p, 0, sizeof(struct pipeline));
+    p->n_threads = pipeline_threads;
+    p->compress = compress;
+    p->write = write;
+    p->arg = arg;
+    p->dict_size = dict_size;
+
+    /* Enough to keep every compressor busy while the writer is catching up */
+    n_blocks = 2 * p->n_threads + 2;
+    p->blocks = xmalloc(n_blocks * sizeof(struct pipe_block));
+    for (i = 0; i < n_blocks; i++) {
+	p->blocks[i].in = xmalloc(in_size);
+	p->blocks[i].out = xmalloc(out_size);
+	p->blocks[i].dict = dict_size ? xmalloc(dict_size) : NULL;
+	p->blocks[i].next = p->free_list;
+	p->free_list = &p->blocks[i];
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cv, NULL);
+    pthread_cond_init(&p->done_cv, NULL);
+    pthread_cond_init(&p->free_cv, NULL);
+
+    p->compressors = xmalloc(p->n_threads * sizeof(pthread_t));
+    for (i = 0; i < p->n_threads; i++)
+	if (pthread_create(&p->compressors[i], NULL, compressor_thread, p))
+	    bail("Unable to create compressor thread!");
+    if (pthread_create(&p->writer, NULL, writer_thread, p))
+	bail("Unable to create writer thread!");
+
+    p->start = now_usecs();
+
+    return p;
+}
+
+/* Returns a buffer of in_size bytes to be filled and passed to
+ * pipeline_submit(). Blocks until one is free.
+ */
+char *pipeline_get_block(struct pipeline *p)
+{
+    long long t = now_usecs();
+
+    if (p->cur)
+	return p->cur->in;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->free_list)
+	pthread_cond_wait(&p->free_cv, &p->lock);
+    p->cur = p->free_list;
+    p->free_list = p->cur->next;
+    pthread_mutex_unlock(&p->lock);
+
+    /* Only we hand out blocks, so the previous one's input is still intact
+     * even if it's been written out already. */
+    p->cur->dict_len = 0;
+    if (p->dict_size && p->prev) {
+	int n = p->prev->in_len < p->dict_size ? p->prev->in_len : p->dict_size;
+	memcpy(p->cur->dict, p->prev->in + p->prev->in_len - n, n);
+	p->cur->dict_len = n;
+    }
+
+    p->read.usecs += now_usecs() - t;
+    return p->cur->in;
+}
+
+void pipeline_submit(struct pipeline *p, int in_len, int last)
+{
+    struct pipe_block *b = p->cur;
+
+    assert(b != NULL);
+    p->cur = NULL;
+    p->prev = b;
+    b->in_len = in_len;
+    b->last = last;
+    b->next = NULL;
+    p->read.bytes_in += in_len;
+
+    pthread_mutex_lock(&p->lock);
+    b->seq = p->next_seq++;
+    if (p->todo_tail)
+	p->todo_tail->next = b;
+    else
+	p->todo_head = b;
+    p->todo_tail = b;
+    p->n_todo++;
+    sample_depth(&p->comp, p->n_todo);
+    pthread_cond_signal(&p->work_cv);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void print_stage(char *name, long long bytes, long long usecs)
+{
+    fprintf(stderr, "[+]   %-9s %lld KB in %lld.%06llds",
+	    name, bytes >> 10, usecs / 1000000, usecs % 1000000);
+    if (usecs)
+	fprintf(stderr, " (%.1f MB/s)", (bytes / 1048576.0) / (usecs / 1000000.0));
+    fprintf(stderr, "\n");
+}
+
+static void print_depth(char *name, struct pipe_stats *s)
+{
+    fprintf(stderr, "[+]   %-9s queue depth avg %.1f, max %d\n", name,
+	    s->samples ? (double)s->depth_sum / s->samples : 0.0,
+	    s->depth_max);
+}
+
+/* Waits for everything submitted to be written, and tears it all down. */
+void pipeline_finish(struct pipeline *p)
+{
+    long long wall;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->cur) {
+	p->cur->next = p->free_list;
+	p->free_list = p->cur;
+	p->cur = NULL;
+    }
+    p->finishing = 1;
+    pthread_cond_broadcast(&p->work_cv);
+    pthread_cond_broadcast(&p->done_cv);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < p->n_threads; i++)
+	pthread_join(p->compressors[i], NULL);
+    pthread_join(p->writer, NULL);
+
+    wall = now_usecs() - p->start;
+
+    fprintf(stderr, "[+] Pipeline with %d compressor threads:\n", p->n_threads);
+    print_stage("read", p->read.bytes_in, wall - p->read.usecs);
+    fprintf(stderr, "[+]   %-9s stalled %lld.%06llds waiting for free blocks\n",
+	    "", p->read.usecs / 1000000, p->read.usecs % 1000000);
+    print_stage("compress", p->comp.bytes_in, p->comp.usecs / p->n_threads);
+    print_stage("write", p->out.bytes_out, p->out.usecs);
+    print_depth("compress", &p->comp);
+    print_depth("write", &p->out);
+
+    for (i = 0; i < 2 * p->n_threads + 2; i++) {
+	free(p->blocks[i].in);
+	free(p->blocks[i].out);
+	free(p->blocks[i].dict);
+    }
+    free(p->blocks);
+    free(p->compressors);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work_cv);
+    pthread_cond_destroy(&p->done_cv);
+    pthread_cond_destroy(&p->free_cv);
+    free(p);
+}
+
+/* vim:set ts=8 sw=4 noet: */
@@ -0,0 +1,39 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+/* A pipeline for writers that work on independent blocks. The thread that
+ * writes the image (and reads the target) fills blocks and submits them,
+ * a pool of threads compresses them, and a writer thread emits the results
+ * in order.
+ */
+
+struct pipe_block {
+    long seq;
+    char *in, *out;
+    char *dict;		/* tail of the previous block's input, if asked for */
+    int in_len, out_len, dict_len;
+    int last;		/* the final block of the stream */
+    unsigned long check; /* for the compressor to pass on to the writer */
+    struct pipe_block *next;
+};
+
+/* Compress b->in into b->out, setting b->out_len. state is private to the
+ * calling thread and starts out NULL. It's called with b NULL as the thread
+ * exits, to clean up state. */
+typedef void (*pipe_compress_fn)(void *arg, void **state, struct pipe_block *b);
+/* Emit a compressed block. Called from a single thread, in order. */
+typedef void (*pipe_write_fn)(void *arg, struct pipe_block *b);
+
+struct pipeline;
+
+extern int pipeline_threads;
+
+struct pipeline *pipeline_start(int in_size, int out_size, int dict_size,
+	pipe_compress_fn compress, pipe_write_fn write, void *arg);
+char *pipeline_get_block(struct pipeline *p);
+void pipeline_submit(struct pipeline *p, int in_len, int last);
+void pipeline_finish(struct pipeline *p);
+
+#endif /* _PIPELINE_H_ */
+
+/* vim:set ts=8 sw=4 noet: */
@@ -0,0 +1,393 @@
+/*
+ * Pre-copy: read the target's memory while it carries on running, then
+ * re-read whatever it dirtied in the meantime, in rounds, until there's
+ * little enough left that it's worth stopping it. The final stop then only
+ * has to read the pages dirtied since the last round, and takes the rest
+ * from here.
+ *
+ * Each round stops the target just long enough to read its soft-dirty bits
+ * and clear them. Anything it writes after that is dirty again, and is picked
+ * up by the next round (or the final stop).
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+#include "process.h"
+
+/* Stop once a round has fewer pages than this to copy, or isn't at least a
+ * quarter better than the one before. */
+#define PRECOPY_DONE_PAGES	256
+
+struct precopy_map {
+    unsigned long start, len;
+    char *data;
+    unsigned char *have; /* a byte per page: whether data holds a copy */
+};
+
+static struct precopy_map *maps; /* sorted by start */
+static int n_maps;
+static long reused_pages, reread_pages;
+
+static int target_is_stopped(pid_t pid)
+{
+    char buf[30];
+    char mode = 0;
+    FILE *f;
+
+    snprintf(buf, 30, "/proc/%d/stat", pid);
+    if ((f = fopen(buf, "r")) == NULL)
+	return 0;
+    fscanf(f, "%*s %*s %c", &mode);
+    fclose(f);
+    return mode == 'T';
+}
+
+/* Stops the target for a moment. Returns the signal it stopped with, to be
+ * handed back to it if it wasn't ours. */
+static int pause_target(pid_t pid)
+{
+    int status;
+
+    if (ptrace(PTRACE_ATTACH, pid, 0, 0) == -1)
+	bail("[-] Failed to ptrace process %d: %s", pid, strerror(errno));
+    if (waitpid(pid, &status, 0) == -1)
+	bail("[-] Failed to wait for process %d: %s", pid, strerror(errno));
+    if (!WIFSTOPPED(status))
+	bail("[-] Process %d went away during pre-copy.", pid);
+    return WSTOPSIG(status) == SIGSTOP ? 0 : WSTOPSIG(status);
+}
+
+static void resume_target(pid_t pid, int sig)
+{
+    if (ptrace(PTRACE_DETACH, pid, 0, sig) == -1)
+	bail("[-] Failed to detach from process %d: %s", pid, strerror(errno));
+}
+
+static struct precopy_map *find_map(unsigned long addr)
+{
+    int lo = 0, hi = n_maps;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (maps[mid].start + maps[mid].len <= addr)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < n_maps && maps[lo].start <= addr)
+	return &maps[lo];
+    return NULL;
+}
+
+/* Carries over what we had of a map from the last round, if it's still the
+ * same map. One that starts in the same place but has grown or shrunk (a
+ * heap, say) keeps what it had of the part the two have in common. */
+static void add_map(unsigned long start, unsigned long len,
+	struct precopy_map *old, int n_old, int *max)
+{
+    struct precopy_map *m;
+    unsigned long old_pages, pages = len / _getpagesize;
+    int i;
+
+    if (n_maps == *max) {
+	*max = *max ? *max * 2 : 64;
+	maps = realloc(maps, *max * sizeof(struct precopy_map));
+	if (!maps)
+	    bail("Out of memory!");
+    }
+    m = &maps[n_maps++];
+    m->start = start;
+    m->len = len;
+
+    for (i = 0; i < n_old; i++) {
+	if (old[i].data && old[i].start == start) {
+	    /* realloc() moves big buffers without touching their pages */
+	    old_pages = old[i].len / _getpagesize;
+	    m->data = old[i].data;
+	    m->have = old[i].have;
+	    old[i].data = NULL;
+	    old[i].have = NULL;
+	    if (old[i].len != len) {
+		m->data = realloc(m->data, len);
+		m->have = realloc(m->have, pages);
+		if (!m->data || !m->have)
+		    bail("Out of memory for pre-copy of map at 0x%lx!", start);
+		if (pages > old_pages)
+		    memset(m->have + old_pages, 0, pages - old_pages);
+	    }
+	    return;
+	}
+    }
+    /* Untouched pages of this don't cost anything */
+    m->data = malloc(len);
+    m->have = calloc(pages, 1);
+    if (!m->data || !m->have)
+	bail("Out of memory for pre-copy of map at 0x%lx!", start);
+}
+
+static void add_run(struct iovec **local, struct iovec **remote, int *n,
+	int *max, char *dest, unsigned long addr, unsigned long len)
+{
+    if (*n && (char*)(*local)[*n - 1].iov_base + (*local)[*n - 1].iov_len == dest &&
+	    (unsigned long)(*remote)[*n - 1].iov_base +
+		(*remote)[*n - 1].iov_len == addr) {
+	(*local)[*n - 1].iov_len += len;
+	(*remote)[*n - 1].iov_len += len;
+	return;
+    }
+    if (*n == *max) {
+	*max = *max ? *max * 2 : 64;
+	*local = realloc(*local, *max * sizeof(struct iovec));
+	*remote = realloc(*remote, *max * sizeof(struct iovec));
+	if (!*local || !*remote)
+	    bail("Out of memory!");
+    }
+    (*local)[*n].iov_base = dest;
+    (*local)[*n].iov_len = len;
+    (*remote)[*n].iov_base = (void*)addr;
+    (*remote)[*n].iov_len = len;
+    (*n)++;
+}
+
+/* Finds the pages of a map that we don't have an up to date copy of */
+static long want_pages(int pm_fd, struct precopy_map *m, struct iovec **local,
+	struct iovec **remote, int *n, int *max)
+{
+    static unsigned long long pm[PM_ENTRIES];
+    int page = _getpagesize;
+    unsigned long pg, npages = m->len / page;
+    long wanted = 0;
+
+    for (pg = 0; pg < npages; pg += PM_ENTRIES) {
+	unsigned long i, k = npages - pg > PM_ENTRIES ? PM_ENTRIES : npages - pg;
+	off64_t off = ((off64_t)(m->start / page) + pg) * sizeof(pm[0]);
+
+	if (pread64(pm_fd, pm, k * sizeof(pm[0]), off) != k * sizeof(pm[0])) {
+	    /* Can't tell, so copy none of it */
+	    memset(m->have + pg, 0, npages - pg);
+	    break;
+	}
+	for (i = 0; i < k; i++) {
+	    if (!(pm[i] & (PM_PRESENT|PM_SWAPPED)))
+		continue; /* left for the final stop */
+	    if (m->have[pg + i] && !(pm[i] & PM_SOFT_DIRTY))
+		continue;
+	    m->have[pg + i] = 0;
+	    add_run(local, remote, n, max, m->data + (pg + i) * page,
+		    m->start + (pg + i) * page, page);
+	    wanted++;
+	}
+    }
+    return wanted;
+}
+
+/* One round. Returns how many pages it had to copy. */
+static long precopy_round(pid_t pid)
+{
+    struct precopy_map *old = maps;
+    struct iovec *local = NULL, *remote = NULL;
+    int n_old = n_maps, max = 0, n = 0, max_iov = 0, i, sig, pm_fd;
+    long wanted = 0;
+    char fn[32], line[1024];
+    FILE *f;
+
+    sig = pause_target(pid);
+
+    maps = NULL;
+    n_maps = 0;
+    snprintf(fn, sizeof(fn), "/proc/%d/maps", pid);
+    if ((f = fopen(fn, "r")) == NULL)
+	bail("Unable to open %s: %s", fn, strerror(errno));
+    snprintf(fn, sizeof(fn), "/proc/%d/pagemap", pid);
+    if ((pm_fd = open(fn, O_RDONLY)) == -1)
+	bail("Unable to open %s: %s", fn, strerror(errno));
+
+    while (fgets(line, sizeof(line), f)) {
+	unsigned long start, end;
+	char perms[5];
+
+	if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3)
+	    continue;
+	/* Shared maps can be written by others, or through the file,
+	 * without it showing in the target's soft-dirty bits, so they're
+	 * only read at the final stop. */
+	if (perms[0] != 'r' || perms[3] == 's' || start >= get_task_size() ||
+		strstr(line, "[vvar"))
+	    continue;
+	add_map(start, end - start, old, n_old, &max);
+	wanted += want_pages(pm_fd, &maps[n_maps - 1], &local, &remote, &n,
+		&max_iov);
+    }
+    fclose(f);
+    close(pm_fd);
+
+    /* Maps that have gone away */
+    for (i = 0; i < n_old; i++) {
+	free(old[i].data);
+	free(old[i].have);
+    }
+    free(old);
+
+    if (!clear_soft_dirty(pid))
+	bail("Unable to clear soft-dirty bits of process %d: %s", pid,
+		strerror(errno));
+    resume_target(pid, sig);
+
+    /* Now copy it all while it runs. Whatever comes up short (a map that's
+     * since been unmapped, say) is left for the final stop. */
+    for (i = 0; i < n; ) {
+	long got = mem_readv_running(pid, local + i, remote + i, n - i);
+
+	if (got < 0)
+	    bail("Pre-copying needs the process_vm or procmem memory method.");
+	for (; i < n && got >= local[i].iov_len; i++) {
+	    unsigned long addr = (unsigned long)remote[i].iov_base;
+	    struct precopy_map *m = find_map(addr);
+
+	    memset(m->have + (addr - m->start) / _getpagesize, 1,
+		    local[i].iov_len / _getpagesize);
+	    got -= local[i].iov_len;
+	}
+	if (i < n)
+	    i++;
+    }
+    free(local);
+    free(remote);
+
+    return wanted;
+}
+
+void precopy_process(pid_t pid, int max_rounds)
+{
+    long pages, last = 0;
+    int round;
+
+    if (!soft_dirty_works())
+	bail("This kernel doesn't track soft-dirty pages, which pre-copying "
+		"needs.");
+    if (target_is_stopped(pid)) {
+	debug("[-] Process %d is stopped already, so there's nothing to gain "
+		"from pre-copying.", pid);
+	return;
+    }
+
+    for (round = 1; round <= max_rounds; round++) {
+	long long t = now_usecs();
+
+	pages = precopy_round(pid);
+	t = now_usecs() - t;
+	debug("[+] Pre-copy round %d: %ld KB in %lld.%03llds.", round,
+		pages * (_getpagesize >> 10), t / 1000000, (t / 1000) % 1000);
+	if (pages < PRECOPY_DONE_PAGES || (last && pages > last - last / 4))
+	    break;
+	last = pages;
+    }
+}
+
+/* Like mem_readv_target(), but only reads the pages that have been dirtied
+ * since the last pre-copy round from the target. */
+int precopy_readv_target(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count)
+{
+    static unsigned long long pm[PM_ENTRIES];
+    struct iovec *dl = NULL, *dr = NULL;
+    int page = _getpagesize;
+    int i, n = 0, max = 0, ok = 1, pm_fd;
+    char fn[32];
+
+    if (!maps)
+	return mem_readv_target(pid, local, remote, count);
+
+    snprintf(fn, sizeof(fn), "/proc/%d/pagemap", pid);
+    if ((pm_fd = open(fn, O_RDONLY)) == -1)
+	return mem_readv_target(pid, local, remote, count);
+
+    for (i = 0; i < count; i++) {
+	unsigned long addr = (unsigned long)remote[i].iov_base;
+	unsigned long len = remote[i].iov_len, off, k = 0, j = 0;
+	char *dest = local[i].iov_base;
+
+	if ((addr | len) & (page - 1)) {
+	    add_run(&dl, &dr, &n, &max, dest, addr, len);
+	    continue;
+	}
+	for (off = 0; off < len; off += page, j++) {
+	    struct precopy_map *m;
+
+	    if (j == k) {
+		k = (len - off) / page > PM_ENTRIES ? PM_ENTRIES : (len - off) / page;
+		j = 0;
+		if (pread64(pm_fd, pm, k * sizeof(pm[0]),
+			    (off64_t)((addr + off) / page) * sizeof(pm[0])) !=
+			k * sizeof(pm[0]))
+		    memset(pm, 0xff, k * sizeof(pm[0])); /* all dirty */
+	    }
+	    m = find_map(addr + off);
+	    if (m && (pm[j] & (PM_PRESENT|PM_SWAPPED)) &&
+		    !(pm[j] & PM_SOFT_DIRTY) &&
+		    m->have[(addr + off - m->start) / page]) {
+		memcpy(dest + off, m->data + (addr + off - m->start), page);
+		reused_pages++;
+	    } else {
+		add_run(&dl, &dr, &n, &max, dest + off, addr + off, page);
+		reread_pages++;
+	    }
+	}
+    }
+    close(pm_fd);
+
+    if (n)
+	ok = mem_readv_target(pid, dl, dr, n);
+    free(dl);
+    free(dr);
+    return ok;
+}
+
+int precopy_read_target(pid_t pid, void *dest, unsigned long src, size_t n)
+{
+    struct iovec local, remote;
+
+    local.iov_base = dest;
+    local.iov_len = n;
+    remote.iov_base = (void*)src;
+    remote.iov_len = n;
+
+    return precopy_readv_target(pid, &local, &remote, 1);
+}
+
+/* Reports how much the pre-copy saved, and lets go of it. */
+void precopy_finish()
+{
+    int i;
+
+    if (!maps)
+	return;
+
+    debug("[+] Took %ld KB from the pre-copy, and re-read %ld KB while "
+	    "stopped.", reused_pages * (_getpagesize >> 10),
+	    reread_pages * (_getpagesize >> 10));
+
+    for (i = 0; i < n_maps; i++) {
+	free(maps[i].data);
+	free(maps[i].have);
+    }
+    free(maps);
+    maps = NULL;
+    n_maps = 0;
+}
+
+/* vim:set ts=8 sw=4 noet: */
@@ -2,6 +2,7 @@
 #define _PROCESS_H_
 #include <sys/types.h>
 #include <sys/user.h>
+#include <sys/uio.h>
 
 #include <linux/kdev_t.h>
 #include <linux/types.h>
@@ -15,6 +16,50 @@ void set_syscall_return(struct user* user, unsigned long val);
 int memcpy_from_target(pid_t pid, void* dest, const void* src, size_t n);
 int memcpy_into_target(pid_t pid, void* dest, const void* src, size_t n);
 
+/* Bits in a /proc/pid/pagemap entry */
+#define PM_PRESENT	(1ULL << 63)
+#define PM_SWAPPED	(1ULL << 62)
+#define PM_SOFT_DIRTY	(1ULL << 55)
+#define PM_ENTRIES	4096 /* How many pagemap entries to read at a time */
+
+/* process_mem.c */
+int mem_readv_target(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count);
+long mem_readv_running(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count);
+int mem_writev_target(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count);
+int mem_read_target(pid_t pid, void *dest, unsigned long src, size_t n);
+int mem_write_target(pid_t pid, unsigned long dest, const void *src, size_t n);
+int mem_set_backend(char *name);
+void mem_report_stats();
+void stop_window_begin();
+void stop_window_end();
+
+/* precopy.c */
+void precopy_process(pid_t pid, int max_rounds);
+int precopy_readv_target(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count);
+int precopy_read_target(pid_t pid, void *dest, unsigned long src, size_t n);
+void precopy_finish();
+
+/* A syscall to be made in the target by r_syscalls(). If buf is set,
+ * args[buf_arg] is pointed at a copy of it in the target, which is copied
+ * back afterwards if buf_out is set.
+ */
+struct r_call {
+    int nr;
+    unsigned long args[5];
+    void *buf;
+    int buf_arg, buf_len, buf_out;
+    long ret; /* the result, or -1 with the error in err */
+    int err;
+};
+void r_syscalls(pid_t pid, struct r_call *calls, int n);
+
+/* cp_w_fd.c */
+int take_fds(pid_t pid, int n, int *fds, int *local);
+
 extern ssize_t r_read(pid_t pid, int fd, void* buf, size_t count);
 extern off_t r_lseek(pid_t pid, int fd, off_t offset, int whence);
 extern int r_fcntl(pid_t pid, int fd, int cmd);
@@ -0,0 +1,411 @@
+/*
+ * Bulk transfer of memory into and out of the target process.
+ *
+ * Reading a process a word at a time with PTRACE_PEEKTEXT costs one syscall
+ * per word, which is unbearable for large address spaces. Here we try a list
+ * of backends in order of preference, and fall back to the next one if the
+ * kernel doesn't support it, or if it couldn't complete a given segment.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "cryopid.h"
+#include "process.h"
+
+/* Maximum number of segments handed to the kernel in one go (UIO_MAXIOV) */
+#define MEM_IOV_MAX	1024
+
+#define MEM_READ	0
+#define MEM_WRITE	1
+
+struct mem_backend {
+    char *name;
+    /* Returns the number of bytes transferred from the start of the request,
+     * or -1 with errno set if nothing could be done. */
+    long (*xfer)(pid_t pid, struct iovec *local, struct iovec *remote,
+	    int count, int dir);
+    long long bytes[2];
+};
+
+static long vm_xfer(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count, int dir)
+{
+#if defined(__NR_process_vm_readv) && defined(__NR_process_vm_writev)
+    return syscall(dir == MEM_WRITE ? __NR_process_vm_writev :
+	    __NR_process_vm_readv, pid, local, count, remote, count, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int mem_fd = -1;
+static pid_t mem_fd_pid;
+
+static int open_proc_mem(pid_t pid)
+{
+    char fn[32];
+
+    if (mem_fd != -1 && mem_fd_pid == pid)
+	return mem_fd;
+    if (mem_fd != -1)
+	close(mem_fd);
+
+    snprintf(fn, sizeof(fn), "/proc/%d/mem", pid);
+    mem_fd = open(fn, O_RDWR);
+    if (mem_fd == -1)
+	mem_fd = open(fn, O_RDONLY);
+    mem_fd_pid = pid;
+    return mem_fd;
+}
+
+static long procmem_xfer(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count, int dir)
+{
+    long done = 0;
+    int fd, i;
+
+    if ((fd = open_proc_mem(pid)) == -1)
+	return -1;
+
+    for (i = 0; i < count; i++) {
+	size_t off = 0;
+	while (off < remote[i].iov_len) {
+	    char *l = (char*)local[i].iov_base + off;
+	    size_t len = remote[i].iov_len - off;
+	    off64_t r = (off64_t)(unsigned long)remote[i].iov_base + off;
+	    ssize_t ret;
+
+	    if (dir == MEM_WRITE)
+		ret = pwrite64(fd, l, len, r);
+	    else
+		ret = pread64(fd, l, len, r);
+	    if (ret <= 0)
+		return (done || ret == 0) ? done : -1;
+	    off += ret;
+	    done += ret;
+	}
+    }
+    return done;
+}
+
+static int poke_target(pid_t pid, void *dest, const void *src, size_t n)
+{
+    /* The old fashioned way. Trailing bytes that don't make up a whole word
+     * are merged with what's already in the target. */
+    char *d = dest;
+    const char *s = src;
+
+    while (n > 0) {
+	long word;
+	size_t len = sizeof(long);
+
+	if (n < len) {
+	    errno = 0;
+	    word = ptrace(PTRACE_PEEKTEXT, pid, d, 0);
+	    if (errno) {
+		perror("ptrace(PTRACE_PEEKTEXT)");
+		return 0;
+	    }
+	    len = n;
+	}
+	memcpy(&word, s, len);
+	errno = 0;
+	if (ptrace(PTRACE_POKETEXT, pid, d, word) == -1) {
+	    perror("ptrace(PTRACE_POKETEXT)");
+	    return 0;
+	}
+	d += len;
+	s += len;
+	n -= len;
+    }
+    return 1;
+}
+
+static long ptrace_xfer(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count, int dir)
+{
+    long done = 0;
+    int i, ok;
+
+    for (i = 0; i < count; i++) {
+	if (dir == MEM_WRITE)
+	    ok = poke_target(pid, remote[i].iov_base, local[i].iov_base,
+		    remote[i].iov_len);
+	else
+	    ok = memcpy_from_target(pid, local[i].iov_base,
+		    remote[i].iov_base, remote[i].iov_len);
+	if (!ok)
+	    break;
+	done += remote[i].iov_len;
+    }
+    return done;
+}
+
+static struct mem_backend backends[] = {
+    { "process_vm", vm_xfer },
+    { "procmem", procmem_xfer },
+    { "ptrace", ptrace_xfer },
+    { NULL, NULL },
+};
+static int cur_backend[2] = { 0, 0 };
+static long long mem_usecs[2] = { 0, 0 };
+
+static int backend_unusable(int err)
+{
+    /* Errors that mean a backend won't ever work for us, rather than just
+     * failing to transfer one particular segment. */
+    return err == ENOSYS || err == EPERM || err == EACCES || err == ENOENT;
+}
+
+static void demote_backend(int dir)
+{
+    int b = cur_backend[dir];
+
+    if (!backends[b+1].name)
+	return;
+    debug("[-] %s unavailable for %s (%s). Falling back to %s.",
+	    backends[b].name, dir == MEM_WRITE ? "writing" : "reading",
+	    strerror(errno), backends[b+1].name);
+    cur_backend[dir]++;
+}
+
+/* Transfer a single segment, starting at the given backend and falling back
+ * to the slower ones for whatever they couldn't manage. */
+static int xfer_segment(pid_t pid, struct iovec *local, struct iovec *remote,
+	int b, int dir)
+{
+    struct iovec l = *local, r = *remote;
+    long ret;
+
+    for (; backends[b].name; b++) {
+	ret = backends[b].xfer(pid, &l, &r, 1, dir);
+	if (ret <= 0)
+	    continue;
+	backends[b].bytes[dir] += ret;
+	l.iov_base = (char*)l.iov_base + ret;
+	r.iov_base = (char*)r.iov_base + ret;
+	l.iov_len -= ret;
+	r.iov_len -= ret;
+	if (r.iov_len == 0)
+	    return 1;
+    }
+    return 0;
+}
+
+static int mem_xferv(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count, int dir)
+{
+    struct timeval tv1, tv2;
+    int ok = 1;
+
+    gettimeofday(&tv1, NULL);
+
+    while (count > 0) {
+	int n = count, b = cur_backend[dir];
+	long ret;
+
+	if (n > MEM_IOV_MAX)
+	    n = MEM_IOV_MAX;
+
+	ret = backends[b].xfer(pid, local, remote, n, dir);
+	if (ret == -1 && backend_unusable(errno) && backends[b+1].name) {
+	    demote_backend(dir);
+	    continue;
+	}
+	if (ret < 0)
+	    ret = 0;
+	backends[b].bytes[dir] += ret;
+
+	/* Skip over the segments that were transferred completely */
+	while (n > 0 && ret >= remote->iov_len) {
+	    ret -= remote->iov_len;
+	    local++;
+	    remote++;
+	    count--;
+	    n--;
+	}
+	if (n == 0)
+	    continue;
+
+	/* Someone came up short part way through a segment. Let the slower
+	 * backends have a go at the rest of it. */
+	{
+	    struct iovec l, r;
+	    l.iov_base = (char*)local->iov_base + ret;
+	    l.iov_len = local->iov_len - ret;
+	    r.iov_base = (char*)remote->iov_base + ret;
+	    r.iov_len = remote->iov_len - ret;
+	    if (!xfer_segment(pid, &l, &r, b+1, dir)) {
+		fprintf(stderr, "Unable to %s %ld bytes at %p in target!\n",
+			dir == MEM_WRITE ? "write" : "read",
+			(long)r.iov_len, r.iov_base);
+		ok = 0;
+		break;
+	    }
+	}
+	local++;
+	remote++;
+	count--;
+    }
+
+    gettimeofday(&tv2, NULL);
+    mem_usecs[dir] += (tv2.tv_sec - tv1.tv_sec) * 1000000LL +
+	(tv2.tv_usec - tv1.tv_usec);
+
+    return ok;
+}
+
+int mem_readv_target(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count)
+{
+    return mem_xferv(pid, local, remote, count, MEM_READ);
+}
+
+/* For reading a target that's still running, and so can't be ptrace'd: the
+ * ptrace backend isn't tried, and nothing's said about failures, as maps can
+ * come and go underneath us. Returns how many bytes were read from the start
+ * of the request, or -1 if there's no way of reading it at all.
+ */
+long mem_readv_running(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count)
+{
+    struct timeval tv1, tv2;
+    int b = cur_backend[MEM_READ];
+    long done = 0;
+
+    gettimeofday(&tv1, NULL);
+    while (count > 0 && backends[b].xfer != ptrace_xfer) {
+	int i, n = count > MEM_IOV_MAX ? MEM_IOV_MAX : count;
+	long want = 0, ret;
+
+	ret = backends[b].xfer(pid, local, remote, n, MEM_READ);
+	if (ret == -1 && backend_unusable(errno)) {
+	    b++;
+	    continue;
+	}
+	if (ret <= 0)
+	    break;
+	backends[b].bytes[MEM_READ] += ret;
+	done += ret;
+
+	for (i = 0; i < n; i++)
+	    want += remote[i].iov_len;
+	if (ret < want)
+	    break;
+	local += n;
+	remote += n;
+	count -= n;
+    }
+    gettimeofday(&tv2, NULL);
+    mem_usecs[MEM_READ] += (tv2.tv_sec - tv1.tv_sec) * 1000000LL +
+	(tv2.tv_usec - tv1.tv_usec);
+
+    if (backends[b].xfer == ptrace_xfer && !done)
+	return -1;
+    return done;
+}
+
+int mem_writev_target(pid_t pid, struct iovec *local, struct iovec *remote,
+	int count)
+{
+    return mem_xferv(pid, local, remote, count, MEM_WRITE);
+}
+
+int mem_read_target(pid_t pid, void *dest, unsigned long src, size_t n)
+{
+    struct iovec local, remote;
+
+    local.iov_base = dest;
+    local.iov_len = n;
+    remote.iov_base = (void*)src;
+    remote.iov_len = n;
+
+    return mem_xferv(pid, &local, &remote, 1, MEM_READ);
+}
+
+int mem_write_target(pid_t pid, unsigned long dest, const void *src, size_t n)
+{
+    struct iovec local, remote;
+
+    local.iov_base = (void*)src;
+    local.iov_len = n;
+    remote.iov_base = (void*)dest;
+    remote.iov_len = n;
+
+    return mem_xferv(pid, &local, &remote, 1, MEM_WRITE);
+}
+
+int mem_set_backend(char *name)
+{
+    int i;
+
+    for (i = 0; backends[i].name; i++) {
+	if (strcmp(backends[i].name, name) == 0) {
+	    cur_backend[MEM_READ] = cur_backend[MEM_WRITE] = i;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/* The time the target spends stopped, from the moment it's attached to until
+ * it's let go, is what a user of the process notices. */
+static struct timeval stopped_at;
+
+void stop_window_begin()
+{
+    gettimeofday(&stopped_at, NULL);
+}
+
+void stop_window_end()
+{
+    struct timeval now;
+    long long t;
+
+    gettimeofday(&now, NULL);
+    t = (now.tv_sec - stopped_at.tv_sec) * 1000000LL +
+	(now.tv_usec - stopped_at.tv_usec);
+    fprintf(stderr, "[+] Process was stopped for %lld.%03llds.\n",
+	    t / 1000000, (t / 1000) % 1000);
+}
+
+void mem_report_stats()
+{
+    static const char *verb[2] = { "Read", "Wrote" };
+    static const char *prep[2] = { "from", "into" };
+    struct mem_backend *b;
+    int dir;
+
+    for (dir = MEM_READ; dir <= MEM_WRITE; dir++) {
+	long long total = 0;
+
+	for (b = backends; b->name; b++) {
+	    if (!b->bytes[dir])
+		continue;
+	    fprintf(stderr, "[+] %s %lld KB %s target using %s.\n",
+		    verb[dir], b->bytes[dir] >> 10, prep[dir], b->name);
+	    total += b->bytes[dir];
+	}
+	if (!total)
+	    continue;
+	fprintf(stderr, "[+] %s target memory in %lld.%06llds (%.1f MB/s).\n",
+		dir == MEM_WRITE ? "Modified" : "Captured",
+		mem_usecs[dir] / 1000000, mem_usecs[dir] % 1000000,
+		mem_usecs[dir] ?
+		    (total / 1048576.0) / (mem_usecs[dir] / 1000000.0) : 0.0);
+    }
+}
+
+/* vim:set ts=8 sw=4 noet: */
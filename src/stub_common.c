@@ -44,6 +44,15 @@ static void read_process()
     /* Read and process all chunks. */
     while (read_chunk(fptr, action));
 
+    /* Pages left unchanged since a parent image come from there */
+    if (action & ACTION_LOAD)
+	restore_from_parents();
+
+    /* Whatever's been left in the image is paged in from it after resuming,
+     * so it's still needed here. */
+    if (action & ACTION_LOAD)
+	start_lazy_pager();
+
     /* Cleanup the input file. */
     stream_ops->finish(fptr);
     //close(console_fd);
@@ -91,6 +100,8 @@ void usage(char* argv0)
 "    -v      Be verbose while resuming.\n"
 "    -p      Pause between steps before resuming (for debugging)\n"
 "    -P      Attempt to gain original PID by way of fork()'ing a lot\n"
+"    -l      Page memory in as it's touched, rather than all before resuming.\n"
+"            (Not for compressed images. Needs userfaultfd, Linux 4.11)\n"
 #ifdef USE_GTK
 "    -g      Close Gtk+ displays. (Required to migrate a second time, but\n"
 "            requires at least Gtk+ 2.10)\n"
@@ -139,7 +150,7 @@ void real_main(int argc, char** argv)
 	    {0, 0, 0, 0},
 	};
 	
-	c = getopt_long(argc, argv, "dvpPg",
+	c = getopt_long(argc, argv, "dvpPgl",
 		long_options, &option_index);
 	if (c == -1)
 	    break;
@@ -158,6 +169,9 @@ void real_main(int argc, char** argv)
 	    case 'P':
 		want_pid = 1;
 		break;
+	    case 'l':
+		lazy_restore = 1;
+		break;
 #ifdef USE_GTK
 	    case 'g':
 		gtk_can_close_displays = 1;
@@ -0,0 +1,85 @@
+/*
+ * tcprepair.h - Saving and restoring TCP connections with TCP_REPAIR
+ *
+ * Needs Linux 3.5 or later, and CAP_NET_ADMIN both to checkpoint and to
+ * resume. Taking the target's sockets needs pidfd_getfd() (Linux 5.6).
+ */
+
+
+#ifndef TCPREPAIR_H
+#define TCPREPAIR_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* From linux/tcp.h, for libcs that don't have them yet */
+#ifndef TCP_REPAIR
+#define TCP_REPAIR		19
+#define TCP_REPAIR_QUEUE	20
+#define TCP_QUEUE_SEQ		21
+#define TCP_REPAIR_OPTIONS	22
+#endif
+#ifndef TCP_TIMESTAMP
+#define TCP_TIMESTAMP		24
+#endif
+#ifndef TCP_REPAIR_WINDOW
+#define TCP_REPAIR_WINDOW	29
+#endif
+
+/* Values for TCP_REPAIR_QUEUE, and socket states. glibc has these as enums,
+ * so they get names of their own. */
+#define TCPREPAIR_NO_QUEUE	0
+#define TCPREPAIR_RECV_QUEUE	1
+#define TCPREPAIR_SEND_QUEUE	2
+
+#define TCPREPAIR_ESTABLISHED	1
+#define TCPREPAIR_CLOSE		7
+#define TCPREPAIR_LISTEN	10
+
+#ifndef TCPOPT_MAXSEG
+#define TCPOPT_MAXSEG		2
+#define TCPOPT_WINDOW		3
+#define TCPOPT_SACK_PERMITTED	4
+#define TCPOPT_TIMESTAMP	8
+#endif
+#ifndef TCPI_OPT_TIMESTAMPS
+#define TCPI_OPT_TIMESTAMPS	1
+#define TCPI_OPT_SACK		2
+#define TCPI_OPT_WSCALE		4
+#endif
+
+struct tcprepair_opt {
+    uint32_t opt_code;
+    uint32_t opt_val;
+};
+
+struct tcprepair_window {
+    uint32_t snd_wl1;
+    uint32_t snd_wnd;
+    uint32_t max_window;
+    uint32_t rcv_wnd;
+    uint32_t rcv_wup;
+};
+
+/* One connection, followed by its send queue and then its receive queue. */
+struct tcprepair_state {
+    int length;			/* Of all of it, queues included */
+    int state;			/* TCPREPAIR_ESTABLISHED, ... */
+    struct sockaddr_in sockname, peername;
+    int backlog;		/* If it's listening */
+    uint32_t snd_seq, rcv_seq;	/* Of the first byte in each queue */
+    int snd_len, unsent_len, rcv_len;
+    int mss, options, snd_wscale, rcv_wscale;
+    uint32_t timestamp;
+    int has_window;
+    struct tcprepair_window window;
+};
+
+void tcprepair_get(pid_t pid, int n, int *fds, void **states, int keep);
+int tcprepair_create(const void *state);
+int tcprepair_activate(int s, const void *state);
+int tcprepair_size(const void *state);
+
+#endif /* TCPREPAIR_H */
+
+/* vim:set ts=8 sw=4 noet: */
@@ -0,0 +1,181 @@
+/*
+ * tcprepair_r.c - Restoring TCP connections with TCP_REPAIR
+ */
+
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+#include "tcprepair.h"
+
+/* ----- Helper functions -------------------------------------------------- */
+
+
+static int set_repair(int s, int on)
+{
+    return setsockopt(s, SOL_TCP, TCP_REPAIR, &on, sizeof(on));
+}
+
+
+static int set_queue_seq(int s, int q, uint32_t seq)
+{
+    if (setsockopt(s, SOL_TCP, TCP_REPAIR_QUEUE, &q, sizeof(q)) < 0)
+	return -1;
+    return setsockopt(s, SOL_TCP, TCP_QUEUE_SEQ, &seq, sizeof(seq));
+}
+
+
+static int send_all(int s, const char *buf, int len)
+{
+    int ret;
+
+    while (len > 0) {
+	ret = send(s, buf, len, 0);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += ret;
+	len -= ret;
+    }
+    return 0;
+}
+
+
+/* Refills both queues of a connection in repair mode. What's in the send
+ * queue goes in as though it had been sent already, bar the unsent tail that
+ * tcprepair_activate() sends for real. */
+static int set_queues(int s, const struct tcprepair_state *st)
+{
+    const char *snd = (const char*)(st+1);
+    int q;
+
+    q = TCPREPAIR_RECV_QUEUE;
+    if (setsockopt(s, SOL_TCP, TCP_REPAIR_QUEUE, &q, sizeof(q)) < 0 ||
+	    send_all(s, snd + st->snd_len, st->rcv_len) < 0)
+	return -1;
+    q = TCPREPAIR_SEND_QUEUE;
+    if (setsockopt(s, SOL_TCP, TCP_REPAIR_QUEUE, &q, sizeof(q)) < 0 ||
+	    send_all(s, snd, st->snd_len - st->unsent_len) < 0)
+	return -1;
+    q = TCPREPAIR_NO_QUEUE;
+    return setsockopt(s, SOL_TCP, TCP_REPAIR_QUEUE, &q, sizeof(q));
+}
+
+
+static int set_options(int s, const struct tcprepair_state *st)
+{
+    struct tcprepair_opt opts[4];
+    int n = 0;
+
+    opts[n].opt_code = TCPOPT_MAXSEG;
+    opts[n++].opt_val = st->mss;
+    if (st->options & TCPI_OPT_WSCALE) {
+	opts[n].opt_code = TCPOPT_WINDOW;
+	opts[n++].opt_val = st->snd_wscale | (st->rcv_wscale << 16);
+    }
+    if (st->options & TCPI_OPT_SACK) {
+	opts[n].opt_code = TCPOPT_SACK_PERMITTED;
+	opts[n++].opt_val = 0;
+    }
+    if (st->options & TCPI_OPT_TIMESTAMPS) {
+	opts[n].opt_code = TCPOPT_TIMESTAMP;
+	opts[n++].opt_val = 0;
+    }
+    if (setsockopt(s, SOL_TCP, TCP_REPAIR_OPTIONS, opts,
+		n * sizeof(struct tcprepair_opt)) < 0)
+	return -1;
+
+    if ((st->options & TCPI_OPT_TIMESTAMPS) &&
+	    setsockopt(s, SOL_TCP, TCP_TIMESTAMP, &st->timestamp,
+		sizeof(st->timestamp)) < 0)
+	return -1;
+
+    /* Not fatal: the window's just renegotiated on kernels without it. */
+    if (st->has_window)
+	setsockopt(s, SOL_TCP, TCP_REPAIR_WINDOW, &st->window,
+		sizeof(st->window));
+    return 0;
+}
+
+
+/* ----- Public functions -------------------------------------------------- */
+
+
+int tcprepair_size(const void *state)
+{
+    const struct tcprepair_state *st = state;
+
+    return st->length;
+}
+
+
+/* Makes a socket like the one saved. A connection is left in repair mode,
+ * until tcprepair_activate(). */
+int tcprepair_create(const void *state)
+{
+    const struct tcprepair_state *st = state;
+    int s, on = 1, saved_errno;
+
+    s = socket(PF_INET, SOCK_STREAM, 0);
+    if (s < 0)
+	return s;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+	goto fail;
+
+    if (st->state != TCPREPAIR_ESTABLISHED) {
+	if (st->sockname.sin_port && bind(s,
+		    (const struct sockaddr*)&st->sockname,
+		    sizeof(st->sockname)) < 0)
+	    goto fail;
+	if (st->state == TCPREPAIR_LISTEN && listen(s, st->backlog) < 0)
+	    goto fail;
+	return s;
+    }
+
+    if (set_repair(s, 1) < 0 ||
+	    set_queue_seq(s, TCPREPAIR_SEND_QUEUE, st->snd_seq) < 0 ||
+	    set_queue_seq(s, TCPREPAIR_RECV_QUEUE, st->rcv_seq) < 0)
+	goto fail;
+    if (bind(s, (const struct sockaddr*)&st->sockname,
+		sizeof(st->sockname)) < 0)
+	goto fail;
+    /* In repair mode, this just makes it established */
+    if (connect(s, (const struct sockaddr*)&st->peername,
+		sizeof(st->peername)) < 0)
+	goto fail;
+    if (set_options(s, st) < 0 || set_queues(s, st) < 0)
+	goto fail;
+    return s;
+
+fail:
+    saved_errno = errno;
+    (void) close(s);
+    errno = saved_errno;
+    return -1;
+}
+
+
+/* Lets a restored connection go, and sends what hadn't been yet. */
+int tcprepair_activate(int s, const void *state)
+{
+    const struct tcprepair_state *st = state;
+    const char *snd = (const char*)(st+1);
+
+    if (st->state != TCPREPAIR_ESTABLISHED)
+	return 0;
+    if (set_repair(s, 0) < 0)
+	return -1;
+    return send_all(s, snd + st->snd_len - st->unsent_len, st->unsent_len);
+}
+
+/* vim:set ts=8 sw=4 noet: */
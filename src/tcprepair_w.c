@@ -0,0 +1,229 @@
+/*
+ * tcprepair_w.c - Saving TCP connections with TCP_REPAIR
+ */
+
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+#include "process.h"
+#include "tcprepair.h"
+
+/* ----- Helper functions -------------------------------------------------- */
+
+
+static int set_repair(int s, int on)
+{
+    return setsockopt(s, SOL_TCP, TCP_REPAIR, &on, sizeof(on));
+}
+
+
+static int set_queue(int s, int q)
+{
+    return setsockopt(s, SOL_TCP, TCP_REPAIR_QUEUE, &q, sizeof(q));
+}
+
+
+/* Reads one queue of a socket in repair mode. Returns 0 on success. */
+static int get_queue(int s, int q, uint32_t *seq, char *buf, int len)
+{
+    socklen_t sz = sizeof(*seq);
+
+    if (set_queue(s, q) == -1)
+	return -1;
+    if (getsockopt(s, SOL_TCP, TCP_QUEUE_SEQ, seq, &sz) == -1)
+	return -1;
+    *seq -= len; /* We want the first byte in the queue, not the next */
+    if (len && recv(s, buf, len, MSG_PEEK|MSG_DONTWAIT) != len)
+	return -1;
+    return 0;
+}
+
+
+/* ----- Saving a connection ------------------------------------------------ */
+
+
+static void *get_unconnected(int s, struct tcp_info *ti)
+{
+    struct tcprepair_state *st = xmalloc(sizeof(*st));
+    socklen_t sz;
+
+    memset(st, 0, sizeof(*st));
+    st->length = sizeof(*st);
+    st->state = ti->tcpi_state;
+    st->backlog = ti->tcpi_sacked; /* That's what it is for listeners */
+    sz = sizeof(st->sockname);
+    getsockname(s, (struct sockaddr*)&st->sockname, &sz);
+    return st;
+}
+
+
+static void *get_established(int s, struct tcp_info *ti)
+{
+    /* sys/ioctl.h and linux/termios.h don't get along */
+    extern int ioctl(int fd, unsigned long req, ...);
+    struct tcprepair_state st, *p;
+    socklen_t sz;
+
+    memset(&st, 0, sizeof(st));
+    st.state = ti->tcpi_state;
+    sz = sizeof(st.sockname);
+    if (getsockname(s, (struct sockaddr*)&st.sockname, &sz) == -1)
+	return NULL;
+    sz = sizeof(st.peername);
+    if (getpeername(s, (struct sockaddr*)&st.peername, &sz) == -1)
+	return NULL;
+
+    if (ioctl(s, SIOCOUTQ, &st.snd_len) == -1 ||
+	    ioctl(s, SIOCOUTQNSD, &st.unsent_len) == -1 ||
+	    ioctl(s, SIOCINQ, &st.rcv_len) == -1)
+	return NULL;
+
+    sz = sizeof(st.mss);
+    if (getsockopt(s, SOL_TCP, TCP_MAXSEG, &st.mss, &sz) == -1)
+	return NULL;
+    st.options = ti->tcpi_options;
+    st.snd_wscale = ti->tcpi_snd_wscale;
+    st.rcv_wscale = ti->tcpi_rcv_wscale;
+    if (st.options & TCPI_OPT_TIMESTAMPS) {
+	sz = sizeof(st.timestamp);
+	if (getsockopt(s, SOL_TCP, TCP_TIMESTAMP, &st.timestamp, &sz) == -1)
+	    return NULL;
+    }
+    /* Older kernels (before 4.8) don't have it. */
+    sz = sizeof(st.window);
+    st.has_window = (getsockopt(s, SOL_TCP, TCP_REPAIR_WINDOW, &st.window,
+		&sz) == 0);
+
+    st.length = sizeof(st) + st.snd_len + st.rcv_len;
+    p = xmalloc(st.length);
+    if (get_queue(s, TCPREPAIR_SEND_QUEUE, &st.snd_seq, (char*)(p+1),
+		st.snd_len) == -1 ||
+	    get_queue(s, TCPREPAIR_RECV_QUEUE, &st.rcv_seq,
+		(char*)(p+1) + st.snd_len, st.rcv_len) == -1) {
+	set_queue(s, TCPREPAIR_NO_QUEUE);
+	free(p);
+	return NULL;
+    }
+    set_queue(s, TCPREPAIR_NO_QUEUE);
+
+    memcpy(p, &st, sizeof(st));
+    return p;
+}
+
+
+/* ----- Public functions -------------------------------------------------- */
+
+
+int tcprepair_size(const void *state)
+{
+    const struct tcprepair_state *st = state;
+
+    return st->length;
+}
+
+
+/* Saves the target's TCP sockets on the given fds, leaving a state (or NULL
+ * where it couldn't be had) for each in states. The target must be stopped.
+ *
+ * This is done in passes over all of them, so that thousands of connections
+ * take no more than a few local syscalls each, and are frozen as close
+ * together as can be. If keep is set, they're left frozen, so that the
+ * original can be killed without the peers seeing the connections close.
+ */
+void tcprepair_get(pid_t pid, int n, int *fds, void **states, int keep)
+{
+    struct tcp_info *ti;
+    int *s, *frozen, i, saved = 0;
+    socklen_t sz;
+
+    memset(states, 0, n * sizeof(void*));
+    if (!n)
+	return;
+
+    s = xmalloc(n * sizeof(int));
+    if (!take_fds(pid, n, fds, s)) {
+	debug("[-] TCP connections won't be saved.");
+	free(s);
+	return;
+    }
+    frozen = xmalloc(n * sizeof(int));
+    ti = xmalloc(n * sizeof(struct tcp_info));
+    memset(frozen, 0, n * sizeof(int));
+
+    /* Find out what state each is in */
+    for (i = 0; i < n; i++) {
+	if (s[i] == -1)
+	    continue;
+	sz = sizeof(struct tcp_info);
+	if (getsockopt(s[i], SOL_TCP, TCP_INFO, &ti[i], &sz) == -1) {
+	    close(s[i]);
+	    s[i] = -1;
+	}
+    }
+
+    /* Freeze the connections. Listening sockets can't be, and don't need to
+     * be. */
+    for (i = 0; i < n; i++) {
+	if (s[i] == -1 || ti[i].tcpi_state != TCPREPAIR_ESTABLISHED)
+	    continue;
+	if (set_repair(s[i], 1) == -1) {
+	    debug("[-] TCP_REPAIR on fd %d: %s", fds[i], strerror(errno));
+	    if (errno == EPERM)
+		break; /* No CAP_NET_ADMIN, so no others will go either */
+	    continue;
+	}
+	frozen[i] = 1;
+    }
+
+    /* Read them */
+    for (i = 0; i < n; i++) {
+	if (s[i] == -1)
+	    continue;
+	switch (ti[i].tcpi_state) {
+	    case TCPREPAIR_ESTABLISHED:
+		if (frozen[i])
+		    states[i] = get_established(s[i], &ti[i]);
+		break;
+	    case TCPREPAIR_LISTEN:
+	    case TCPREPAIR_CLOSE:
+		states[i] = get_unconnected(s[i], &ti[i]);
+		break;
+	    default:
+		debug("[-] fd %d: can't save a TCP socket in state %d",
+			fds[i], ti[i].tcpi_state);
+	}
+	if (states[i])
+	    saved++;
+	else if (ti[i].tcpi_state == TCPREPAIR_ESTABLISHED)
+	    debug("[-] fd %d: couldn't save TCP connection", fds[i]);
+    }
+
+    /* Thaw them, unless they're to stay frozen until the original dies. */
+    if (!keep) {
+	for (i = 0; i < n; i++) {
+	    if (frozen[i])
+		set_repair(s[i], 0);
+	    if (s[i] != -1)
+		close(s[i]);
+	}
+    }
+
+    debug("[+] Saved %d of %d TCP sockets.", saved, n);
+
+    free(ti);
+    free(frozen);
+    free(s);
+}
+
+/* vim:set ts=8 sw=4 noet: */
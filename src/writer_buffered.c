@@ -87,6 +87,15 @@ static int buf_write(void *fptr, void *buf, int len)
     return wlen;
 }
 
+static int buf_writev(void *fptr, const struct iovec *iov, int iovcnt)
+{
+    int i, wlen = 0;
+
+    for (i = 0; i < iovcnt; i++)
+	wlen += buf_write(fptr, iov[i].iov_base, iov[i].iov_len);
+    return wlen;
+}
+
 static long buf_ftell(void *fptr)
 {
     struct buf_data *rd = fptr;
@@ -116,13 +125,33 @@ static void buf_dup2(void *fptr, int newfd)
     setvbuf(rd->f, rd->buffer, _IOFBF, BUFSIZ);
 }
 
+static long buf_file_offset(void *fptr, int *fd)
+{
+    struct buf_data *rd = fptr;
+
+    *fd = rd->fd;
+    return ftell(rd->f);
+}
+
+static void buf_skip(void *fptr, long len)
+{
+    struct buf_data *rd = fptr;
+
+    if (fseek(rd->f, len, SEEK_CUR) == -1)
+	bail("fseek(rd->f, %ld) failed: %s", len, strerror(errno));
+    rd->offset += len;
+}
+
 struct stream_ops buf_ops = {
     .init = buf_init,
     .read = buf_read,
     .write = buf_write,
+    .writev = buf_writev,
     .finish = buf_finish,
     .ftell = buf_ftell,
     .dup2 = buf_dup2,
+    .file_offset = buf_file_offset,
+    .skip = buf_skip,
 };
 
 declare_writer(buffered, buf_ops, "Writes an output file with buffering");
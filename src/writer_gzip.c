@@ -19,8 +19,13 @@
 #define GZIP_NO_WRITER
 #else
 #define GZIP_NO_READER
+#include "pipeline.h"
 #endif
 
+/* deflate's window. Each block in the parallel writer is primed with this
+ * much of the input before it. */
+#define DICT_LEN (32 * 1024)
+
 struct gzip_data {
     int fd;
     int mode;
@@ -29,8 +34,27 @@ struct gzip_data {
     int in_len, in_used, out_len;
     int bytesin, bytesout; /* for statistics */
     int offset;
+#ifndef GZIP_NO_WRITER
+    struct pipeline *pipe;
+    unsigned long adler; /* of the input so far, for the zlib trailer */
+#endif
 };
 
+#ifndef GZIP_NO_WRITER
+static int gzip_level()
+{
+    if (compression_level < 0)
+	return Z_DEFAULT_COMPRESSION;
+    if (compression_level > Z_BEST_COMPRESSION)
+	bail("gzip compression level must be at most %d", Z_BEST_COMPRESSION);
+    return compression_level;
+}
+
+static void gzip_pipe_compress(void *fptr, void **state, struct pipe_block *b);
+static void gzip_pipe_write(void *fptr, struct pipe_block *b);
+static void gzip_write_out(struct gzip_data *zd, void *buf, int len);
+#endif
+
 static void *gzip_writer_init(int fd, int mode)
 {
     struct gzip_data *zd;
@@ -48,9 +72,37 @@ static void *gzip_writer_init(int fd, int mode)
     zd->c_stream.opaque = (voidpf)0;
 
 #ifndef GZIP_NO_WRITER
-    if (zd->mode == O_WRONLY)
+    zd->pipe = NULL;
+    if (zd->mode == O_WRONLY && pipeline_threads > 1)
+    {
+	/* pigz style: raw deflate blocks, each primed with the tail of the
+	 * previous one and ending on a byte boundary with Z_SYNC_FLUSH, so
+	 * that they join up into one stream. We wrap it in the zlib header
+	 * and trailer ourselves, so it reads back just as if deflate() had
+	 * produced it. */
+	int level = gzip_level();
+	unsigned char hdr[2];
+
+	/* CMF: deflate with a 32K window. FLG: the level, and a check so
+	 * that the two of them make a multiple of 31 */
+	hdr[0] = 0x78;
+	if (level == Z_DEFAULT_COMPRESSION || level == 6)
+	    hdr[1] = 2 << 6;
+	else if (level < 2)
+	    hdr[1] = 0 << 6;
+	else if (level < 6)
+	    hdr[1] = 1 << 6;
+	else
+	    hdr[1] = 3 << 6;
+	hdr[1] += 31 - ((hdr[0] << 8) + hdr[1]) % 31;
+	gzip_write_out(zd, hdr, sizeof(hdr));
+	zd->adler = adler32(0L, Z_NULL, 0);
+	zd->pipe = pipeline_start(IN_LEN, OUT_LEN, DICT_LEN,
+		gzip_pipe_compress, gzip_pipe_write, zd);
+    }
+    else if (zd->mode == O_WRONLY)
     {
-	if (deflateInit(&zd->c_stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+	if (deflateInit(&zd->c_stream, gzip_level()) != Z_OK)
 	    bail("deflateInit() failed!");
     }
 #endif
@@ -66,7 +118,12 @@ static void *gzip_writer_init(int fd, int mode)
     }
 #endif
 
-    zd->in = xmalloc(IN_LEN);
+#ifndef GZIP_NO_WRITER
+    if (zd->pipe)
+	zd->in = (unsigned char*)pipeline_get_block(zd->pipe);
+    else
+#endif
+	zd->in = xmalloc(IN_LEN);
     zd->out = xmalloc(OUT_LEN);
 
     zd->in_len = 0;
@@ -74,7 +131,12 @@ static void *gzip_writer_init(int fd, int mode)
     zd->out_len = 0;
 
     zd->bytesin = 0;
-    zd->bytesout = 0;
+#ifndef GZIP_NO_WRITER
+    if (zd->pipe)
+	zd->bytesout = 2; /* the header */
+    else
+#endif
+	zd->bytesout = 0;
 
     zd->offset = 0;
 
@@ -82,11 +144,8 @@ static void *gzip_writer_init(int fd, int mode)
 }
 
 #ifndef GZIP_NO_READER
-static void gzip_uncompress_chunk(void *fptr)
+static void gzip_fill_input(struct gzip_data *zd)
 {
-    struct gzip_data *zd = fptr;
-    int r;
-
     if (zd->c_stream.avail_in == 0) {
 	zd->out_len = read(zd->fd, zd->out, OUT_LEN);
 	if (zd->out_len <  0)
@@ -95,6 +154,14 @@ static void gzip_uncompress_chunk(void *fptr)
 	zd->c_stream.next_in   = zd->out;
 	zd->c_stream.avail_in  = zd->out_len;
     }
+}
+
+static void gzip_uncompress_chunk(void *fptr)
+{
+    struct gzip_data *zd = fptr;
+    int r;
+
+    gzip_fill_input(zd);
 
     zd->c_stream.next_out  = zd->in;
     zd->c_stream.avail_out = IN_LEN;
@@ -147,16 +214,82 @@ static int gzip_writer_read(void *fptr, void *buf, int len)
 }
 #endif
 
-#ifndef GZIP_NO_WRITER
-static void gzip_compress_chunk(void *fptr, int flush)
+#ifndef GZIP_NO_READER
+/* Inflates straight into buf (a map being restored, usually) rather than
+ * through zd->in, checksumming each piece as it comes out. */
+static int gzip_writer_read_into(void *fptr, void *buf, int len,
+	unsigned int *sum)
 {
     struct gzip_data *zd = fptr;
+    int rlen, x, r;
+    char *p;
+
+    assert(zd->mode == O_RDONLY);
+    rlen = len;
+    p = buf;
+
+    /* Anything already inflated comes first */
+    x = zd->in_len - zd->in_used;
+    if (x > rlen)
+	x = rlen;
+    if (x > 0) {
+	memcpy(p, &zd->in[zd->in_used], x);
+	*sum = checksum(p, x, *sum);
+	zd->in_used += x;
+	p += x;
+	rlen -= x;
+    }
+
+    while (rlen > 0) {
+	gzip_fill_input(zd);
+
+	x = rlen > READ_SLICE ? READ_SLICE : rlen;
+	zd->c_stream.next_out  = (Bytef*)p;
+	zd->c_stream.avail_out = x;
+
+	r = inflate(&zd->c_stream, 0);
+
+	if (r != Z_OK && r != Z_STREAM_END)
+	    bail("zlib decompression error: %s", zd->c_stream.msg);
+	x -= zd->c_stream.avail_out;
+	if (r == Z_STREAM_END && x == 0)
+	    bail("Unexpected end of compressed image!");
+
+	*sum = checksum(p, x, *sum);
+	p += x;
+	rlen -= x;
+    }
+
+    zd->offset += len;
+
+    return len;
+}
+#endif
+
+#ifndef GZIP_NO_WRITER
+static void gzip_write_out(struct gzip_data *zd, void *buf, int len)
+{
+    int ret;
+
+    ret = write(zd->fd, buf, len);
+    if (ret < 0)
+	bail("write(zd->fd, %p, %d) failed: %s", buf, len, strerror(errno));
+    if (ret != len)
+	bail("write(zd->fd, %p, %d) failed: Short write", buf, len);
+}
+
+/* Deflates len bytes from buf, be it zd->in or the caller's own */
+static void gzip_deflate(struct gzip_data *zd, void *buf, int len, int flush)
+{
     int ret;
 
-    zd->c_stream.next_in   = zd->in;
-    zd->c_stream.avail_in  = zd->in_len;
+    if (len == 0 && flush != Z_FINISH)
+	return;
+
+    zd->c_stream.next_in   = buf;
+    zd->c_stream.avail_in  = len;
 
-    while (zd->c_stream.avail_in > 0) {
+    do {
 	zd->c_stream.next_out  = zd->out;
 	zd->c_stream.avail_out = OUT_LEN;
 
@@ -167,16 +300,82 @@ static void gzip_compress_chunk(void *fptr, int flush)
 
 	zd->out_len = OUT_LEN - zd->c_stream.avail_out;
 
-	ret = write(zd->fd, zd->out, zd->out_len);
-	if (ret < 0)
-	    bail("write(zd->fd, %p, %d) failed: %s",
-		    zd->out, zd->out_len, strerror(errno));
-	if (ret != zd->out_len)
-	    bail("write(zd->fd, %p, %d) failed: Short write", zd->out, zd->out_len);
-    }
+	gzip_write_out(zd, zd->out, zd->out_len);
+	zd->bytesout += zd->out_len;
+    } while (zd->c_stream.avail_in > 0 ||
+	    (flush == Z_FINISH && ret != Z_STREAM_END));
+}
 
+static void gzip_compress_chunk(void *fptr, int flush)
+{
+    struct gzip_data *zd = fptr;
+
+    gzip_deflate(zd, zd->in, zd->in_len, flush);
     zd->in_len = 0;
-    zd->bytesout += zd->out_len;
+}
+
+static void gzip_pipe_compress(void *fptr, void **state, struct pipe_block *b)
+{
+    z_stream *s = *state;
+    int ret;
+
+    if (!b) {
+	if (s) {
+	    deflateEnd(s);
+	    free(s);
+	}
+	return;
+    }
+
+    if (!s) {
+	s = *state = xmalloc(sizeof(z_stream));
+	memset(s, 0, sizeof(z_stream));
+	if (deflateInit2(s, gzip_level(), Z_DEFLATED, -MAX_WBITS,
+		    8, Z_DEFAULT_STRATEGY) != Z_OK)
+	    bail("deflateInit2() failed!");
+    } else
+	deflateReset(s);
+
+    if (b->dict_len)
+	deflateSetDictionary(s, (Bytef*)b->dict, b->dict_len);
+
+    s->next_in   = (Bytef*)b->in;
+    s->avail_in  = b->in_len;
+    s->next_out  = (Bytef*)b->out;
+    s->avail_out = OUT_LEN;
+
+    /* The last block may well be empty, but still has to end the stream */
+    ret = deflate(s, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret != (b->last ? Z_STREAM_END : Z_OK) ||
+	    s->avail_in != 0 || s->avail_out == 0)
+	bail("zlib internal compression error: %s", s->msg);
+
+    b->out_len = OUT_LEN - s->avail_out;
+    b->check = adler32(adler32(0L, Z_NULL, 0), (Bytef*)b->in, b->in_len);
+}
+
+static void gzip_pipe_write(void *fptr, struct pipe_block *b)
+{
+    struct gzip_data *zd = fptr;
+
+    zd->adler = adler32_combine(zd->adler, b->check, b->in_len);
+    gzip_write_out(zd, b->out, b->out_len);
+    zd->bytesout += b->out_len;
+}
+
+/* Hand a full input block on, either to the pipeline or to deflate */
+static void gzip_flush_chunk(void *fptr, int last)
+{
+    struct gzip_data *zd = fptr;
+
+    if (zd->pipe) {
+	pipeline_submit(zd->pipe, zd->in_len, last);
+	zd->in_len = 0;
+	if (!last)
+	    zd->in = (unsigned char*)pipeline_get_block(zd->pipe);
+	return;
+    }
+    gzip_compress_chunk(fptr, last ? Z_FINISH : Z_NO_FLUSH);
 }
 #endif
 
@@ -203,9 +402,30 @@ static int gzip_writer_write(void *fptr, void *buf, int len)
 	zd->in_len += x;
 	p += x;
 	wlen -= x;
-	if (zd->in_len == IN_LEN) {
-	    gzip_compress_chunk(fptr, Z_NO_FLUSH);
+	if (zd->in_len == IN_LEN)
+	    gzip_flush_chunk(fptr, 0);
+    }
+
+    return len;
+}
+
+static int gzip_writer_writev(void *fptr, const struct iovec *iov, int iovcnt)
+{
+    struct gzip_data *zd = fptr;
+    int i, len = 0;
+
+    assert(zd->mode == O_WRONLY);
+    for (i = 0; i < iovcnt; i++) {
+	len += iov[i].iov_len;
+	/* The pipeline's blocks have to hold their own input, but deflate
+	 * can take big buffers (maps, mostly) where they are. */
+	if (zd->pipe || iov[i].iov_len < IN_LEN) {
+	    gzip_writer_write(fptr, iov[i].iov_base, iov[i].iov_len);
+	    continue;
 	}
+	gzip_compress_chunk(fptr, Z_NO_FLUSH);
+	gzip_deflate(zd, iov[i].iov_base, iov[i].iov_len, Z_NO_FLUSH);
+	zd->bytesin += iov[i].iov_len;
     }
 
     return len;
@@ -217,7 +437,20 @@ static void gzip_writer_finish(void *fptr)
     struct gzip_data *zd = fptr;
 
 #ifndef GZIP_NO_WRITER
-    if (zd->mode == O_WRONLY && zd->in_len > 0) {
+    if (zd->pipe) {
+	unsigned char trailer[4];
+
+	gzip_flush_chunk(fptr, 1);
+	pipeline_finish(zd->pipe); /* also frees zd->in */
+	zd->in = NULL;
+
+	trailer[0] = zd->adler >> 24;
+	trailer[1] = zd->adler >> 16;
+	trailer[2] = zd->adler >> 8;
+	trailer[3] = zd->adler;
+	gzip_write_out(zd, trailer, sizeof(trailer));
+	zd->bytesout += sizeof(trailer);
+    } else if (zd->mode == O_WRONLY) {
 	gzip_compress_chunk(fptr, Z_FINISH);
 	deflateEnd(&zd->c_stream);
     }
@@ -267,9 +500,11 @@ struct stream_ops gzip_ops = {
     .init = gzip_writer_init,
 #ifndef GZIP_NO_READER
     .read = gzip_writer_read,
+    .read_into = gzip_writer_read_into,
 #endif
 #ifndef GZIP_NO_WRITER
     .write = gzip_writer_write,
+    .writev = gzip_writer_writev,
 #endif
     .finish = gzip_writer_finish,
 #ifndef GZIP_NO_READER
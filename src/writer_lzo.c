@@ -8,6 +8,9 @@
 
 #include "cryopid.h"
 #include "cpimage.h"
+#ifndef COMPILING_STUB
+#include "pipeline.h"
+#endif
 
 #define MAX_COMPRESSED_SIZE(x) ((x) + (x) / 64 + 16 + 3)
 #ifndef IN_LEN
@@ -22,8 +25,16 @@ struct lzo_data {
     lzo_uint in_len, in_used, out_len;
     int bytesin, bytesout; /* for statistics */
     int offset;
+#ifndef COMPILING_STUB
+    struct pipeline *pipe;
+#endif
 };
 
+#ifndef COMPILING_STUB
+static void lzo_pipe_compress(void *fptr, void **wrkmem, struct pipe_block *b);
+static void lzo_pipe_write(void *fptr, struct pipe_block *b);
+#endif
+
 static void *lzo_writer_init(int fd, int mode)
 {
     struct lzo_data *ld;
@@ -38,12 +49,18 @@ static void *lzo_writer_init(int fd, int mode)
     if (lzo_init() != LZO_E_OK)
 	bail("lzo_init() failed!");
 
-    ld->in = xmalloc(IN_LEN);
+#ifndef COMPILING_STUB
+    /* Blocks are compressed independently, so we can farm them out */
+    ld->pipe = NULL;
+    if (ld->mode == O_WRONLY && pipeline_threads > 1) {
+	ld->pipe = pipeline_start(IN_LEN, OUT_LEN, 0, lzo_pipe_compress,
+		lzo_pipe_write, ld);
+	ld->in = (lzo_byte*)pipeline_get_block(ld->pipe);
+    } else
+#endif
+	ld->in = xmalloc(IN_LEN);
     ld->out = xmalloc(OUT_LEN);
-    if (ld->mode == O_WRONLY)
-	ld->wrkmem = xmalloc(LZO1X_1_MEM_COMPRESS);
-    else
-	ld->wrkmem = NULL;
+    ld->wrkmem = NULL;
 
     ld->in_len = 0;
     ld->in_used = 0;
@@ -124,38 +141,91 @@ static int lzo_writer_read(void *fptr, void *buf, int len)
     return len;
 }
 
-static void lzo_compress_chunk(void *fptr)
+static int lzo_compress_block(void *fptr, void **wrkmem, char *in, int in_len,
+	char *out)
 {
+    lzo_uint out_len;
     int r;
-    struct lzo_data *ld = fptr;
 
-    r = lzo1x_1_compress(ld->in, ld->in_len, ld->out, &ld->out_len, ld->wrkmem);
+    if (!*wrkmem)
+	*wrkmem = xmalloc(LZO1X_1_MEM_COMPRESS);
+
+    r = lzo1x_1_compress((lzo_byte*)in, in_len, (lzo_byte*)out, &out_len,
+	    *wrkmem);
     if (r != LZO_E_OK)
 	bail("LZF internal compression error: %d", r);
 
-    ld->bytesout += ld->out_len;
+    return out_len;
+}
 
+static void lzo_compress_chunk(void *fptr)
+{
+    struct lzo_data *ld = fptr;
+
+    ld->out_len = lzo_compress_block(fptr, (void**)&ld->wrkmem,
+	    (char*)ld->in, ld->in_len, (char*)ld->out);
     ld->in_len = 0;
 }
 
-static void lzo_write_compressed(void *fptr)
+static void lzo_write_block(void *fptr, char *out, int out_len)
 {
     struct lzo_data *ld = fptr;
     int ret;
 
     /* Write the size of the chunk first */
-    ret = write(ld->fd, &ld->out_len, sizeof(int));
+    ret = write(ld->fd, &out_len, sizeof(int));
     if (ret < 0)
 	bail("write(ld->fd, len, %d) failed: %s", sizeof(int), strerror(errno));
     if (ret != sizeof(int))
 	bail("write(ld->fd, len, %d) failed: Short write", sizeof(int));
 
-    ret = write(ld->fd, ld->out, ld->out_len);
+    ret = write(ld->fd, out, out_len);
     if (ret < 0)
 	bail("write(ld->fd, %p, %d) failed: %s",
-		ld->out, ld->out_len, strerror(errno));
-    if (ret != ld->out_len)
-	bail("write(ld->fd, %p, %d) failed: Short write", ld->out, ld->out_len);
+		out, out_len, strerror(errno));
+    if (ret != out_len)
+	bail("write(ld->fd, %p, %d) failed: Short write", out, out_len);
+
+    ld->bytesout += out_len;
+}
+
+static void lzo_write_compressed(void *fptr)
+{
+    struct lzo_data *ld = fptr;
+    lzo_write_block(fptr, (char*)ld->out, ld->out_len);
+}
+
+#ifndef COMPILING_STUB
+static void lzo_pipe_compress(void *fptr, void **wrkmem, struct pipe_block *b)
+{
+    if (!b) {
+	free(*wrkmem);
+	return;
+    }
+    b->out_len = lzo_compress_block(fptr, wrkmem, b->in, b->in_len, b->out);
+}
+
+static void lzo_pipe_write(void *fptr, struct pipe_block *b)
+{
+    lzo_write_block(fptr, b->out, b->out_len);
+}
+#endif
+
+/* Hand a full input block on, either to the pipeline or straight out */
+static void lzo_flush_chunk(void *fptr)
+{
+#ifndef COMPILING_STUB
+    struct lzo_data *ld = fptr;
+
+    if (ld->pipe) {
+	pipeline_submit(ld->pipe, ld->in_len, 0);
+	ld->in_len = 0;
+	ld->in = (lzo_byte*)pipeline_get_block(ld->pipe);
+	return;
+    }
+#endif
+    lzo_compress_chunk(fptr);
+    lzo_write_compressed(fptr);
 }
 
 static int lzo_writer_write(void *fptr, void *buf, int len)
@@ -180,10 +250,43 @@ static int lzo_writer_write(void *fptr, void *buf, int len)
 	ld->in_len += x;
 	p += x;
 	wlen -= x;
-	if (ld->in_len == IN_LEN) {
-	    lzo_compress_chunk(fptr);
+	if (ld->in_len == IN_LEN)
+	    lzo_flush_chunk(fptr);
+    }
+
+    return len;
+}
+
+static int lzo_writer_writev(void *fptr, const struct iovec *iov, int iovcnt)
+{
+    struct lzo_data *ld = fptr;
+    int i, left, len = 0;
+    char *p;
+
+    assert(ld->mode == O_WRONLY);
+    for (i = 0; i < iovcnt; i++) {
+	p = iov[i].iov_base;
+	left = iov[i].iov_len;
+	len += left;
+#ifndef COMPILING_STUB
+	if (ld->pipe) {
+	    lzo_writer_write(fptr, p, left);
+	    continue;
+	}
+#endif
+	/* Blocks are independent, and needn't be full, so big buffers are
+	 * compressed where they are, a block at a time */
+	if (left >= IN_LEN && ld->in_len > 0)
+	    lzo_flush_chunk(fptr);
+	while (left >= IN_LEN) {
+	    ld->out_len = lzo_compress_block(fptr, (void**)&ld->wrkmem, p,
+		    IN_LEN, (char*)ld->out);
 	    lzo_write_compressed(fptr);
+	    ld->bytesin += IN_LEN;
+	    p += IN_LEN;
+	    left -= IN_LEN;
 	}
+	lzo_writer_write(fptr, p, left);
     }
 
     return len;
@@ -193,10 +296,15 @@ static void lzo_writer_finish(void *fptr)
 {
     struct lzo_data *ld = fptr;
 
-    if (ld->mode == O_WRONLY && ld->in_len > 0) {
-	lzo_compress_chunk(fptr);
-	lzo_write_compressed(fptr);
+    if (ld->mode == O_WRONLY && ld->in_len > 0)
+	lzo_flush_chunk(fptr);
+
+#ifndef COMPILING_STUB
+    if (ld->pipe) {
+	pipeline_finish(ld->pipe); /* also frees ld->in */
+	ld->in = NULL;
     }
+#endif
 
     free(ld->wrkmem);
     free(ld->out);
@@ -237,6 +345,7 @@ struct stream_ops lzo_ops = {
     .init = lzo_writer_init,
     .read = lzo_writer_read,
     .write = lzo_writer_write,
+    .writev = lzo_writer_writev,
     .finish = lzo_writer_finish,
     .ftell = lzo_writer_ftell,
     .dup2 = lzo_writer_dup2,
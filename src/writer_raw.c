@@ -54,13 +54,41 @@ static int raw_read(void *fptr, void *buf, int len)
     return len;
 }
 
-static int raw_write(void *fptr, void *buf, int len)
+/* writev() may take less than all of it (from a pipe, or with more than 2GB
+ * at once), so it's called again for whatever's left. */
+static int raw_writev(void *fptr, const struct iovec *iov, int iovcnt)
 {
-    int wlen;
     struct raw_data *rd = fptr;
+    int i = 0, wlen, total = 0;
+    size_t done = 0; /* of iov[i] */
+
+    while (i < iovcnt) {
+	if (done)
+	    wlen = write(rd->fd, (char*)iov[i].iov_base + done,
+		    iov[i].iov_len - done);
+	else
+	    wlen = writev(rd->fd, iov + i, iovcnt - i);
+	if (wlen == -1 && errno == EINTR)
+	    continue;
+	if (wlen <= 0)
+	    return total ? total : wlen;
+	total += wlen;
+	rd->offset += wlen;
+	done += wlen;
+	while (i < iovcnt && done >= iov[i].iov_len)
+	    done -= iov[i++].iov_len;
+    }
 
-    wlen = write(rd->fd, buf, len);
-    return wlen;
+    return total;
+}
+
+static int raw_write(void *fptr, void *buf, int len)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return raw_writev(fptr, &iov, 1);
 }
 
 static long raw_ftell(void *fptr)
@@ -82,13 +110,33 @@ static void raw_dup2(void *fptr, int newfd)
     rd->fd = newfd;
 }
 
+/* Everything's stored as is, so where it is in the file is easily found */
+static long raw_file_offset(void *fptr, int *fd)
+{
+    struct raw_data *rd = fptr;
+
+    *fd = rd->fd;
+    return lseek(rd->fd, 0, SEEK_CUR);
+}
+
+static void raw_skip(void *fptr, long len)
+{
+    struct raw_data *rd = fptr;
+
+    syscall_check(lseek(rd->fd, len, SEEK_CUR), 0, "raw_skip(%ld)", len);
+    rd->offset += len;
+}
+
 struct stream_ops raw_ops = {
     .init = raw_init,
     .read = raw_read,
     .write = raw_write,
+    .writev = raw_writev,
     .finish = raw_finish,
     .ftell = raw_ftell,
     .dup2 = raw_dup2,
+    .file_offset = raw_file_offset,
+    .skip = raw_skip,
 };
 
 declare_writer(raw, raw_ops, "Writes directly to an output file");
@@ -0,0 +1,546 @@
+/*
+ * zlib compression in independent blocks.
+ *
+ * The image is a series of frames:
+ *     ZB_MAGIC, n_blocks, n_blocks * { compressed length, length }, blocks
+ * ending with a frame of no blocks. Each block is a raw deflate stream of its
+ * own, and the index up front says where each one lands, so a whole frame
+ * can be decompressed at once on as many CPUs as we have. Large reads (ie,
+ * VMA data) are decompressed straight into place.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+
+#ifdef COMPILING_STUB
+#define ZB_NO_WRITER
+#else
+#define ZB_NO_READER
+#include "pipeline.h"
+#endif
+
+#define ZB_MAGIC	0x5a424c4b
+#define ZB_BLOCK_LEN	(128 * 1024)
+#define ZB_OUT_LEN	(ZB_BLOCK_LEN + ZB_BLOCK_LEN / 1000 + 64)
+
+/* The stub holds a frame compressed and a frame decompressed. Don't let that
+ * take more than half of its malloc pool. */
+#define ZB_POOL_BLOCKS	((MALLOC_END - MALLOC_START) / (4 * ZB_OUT_LEN))
+#define ZB_FRAME_BLOCKS	\
+    (ZB_POOL_BLOCKS > 16 ? 16 : ZB_POOL_BLOCKS > 1 ? ZB_POOL_BLOCKS : 1)
+
+#define ZB_FRAME_LEN	(ZB_FRAME_BLOCKS * ZB_OUT_LEN)
+
+struct zb_index {
+    unsigned int clen, ulen;
+};
+
+#ifndef ZB_NO_READER
+/* Decompression threads are raw clone()s sharing our memory. Our malloc isn't
+ * thread safe, so each gets its stack and zlib's memory up front. */
+#define ZB_STACK_LEN	(64 * 1024)
+#define ZB_ARENA_LEN	(64 * 1024)
+
+struct zb_job {
+    char *src, *dst;
+    int clen, ulen;
+};
+
+struct zb_worker {
+    z_stream s;
+    char *stack;
+    char *arena;
+    int arena_used;
+    struct zb_job *jobs;
+    int first, stride, n_jobs;
+    int failed;
+};
+#endif
+
+struct zb_data {
+    int fd;
+    int mode;
+    struct zb_index index[ZB_FRAME_BLOCKS];
+    int n_blocks;
+    char *comp; /* a frame's worth of compressed blocks */
+    char *in, *out;
+    int bytesin, bytesout; /* for statistics */
+    int offset;
+#ifndef ZB_NO_WRITER
+    int in_len, comp_len;
+    z_stream s;
+    struct pipeline *pipe;
+#endif
+#ifndef ZB_NO_READER
+    int next_block;
+    int comp_offs[ZB_FRAME_BLOCKS];
+    int out_len, out_used;
+    struct zb_job jobs[ZB_FRAME_BLOCKS];
+    struct zb_worker *workers;
+    int n_workers;
+#endif
+};
+
+#ifndef ZB_NO_WRITER
+static int zb_level()
+{
+    if (compression_level < 0)
+	return Z_DEFAULT_COMPRESSION;
+    if (compression_level > Z_BEST_COMPRESSION)
+	bail("zblock compression level must be at most %d", Z_BEST_COMPRESSION);
+    return compression_level;
+}
+
+static void zb_pipe_compress(void *fptr, void **state, struct pipe_block *b);
+static void zb_pipe_write(void *fptr, struct pipe_block *b);
+#endif
+
+#ifndef ZB_NO_READER
+static voidpf zb_alloc(voidpf opaque, uInt items, uInt size)
+{
+    struct zb_worker *w = opaque;
+    int len = (items * size + 15) & ~15;
+    void *p;
+
+    if (w->arena_used + len > ZB_ARENA_LEN)
+	return Z_NULL;
+    p = w->arena + w->arena_used;
+    w->arena_used += len;
+    return p;
+}
+
+static void zb_free(voidpf opaque, voidpf address)
+{
+}
+
+static void zb_init_workers(struct zb_data *zd)
+{
+    int i;
+
+    zd->n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (zd->n_workers > ZB_FRAME_BLOCKS)
+	zd->n_workers = ZB_FRAME_BLOCKS;
+    if (zd->n_workers < 1)
+	zd->n_workers = 1;
+
+    zd->workers = xmalloc(zd->n_workers * sizeof(struct zb_worker));
+    memset(zd->workers, 0, zd->n_workers * sizeof(struct zb_worker));
+    for (i = 0; i < zd->n_workers; i++) {
+	struct zb_worker *w = &zd->workers[i];
+	w->arena = xmalloc(ZB_ARENA_LEN);
+	/* The first one is us */
+	w->stack = i ? xmalloc(ZB_STACK_LEN) : NULL;
+	w->s.zalloc = zb_alloc;
+	w->s.zfree = zb_free;
+	w->s.opaque = w;
+	if (inflateInit2(&w->s, -MAX_WBITS) != Z_OK)
+	    bail("inflateInit2() failed!");
+    }
+}
+
+static int zb_worker_run(void *arg)
+{
+    struct zb_worker *w = arg;
+    int i;
+
+    for (i = w->first; i < w->n_jobs; i += w->stride) {
+	struct zb_job *j = &w->jobs[i];
+
+	inflateReset(&w->s);
+	w->s.next_in = (Bytef*)j->src;
+	w->s.avail_in = j->clen;
+	w->s.next_out = (Bytef*)j->dst;
+	w->s.avail_out = j->ulen;
+	if (inflate(&w->s, Z_FINISH) != Z_STREAM_END || w->s.avail_out != 0) {
+	    w->failed = 1;
+	    break;
+	}
+    }
+    return 0;
+}
+
+/* Decompress count blocks of the current frame, starting at first, back to
+ * back into dst. */
+static void zb_decode(struct zb_data *zd, int first, int count, char *dst)
+{
+    pid_t pids[ZB_FRAME_BLOCKS];
+    int i, n;
+
+    for (i = 0; i < count; i++) {
+	zd->jobs[i].src = zd->comp + zd->comp_offs[first + i];
+	zd->jobs[i].clen = zd->index[first + i].clen;
+	zd->jobs[i].dst = dst;
+	zd->jobs[i].ulen = zd->index[first + i].ulen;
+	dst += zd->jobs[i].ulen;
+    }
+
+    n = count < zd->n_workers ? count : zd->n_workers;
+    for (i = 0; i < n; i++) {
+	struct zb_worker *w = &zd->workers[i];
+	w->jobs = zd->jobs;
+	w->first = i;
+	w->stride = n;
+	w->n_jobs = count;
+	w->failed = 0;
+    }
+
+    for (i = 1; i < n; i++) {
+	char *sp = zd->workers[i].stack + ZB_STACK_LEN;
+	sp = (char*)((unsigned long)sp & ~15UL);
+	pids[i] = clone(zb_worker_run, sp,
+		CLONE_VM | CLONE_FS | CLONE_FILES | SIGCHLD, &zd->workers[i]);
+	if (pids[i] == -1)
+	    zb_worker_run(&zd->workers[i]); /* Just do it ourselves */
+    }
+
+    zb_worker_run(&zd->workers[0]);
+
+    for (i = 1; i < n; i++) {
+	if (pids[i] == -1)
+	    continue;
+	while (waitpid(pids[i], NULL, 0) == -1 && errno == EINTR)
+	    ;
+    }
+
+    for (i = 0; i < n; i++)
+	if (zd->workers[i].failed)
+	    bail("zlib decompression error in block of frame!");
+}
+
+static void zb_read_in(struct zb_data *zd, void *buf, int len)
+{
+    char *p = buf;
+    int ret;
+
+    while (len > 0) {
+	ret = read(zd->fd, p, len);
+	if (ret < 0)
+	    bail("read(zd->fd, %p, %d) failed: %s", p, len, strerror(errno));
+	if (ret == 0)
+	    bail("read(zd->fd, %p, %d) failed: Short read", p, len);
+	p += ret;
+	len -= ret;
+    }
+}
+
+static void zb_read_frame(struct zb_data *zd)
+{
+    unsigned int hdr[2];
+    int i, comp_len = 0;
+
+    zb_read_in(zd, hdr, sizeof(hdr));
+    if (hdr[0] != ZB_MAGIC)
+	bail("Bad frame magic in image (0x%x)", hdr[0]);
+    if (hdr[1] == 0)
+	bail("Unexpected end of image!");
+    if (hdr[1] > ZB_FRAME_BLOCKS)
+	bail("Too many blocks in frame (%d)", hdr[1]);
+
+    zd->n_blocks = hdr[1];
+    zb_read_in(zd, zd->index, zd->n_blocks * sizeof(struct zb_index));
+    for (i = 0; i < zd->n_blocks; i++) {
+	if (zd->index[i].clen > ZB_OUT_LEN || zd->index[i].ulen > ZB_BLOCK_LEN)
+	    bail("Bad block in frame (%d -> %d bytes)",
+		    zd->index[i].clen, zd->index[i].ulen);
+	zd->comp_offs[i] = comp_len;
+	comp_len += zd->index[i].clen;
+    }
+    zb_read_in(zd, zd->comp, comp_len);
+    zd->next_block = 0;
+}
+#endif
+
+static void *zb_writer_init(int fd, int mode)
+{
+    struct zb_data *zd;
+
+    if (mode == O_RDWR)
+	bail("zblock writer cannot be used for simultaneous reading and writing!");
+
+    zd = xmalloc(sizeof(struct zb_data));
+    memset(zd, 0, sizeof(struct zb_data));
+    zd->fd = fd;
+    zd->mode = mode;
+    zd->comp = xmalloc(ZB_FRAME_LEN);
+
+#ifndef ZB_NO_WRITER
+    if (zd->mode == O_WRONLY && pipeline_threads > 1) {
+	zd->pipe = pipeline_start(ZB_BLOCK_LEN, ZB_OUT_LEN, 0,
+		zb_pipe_compress, zb_pipe_write, zd);
+	zd->in = pipeline_get_block(zd->pipe);
+    } else if (zd->mode == O_WRONLY) {
+	if (deflateInit2(&zd->s, zb_level(), Z_DEFLATED,
+		    -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	    bail("deflateInit2() failed!");
+	zd->in = xmalloc(ZB_BLOCK_LEN);
+	zd->out = xmalloc(ZB_OUT_LEN);
+    }
+#endif
+#ifndef ZB_NO_READER
+    if (zd->mode == O_RDONLY) {
+	zd->out = xmalloc(ZB_FRAME_BLOCKS * ZB_BLOCK_LEN);
+	zb_init_workers(zd);
+    }
+#endif
+
+    return zd;
+}
+
+#ifndef ZB_NO_READER
+static int zb_writer_read(void *fptr, void *buf, int len)
+{
+    struct zb_data *zd = fptr;
+    int rlen, i, n, direct;
+    char *p;
+
+    assert(zd->mode == O_RDONLY);
+    rlen = len;
+    p = buf;
+    while (rlen > 0) {
+	int bytes_ready = zd->out_len - zd->out_used;
+
+	if (bytes_ready > 0) {
+	    int x = rlen > bytes_ready ? bytes_ready : rlen;
+	    memcpy(p, &zd->out[zd->out_used], x);
+	    zd->out_used += x;
+	    p += x;
+	    rlen -= x;
+	    continue;
+	}
+
+	if (zd->next_block == zd->n_blocks)
+	    zb_read_frame(zd);
+
+	/* Whole blocks that fit go straight to the caller */
+	direct = 0;
+	for (i = zd->next_block, n = 0; i < zd->n_blocks; i++) {
+	    if (direct + zd->index[i].ulen > rlen)
+		break;
+	    direct += zd->index[i].ulen;
+	    n++;
+	}
+	if (n > 0) {
+	    zb_decode(zd, zd->next_block, n, p);
+	    zd->next_block += n;
+	    p += direct;
+	    rlen -= direct;
+	    continue;
+	}
+
+	/* Otherwise unpack the rest of the frame for the small reads to come */
+	n = zd->n_blocks - zd->next_block;
+	zb_decode(zd, zd->next_block, n, zd->out);
+	for (i = zd->next_block, zd->out_len = 0; i < zd->n_blocks; i++)
+	    zd->out_len += zd->index[i].ulen;
+	zd->out_used = 0;
+	zd->next_block = zd->n_blocks;
+    }
+
+    zd->offset += len;
+
+    return len;
+}
+#endif
+
+#ifndef ZB_NO_WRITER
+static void zb_write_out(struct zb_data *zd, void *buf, int len)
+{
+    int ret;
+
+    ret = write(zd->fd, buf, len);
+    if (ret < 0)
+	bail("write(zd->fd, %p, %d) failed: %s", buf, len, strerror(errno));
+    if (ret != len)
+	bail("write(zd->fd, %p, %d) failed: Short write", buf, len);
+    zd->bytesout += len;
+}
+
+static void zb_write_frame(struct zb_data *zd)
+{
+    unsigned int hdr[2];
+
+    hdr[0] = ZB_MAGIC;
+    hdr[1] = zd->n_blocks;
+    zb_write_out(zd, hdr, sizeof(hdr));
+    if (!zd->n_blocks)
+	return;
+    zb_write_out(zd, zd->index, zd->n_blocks * sizeof(struct zb_index));
+    zb_write_out(zd, zd->comp, zd->comp_len);
+    zd->n_blocks = 0;
+    zd->comp_len = 0;
+}
+
+static void zb_add_block(struct zb_data *zd, char *out, int clen, int ulen)
+{
+    if (zd->n_blocks == ZB_FRAME_BLOCKS)
+	zb_write_frame(zd);
+    memcpy(zd->comp + zd->comp_len, out, clen);
+    zd->index[zd->n_blocks].clen = clen;
+    zd->index[zd->n_blocks].ulen = ulen;
+    zd->n_blocks++;
+    zd->comp_len += clen;
+}
+
+static int zb_compress(z_stream *s, char *in, int in_len, char *out)
+{
+    deflateReset(s);
+    s->next_in = (Bytef*)in;
+    s->avail_in = in_len;
+    s->next_out = (Bytef*)out;
+    s->avail_out = ZB_OUT_LEN;
+    if (deflate(s, Z_FINISH) != Z_STREAM_END)
+	bail("zlib internal compression error: %s", s->msg);
+    return ZB_OUT_LEN - s->avail_out;
+}
+
+static void zb_pipe_compress(void *fptr, void **state, struct pipe_block *b)
+{
+    z_stream *s = *state;
+
+    if (!b) {
+	if (s) {
+	    deflateEnd(s);
+	    free(s);
+	}
+	return;
+    }
+
+    if (!s) {
+	s = *state = xmalloc(sizeof(z_stream));
+	memset(s, 0, sizeof(z_stream));
+	if (deflateInit2(s, zb_level(), Z_DEFLATED, -MAX_WBITS,
+		    8, Z_DEFAULT_STRATEGY) != Z_OK)
+	    bail("deflateInit2() failed!");
+    }
+    b->out_len = zb_compress(s, b->in, b->in_len, b->out);
+}
+
+static void zb_pipe_write(void *fptr, struct pipe_block *b)
+{
+    zb_add_block(fptr, b->out, b->out_len, b->in_len);
+}
+
+static void zb_flush_block(struct zb_data *zd)
+{
+    if (zd->pipe) {
+	pipeline_submit(zd->pipe, zd->in_len, 0);
+	zd->in = pipeline_get_block(zd->pipe);
+    } else
+	zb_add_block(zd, zd->out, zb_compress(&zd->s, zd->in, zd->in_len,
+		    zd->out), zd->in_len);
+    zd->in_len = 0;
+}
+
+static int zb_writer_write(void *fptr, void *buf, int len)
+{
+    struct zb_data *zd = fptr;
+    int wlen;
+    char *p;
+
+    assert(zd->mode == O_WRONLY);
+    wlen = len;
+    zd->bytesin += wlen;
+
+    p = buf;
+    while (wlen > 0) {
+	int x;
+	int space_remaining = ZB_BLOCK_LEN - zd->in_len;
+	if (wlen > space_remaining)
+	    x = space_remaining;
+	else
+	    x = wlen;
+	memcpy(&zd->in[zd->in_len], p, x);
+	zd->in_len += x;
+	p += x;
+	wlen -= x;
+	if (zd->in_len == ZB_BLOCK_LEN)
+	    zb_flush_block(zd);
+    }
+
+    return len;
+}
+#endif
+
+static void zb_writer_finish(void *fptr)
+{
+    struct zb_data *zd = fptr;
+
+#ifndef ZB_NO_WRITER
+    if (zd->mode == O_WRONLY) {
+	if (zd->in_len > 0)
+	    zb_flush_block(zd);
+	if (zd->pipe) {
+	    pipeline_finish(zd->pipe); /* also frees zd->in */
+	    zd->in = NULL;
+	} else
+	    deflateEnd(&zd->s);
+	if (zd->n_blocks)
+	    zb_write_frame(zd);
+	zb_write_frame(zd); /* the empty one, to end the image */
+
+	fprintf(stderr, "Compressed %d bytes into %d bytes",
+		zd->bytesin, zd->bytesout);
+	if (zd->bytesin)
+	    fprintf(stderr, " (%d%% compression)", 100 - (100 * zd->bytesout / zd->bytesin));
+	fprintf(stderr, "\n");
+    }
+#endif
+
+    free(zd->comp);
+    free(zd->out);
+    free(zd->in);
+    close(zd->fd);
+    free(zd);
+}
+
+#ifndef ZB_NO_READER
+static long zb_writer_ftell(void *fptr)
+{
+    struct zb_data *zd = fptr;
+    return zd->offset;
+}
+
+static void zb_writer_dup2(void *fptr, int newfd)
+{
+    struct zb_data *zd = fptr;
+
+    if (newfd == zd->fd)
+	return;
+
+    syscall_check(dup2(zd->fd, newfd), 0, "zblock_dup2(%d, %d)", zd->fd, newfd);
+
+    close(zd->fd);
+    zd->fd = newfd;
+}
+#endif
+
+struct stream_ops zblock_ops = {
+    .init = zb_writer_init,
+#ifndef ZB_NO_READER
+    .read = zb_writer_read,
+#endif
+#ifndef ZB_NO_WRITER
+    .write = zb_writer_write,
+#endif
+    .finish = zb_writer_finish,
+#ifndef ZB_NO_READER
+    .ftell = zb_writer_ftell,
+    .dup2 = zb_writer_dup2,
+#endif
+};
+
+declare_writer(zblock, zblock_ops, "Compresses output with zlib in independent blocks, which are decompressed in parallel");
+
+/* vim:set ts=8 sw=4 noet: */
@@ -0,0 +1,252 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+
+#ifdef COMPILING_STUB
+#define ZSTD_NO_WRITER
+#else
+#define ZSTD_NO_READER
+#include "pipeline.h"
+#endif
+
+/* Long distance matching is only as good as the window is long, but the stub
+ * has to hold all of it in its malloc pool. Take up to half of the pool. */
+#define MALLOC_POOL_LEN	(MALLOC_END - MALLOC_START)
+#if MALLOC_POOL_LEN >= (256L << 20)
+#define ZSTD_WINDOW_LOG	27
+#elif MALLOC_POOL_LEN >= (64L << 20)
+#define ZSTD_WINDOW_LOG	25
+#elif MALLOC_POOL_LEN >= (16L << 20)
+#define ZSTD_WINDOW_LOG	23
+#elif MALLOC_POOL_LEN >= (4L << 20)
+#define ZSTD_WINDOW_LOG	21
+#else
+#define ZSTD_WINDOW_LOG	19
+#endif
+
+struct zstd_data {
+    int fd;
+    int mode;
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    char *buf;		/* compressed data on its way to/from the file */
+    int buf_size;
+    ZSTD_inBuffer in;	/* reading: what's left of buf */
+    int bytesin, bytesout; /* for statistics */
+    int offset;
+};
+
+static void zstd_check(size_t ret, char *what)
+{
+    if (ZSTD_isError(ret))
+	bail("%s failed: %s", what, ZSTD_getErrorName(ret));
+}
+
+static void *zstd_writer_init(int fd, int mode)
+{
+    struct zstd_data *zd;
+
+    if (mode == O_RDWR)
+	bail("zstd writer cannot be used for simultaneous reading and writing!");
+
+    zd = xmalloc(sizeof(struct zstd_data));
+    memset(zd, 0, sizeof(struct zstd_data));
+    zd->fd = fd;
+    zd->mode = mode;
+
+#ifndef ZSTD_NO_WRITER
+    if (zd->mode == O_WRONLY) {
+	int level = compression_level;
+
+	if (level < 0)
+	    level = ZSTD_CLEVEL_DEFAULT;
+	if (level > ZSTD_maxCLevel())
+	    bail("zstd compression level must be at most %d", ZSTD_maxCLevel());
+
+	if (!(zd->cctx = ZSTD_createCCtx()))
+	    bail("ZSTD_createCCtx() failed!");
+	zstd_check(ZSTD_CCtx_setParameter(zd->cctx, ZSTD_c_compressionLevel,
+		    level), "Setting compression level");
+	zstd_check(ZSTD_CCtx_setParameter(zd->cctx, ZSTD_c_windowLog,
+		    ZSTD_WINDOW_LOG), "Setting window size");
+	zstd_check(ZSTD_CCtx_setParameter(zd->cctx,
+		    ZSTD_c_enableLongDistanceMatching, 1),
+		"Enabling long distance matching");
+	/* zstd has its own worker threads, and is better at using them on
+	 * one stream than our pipeline would be */
+	if (pipeline_threads > 1)
+	    zstd_check(ZSTD_CCtx_setParameter(zd->cctx, ZSTD_c_nbWorkers,
+			pipeline_threads), "Setting worker threads");
+
+	zd->buf_size = ZSTD_CStreamOutSize();
+    }
+#endif
+#ifndef ZSTD_NO_READER
+    if (zd->mode == O_RDONLY) {
+	/* The stub's free() gives nothing back, and the window is a good part
+	 * of its pool, so parent images share the one context. */
+	static ZSTD_DCtx *dctx;
+
+	if (!dctx) {
+	    if (!(dctx = ZSTD_createDCtx()))
+		bail("ZSTD_createDCtx() failed!");
+	    zstd_check(ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax,
+			ZSTD_WINDOW_LOG), "Setting window size");
+	} else
+	    zstd_check(ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only),
+		    "Resetting decompression context");
+	zd->dctx = dctx;
+	zd->buf_size = ZSTD_DStreamInSize();
+    }
+#endif
+
+    zd->buf = xmalloc(zd->buf_size);
+
+    return zd;
+}
+
+#ifndef ZSTD_NO_READER
+static int zstd_writer_read(void *fptr, void *buf, int len)
+{
+    struct zstd_data *zd = fptr;
+    ZSTD_outBuffer out = { buf, len, 0 };
+
+    assert(zd->mode == O_RDONLY);
+
+    /* Decompress straight into the caller's buffer */
+    while (out.pos < out.size) {
+	if (zd->in.pos == zd->in.size) {
+	    int ret = read(zd->fd, zd->buf, zd->buf_size);
+	    if (ret < 0)
+		bail("read(zd->fd, %p, %d) failed: %s", zd->buf, zd->buf_size,
+			strerror(errno));
+	    if (ret == 0)
+		bail("Unexpected end of compressed image!");
+	    zd->in.src = zd->buf;
+	    zd->in.size = ret;
+	    zd->in.pos = 0;
+	}
+	zstd_check(ZSTD_decompressStream(zd->dctx, &out, &zd->in),
+		"zstd decompression");
+    }
+
+    zd->offset += len;
+
+    return len;
+}
+#endif
+
+#ifndef ZSTD_NO_WRITER
+static void zstd_write_out(struct zstd_data *zd, ZSTD_outBuffer *out)
+{
+    int ret;
+
+    if (out->pos == 0)
+	return;
+
+    ret = write(zd->fd, out->dst, out->pos);
+    if (ret < 0)
+	bail("write(zd->fd, %p, %ld) failed: %s",
+		out->dst, (long)out->pos, strerror(errno));
+    if (ret != out->pos)
+	bail("write(zd->fd, %p, %ld) failed: Short write",
+		out->dst, (long)out->pos);
+
+    zd->bytesout += out->pos;
+    out->pos = 0;
+}
+
+static int zstd_writer_write(void *fptr, void *buf, int len)
+{
+    struct zstd_data *zd = fptr;
+    ZSTD_inBuffer in = { buf, len, 0 };
+    ZSTD_outBuffer out = { zd->buf, zd->buf_size, 0 };
+
+    assert(zd->mode == O_WRONLY);
+    zd->bytesin += len;
+
+    while (in.pos < in.size) {
+	zstd_check(ZSTD_compressStream2(zd->cctx, &out, &in, ZSTD_e_continue),
+		"zstd compression");
+	zstd_write_out(zd, &out);
+    }
+
+    return len;
+}
+#endif
+
+static void zstd_writer_finish(void *fptr)
+{
+    struct zstd_data *zd = fptr;
+
+#ifndef ZSTD_NO_WRITER
+    if (zd->mode == O_WRONLY) {
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+	ZSTD_outBuffer out = { zd->buf, zd->buf_size, 0 };
+	size_t remaining;
+
+	do {
+	    remaining = ZSTD_compressStream2(zd->cctx, &out, &in, ZSTD_e_end);
+	    zstd_check(remaining, "zstd compression");
+	    zstd_write_out(zd, &out);
+	} while (remaining);
+	ZSTD_freeCCtx(zd->cctx);
+
+	fprintf(stderr, "Compressed %d bytes into %d bytes",
+		zd->bytesin, zd->bytesout);
+	if (zd->bytesin)
+	    fprintf(stderr, " (%d%% compression)", 100 - (100 * zd->bytesout / zd->bytesin));
+	fprintf(stderr, "\n");
+    }
+#endif
+    free(zd->buf);
+    close(zd->fd);
+    free(zd);
+}
+
+#ifndef ZSTD_NO_READER
+static long zstd_writer_ftell(void *fptr)
+{
+    struct zstd_data *zd = fptr;
+    return zd->offset;
+}
+
+static void zstd_writer_dup2(void *fptr, int newfd)
+{
+    struct zstd_data *zd = fptr;
+
+    if (newfd == zd->fd)
+	return;
+
+    syscall_check(dup2(zd->fd, newfd), 0, "zstd_dup2(%d, %d)", zd->fd, newfd);
+
+    close(zd->fd);
+    zd->fd = newfd;
+}
+#endif
+
+struct stream_ops zstd_ops = {
+    .init = zstd_writer_init,
+#ifndef ZSTD_NO_READER
+    .read = zstd_writer_read,
+#endif
+#ifndef ZSTD_NO_WRITER
+    .write = zstd_writer_write,
+#endif
+    .finish = zstd_writer_finish,
+#ifndef ZSTD_NO_READER
+    .ftell = zstd_writer_ftell,
+    .dup2 = zstd_writer_dup2,
+#endif
+};
+
+declare_writer(zstd, zstd_ops, "Compresses output using zstd, with long distance matching");
+
+/* vim:set ts=8 sw=4 noet: */
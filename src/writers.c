@@ -0,0 +1,186 @@
+/*
+ * The writers built into cryopid. Each one comes with the stub that reads
+ * its output back in, so picking a writer picks the stub too.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "cryopid.h"
+#include "cpimage.h"
+#include "pipeline.h"
+
+#ifdef USE_WRITER_raw
+extern struct writer_info writer_raw;
+#endif
+#ifdef USE_WRITER_buffered
+extern struct writer_info writer_buffered;
+#endif
+#ifdef USE_WRITER_gzip
+extern struct writer_info writer_gzip;
+#endif
+#ifdef USE_WRITER_lzo
+extern struct writer_info writer_lzo;
+#endif
+#ifdef USE_WRITER_zblock
+extern struct writer_info writer_zblock;
+#endif
+#ifdef USE_WRITER_zstd
+extern struct writer_info writer_zstd;
+#endif
+
+static struct writer_info *writers[] = {
+#ifdef USE_WRITER_raw
+    &writer_raw,
+#endif
+#ifdef USE_WRITER_buffered
+    &writer_buffered,
+#endif
+#ifdef USE_WRITER_gzip
+    &writer_gzip,
+#endif
+#ifdef USE_WRITER_lzo
+    &writer_lzo,
+#endif
+#ifdef USE_WRITER_zblock
+    &writer_zblock,
+#endif
+#ifdef USE_WRITER_zstd
+    &writer_zstd,
+#endif
+    NULL,
+};
+
+struct stream_ops *stream_ops;
+char *stub_start;
+long stub_size;
+
+static struct writer_info *find_writer(char *name)
+{
+    struct writer_info **w;
+
+    for (w = writers; *w; w++)
+	if (strcmp((*w)->name, name) == 0)
+	    return *w;
+    return NULL;
+}
+
+/* Selects the writer, and the stub to go with it. Returns 0 if there's no
+ * such writer. NULL picks the default. */
+int set_writer(char *name)
+{
+    struct writer_info *w;
+
+    if (!name)
+	name = DEFAULT_WRITER;
+
+    w = find_writer(name);
+    if (!w)
+	return 0;
+
+    stream_ops = w->ops;
+    stub_start = w->stub_start;
+    stub_size = w->stub_size;
+    return 1;
+}
+
+/* Something that looks vaguely like process memory: some zero pages, some
+ * incompressible pages and a lot of repetitive ones. */
+#define BENCH_CHUNK	(128*1024)
+#define BENCH_LEN	(32*1024*1024)
+
+static void fill_sample(char *buf, int len)
+{
+    int page = _getpagesize;
+    int i, j;
+
+    srand(1);
+    for (i = 0; i < len; i += page) {
+	char *p = buf + i;
+	switch ((i / page) % 4) {
+	    case 0:
+		memset(p, 0, page);
+		break;
+	    case 1:
+		for (j = 0; j < page; j++)
+		    p[j] = rand();
+		break;
+	    default:
+		for (j = 0; j < page; j += 32)
+		    snprintf(p + j, 32, "%08x:%-22d", (i + j) & 0xfff0,
+			    rand() % 1000);
+		break;
+	}
+    }
+}
+
+/* Pushes BENCH_LEN bytes through the writer into a scratch file. Returns
+ * the time taken, and the size of the output in out_len. */
+static long long bench_writer(struct writer_info *w, char *sample, long *out_len)
+{
+    char tmpl[] = "/tmp/cryopid-bench-XXXXXX";
+    long long t;
+    void *fp;
+    int fd, err, null, i;
+
+    fd = mkstemp(tmpl);
+    if (fd == -1)
+	bail("mkstemp(%s) failed: %s", tmpl, strerror(errno));
+    unlink(tmpl);
+
+    /* Writers report their compression ratio on stderr; keep them quiet */
+    err = dup(2);
+    null = syscall_check(open("/dev/null", O_WRONLY), 0, "open(/dev/null)");
+    dup2(null, 2);
+    close(null);
+
+    t = now_usecs();
+    fp = w->ops->init(dup(fd), O_WRONLY);
+    for (i = 0; i < BENCH_LEN; i += BENCH_CHUNK)
+	w->ops->write(fp, sample + (i % (BENCH_LEN / 4)), BENCH_CHUNK);
+    w->ops->finish(fp);
+    t = now_usecs() - t;
+
+    dup2(err, 2);
+    close(err);
+
+    *out_len = lseek(fd, 0, SEEK_END);
+    close(fd);
+
+    return t;
+}
+
+/* Lists the writers, with how fast each one runs on this host. */
+void list_writers()
+{
+    struct writer_info **w;
+    char *sample;
+
+    sample = xmalloc(BENCH_LEN / 4);
+    fill_sample(sample, BENCH_LEN / 4);
+
+    fprintf(stderr, "Available writers (measured on %d MB of sample data, %d thread%s):\n\n",
+	    BENCH_LEN >> 20, pipeline_threads, pipeline_threads == 1 ? "" : "s");
+    for (w = writers; *w; w++) {
+	long long t;
+	long out_len;
+
+	t = bench_writer(*w, sample, &out_len);
+	if (t == 0)
+	    t = 1;
+	fprintf(stderr, "    %-9s %8.1f MB/s %5.1f%% of input %s\n",
+		(*w)->name, (BENCH_LEN / 1048576.0) / (t / 1000000.0),
+		100.0 * out_len / BENCH_LEN,
+		strcmp((*w)->name, DEFAULT_WRITER) == 0 ? "(default)" : "");
+	fprintf(stderr, "              %s\n", (*w)->desc);
+    }
+    fprintf(stderr, "\n");
+
+    free(sample);
+}
+
+/* vim:set ts=8 sw=4 noet: */
@@ -0,0 +1,63 @@
+/* Does lazy restore page memory back in right? Checkpoint this with an
+ * uncompressed writer (-w raw) and resume the image with -l. It checks its
+ * memory a slice at a time, so most of it is still in the image once it's
+ * running again, and it should carry on with no mismatches. Slices that take
+ * longer the first time round were paged in as they were touched. Every
+ * eighth slice was dropped, and has to come back as zeros. */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define MEGS	256
+#define SLICE	(4 << 20)
+
+static unsigned long pattern(unsigned long i) {
+	return i * 2654435761UL + 1;
+}
+
+static long usecs() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+int main() {
+	unsigned long per = SLICE / sizeof(long), n = (MEGS << 20) / sizeof(long);
+	unsigned long *mem, i, s, bad;
+	long t;
+	int pass;
+
+	mem = mmap(NULL, MEGS << 20, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	for (i = 0; i < n; i++)
+		mem[i] = pattern(i);
+	for (s = 0; s < n; s += 8 * per)
+		madvise(mem + s, SLICE, MADV_DONTNEED);
+
+	printf("Pid %d. Checking %d MB, %d MB at a time.\n", getpid(), MEGS,
+			SLICE >> 20);
+	for (pass = 1;; pass++) {
+		for (s = 0; s < n; s += per) {
+			t = usecs();
+			bad = 0;
+			for (i = s; i < s + per; i++)
+				if (mem[i] != (s % (8 * per) ? pattern(i) : 0))
+					bad++;
+			t = usecs() - t;
+			printf("Pass %d, slice %lu: %s in %ld us\n", pass, s / per,
+					bad ? "MISMATCH" : "ok", t);
+			if (bad)
+				printf("%lu words wrong in the slice at %p\n", bad,
+						mem + s);
+			fflush(stdout);
+			usleep(250000);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+/* Does memory left with the page server come back right? Checkpoint this
+ * with -S <socket> (and -k), and run the image while cryopid is still waiting
+ * to serve it. Its heap and a big anonymous map are left behind, with holes
+ * that have to come back as zeros, and it should carry on counting with no
+ * mismatches. Each round also writes to some of it, so pages fetched from
+ * the server have to stay writable. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MEGS	64
+#define BLOCKS	1000
+#define BLOCK	1000
+
+static unsigned long pattern(unsigned long i, int round) {
+	return (i + round) * 2654435761UL + 1;
+}
+
+int main() {
+	unsigned long n = (MEGS << 20) / sizeof(long), page = getpagesize();
+	unsigned long *mem, i, bad;
+	unsigned int *blocks[BLOCKS];
+	int round, b, j;
+
+	/* A big map, with every other megabyte dropped again */
+	mem = mmap(NULL, MEGS << 20, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	for (i = 0; i < n; i++)
+		mem[i] = pattern(i, 0);
+	for (i = 1; i < MEGS; i += 2)
+		madvise((char*)mem + (i << 20), 1 << 20, MADV_DONTNEED);
+
+	/* And small blocks all over the heap */
+	for (b = 0; b < BLOCKS; b++) {
+		blocks[b] = malloc(BLOCK * sizeof(int));
+		for (j = 0; j < BLOCK; j++)
+			blocks[b][j] = b * BLOCK + j;
+	}
+
+	printf("Pid %d.\n", getpid());
+	for (round = 0;; round++) {
+		bad = 0;
+		for (i = 0; i < n; i++) {
+			unsigned long want = 0;
+
+			if (!((i * sizeof(long) >> 20) & 1))
+				want = pattern(i, (i * sizeof(long) / page) % 16 ? 0 : round);
+			if (mem[i] != want)
+				bad++;
+		}
+		for (b = 0; b < BLOCKS; b++)
+			for (j = 0; j < BLOCK; j++)
+				if (blocks[b][j] != b * BLOCK + j)
+					bad++;
+		printf("Round %d: %s\n", round, bad ? "MISMATCH" : "ok");
+		if (bad)
+			printf("%lu words wrong\n", bad);
+		fflush(stdout);
+
+		/* Every sixteenth page of the saved part moves on a round */
+		for (i = 0; i < n; i += 16 * page / sizeof(long)) {
+			unsigned long k;
+
+			if ((i * sizeof(long) >> 20) & 1)
+				continue;
+			for (k = i; k < i + page / sizeof(long); k++)
+				mem[k] = pattern(k, round + 1);
+		}
+		sleep(1);
+	}
+	return 0;
+}
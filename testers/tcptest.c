@@ -0,0 +1,52 @@
+/* Do TCP connections survive? Checkpoint the client (with -k), resume it,
+ * and it should carry on counting over the same connection. */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+int main() {
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	char buf[64];
+	int l, s, n, i;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	l = socket(PF_INET, SOCK_STREAM, 0);
+	if (bind(l, (struct sockaddr*)&sin, sizeof(sin)) < 0 || listen(l, 1) < 0) {
+		perror("server");
+		return 1;
+	}
+	getsockname(l, (struct sockaddr*)&sin, &len);
+
+	if (fork() == 0) {
+		close(l);
+		s = socket(PF_INET, SOCK_STREAM, 0);
+		if (connect(s, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+			perror("client");
+			return 1;
+		}
+		printf("Client is pid %d.\n", getpid());
+		for (i = 0;; i++) {
+			n = snprintf(buf, sizeof(buf), "%d", i);
+			write(s, buf, n);
+			if ((n = read(s, buf, sizeof(buf))) <= 0)
+				break;
+			printf("Client got back %.*s\n", n, buf);
+			sleep(1);
+		}
+		printf("Client lost the connection.\n");
+		return 1;
+	}
+
+	/* Echo it all back */
+	s = accept(l, NULL, NULL);
+	while ((n = read(s, buf, sizeof(buf))) > 0)
+		write(s, buf, n);
+	printf("Server lost the connection.\n");
+	return 0;
+}